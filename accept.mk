@@ -26,6 +26,11 @@ RTDIR := $(ACCEPTDIR)/rt
 ARCH ?= default
 RTLIB ?= $(RTDIR)/acceptrt.$(ARCH).bc
 EXTRABC += $(RTLIB)
+ifeq ($(ARCH),default)
+	# The host runtime's relaxed synchronization support uses threads, and
+	# its software NPU uses libm.
+	LIBS += -lpthread -lm
+endif
 
 # Host platform specifics.
 ifeq ($(shell uname -s),Darwin)
@@ -116,7 +121,8 @@ $(BUILD_TARGETS): build_%: setup $(EXTRADEPS) $(TARGET).%
 
 # Make the ACCEPT runtime library for the target architecture.
 $(RTLIB):
-	make -C $(RTDIR) acceptrt.$(ARCH).bc CC="$(CC)" CFLAGS="$(CFLAGS)"
+	make -C $(RTDIR) acceptrt.$(ARCH).bc CC="$(CC)" CFLAGS="$(CFLAGS)" \
+		LLVMLINK="$(LLVMLINK)"
 
 # Link component bitcode files into a single file.
 $(LINKEDBC): $(BCFILES) $(EXTRABC)
@@ -146,7 +152,7 @@ $(TARGET).%: $(TARGET).%.s
 clean:
 	$(RM) $(TARGET) $(TARGET).s $(BCFILES) $(LLFILES) $(LINKEDBC) \
 	accept-globals-info.txt accept_config.txt accept_config_desc.txt \
-	accept_log.txt accept_time.txt \
+	accept_log.txt accept_time.txt accept_syncprof.txt \
 	$(CONFIGS:%=$(TARGET).%.bc) $(CONFIGS:%=$(TARGET).%) \
 	accept-approxRetValueFunctions-info.txt accept-npuArrayArgs-info.txt \
 	$(CLEANMETOO)
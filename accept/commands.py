@@ -155,8 +155,18 @@ def dump_results_json(results):
 
 OPT_KINDS = {
     'loopperf': ('loop',),
-    'desync':   ('lock', 'barrier'),
-    'npu':      ('npu_region',),
+    'desync':   ('lock', 'barrier', 'quorum', 'reduction'),
+    'npu':      ('npu_region', 'npu_depth'),
+    'memo':     ('memo',),
+    'lut':      ('lut',),
+    'fastmath': ('fastmath',),
+    'arith':    ('arith',),
+    'demote':   ('demote',),
+    'narrow':   ('narrow',),
+    'fixed':    ('fixed',),
+    'compress': ('compress',),
+    'alias':    ('alias',),
+    'parallel': ('parallel',),
 }
 
 
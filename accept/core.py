@@ -22,6 +22,7 @@ import math
 
 EVALSCRIPT = 'eval.py'
 CONFIGFILE = 'accept_config.txt'
+SYNCPROF_FILE = 'accept_syncprof.txt'
 BASEDIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
 OUTPUTS_DIR = os.path.join(BASEDIR, 'saved_outputs')
 MAX_ERROR = 0.3
@@ -30,9 +31,21 @@ MAX_GENERATIONS = 10  # How aggressively to apply each optimization.
 PARAM_MAX = {
     'loop': 10,
     'lock': 1,
-    'barrier': 1,
+    'barrier': 7,
+    'quorum': 4,
+    'reduction': 8,
     'alias': 1,
     'npu_region': 1,
+    'npu_depth': 8,
+    'memo': 10,
+    'lut': 10,
+    'fastmath': 3,
+    'arith': 3,
+    'demote': 1,
+    'narrow': 2,
+    'fixed': 7,
+    'compress': 3,
+    'parallel': 5,
 }
 EPSILON_ERROR = 0.001
 EPSILON_SPEEDUP = 0.01
@@ -248,6 +261,49 @@ def dump_relax_config(config, f):
         f.write('{} {}\n'.format(param, ident))
 
 
+# Synchronization contention profiles.
+
+def parse_sync_profile(f):
+    """Parse a contention profile written by the runtime's
+    synchronization profiler (build with `-accept-syncprof`). Return a
+    dictionary mapping site idents to the total time (in seconds)
+    threads spent waiting for and holding the site.
+    """
+    out = {}
+    for line in f:
+        line = line.rstrip('\n')
+        if line:
+            fields = line.split('\t')
+            ident, wait, hold = fields[0], float(fields[2]), float(fields[3])
+            out[ident] = wait + hold
+    return out
+
+
+def _sync_profile_ident(ident):
+    """Get the profiled site corresponding to a configuration ident.
+    Quorum barriers and privatized reductions are alternate relaxations
+    of a barrier or a lock site.
+    """
+    if ident.startswith('quorum barrier '):
+        return ident[len('quorum '):]
+    elif ident.startswith('reduction '):
+        return 'lock acquire ' + ident[len('reduction '):]
+    return ident
+
+
+def order_by_contention(configs, profile):
+    """Sort base configurations so those enabling the most contended
+    synchronization sites come first. Other configurations keep their
+    order after them.
+    """
+    def contention(config):
+        for ident, param in config:
+            if param:
+                return profile.get(_sync_profile_ident(ident), 0.0)
+        return 0.0
+    return sorted(configs, key=contention, reverse=True)
+
+
 # Loading the evaluation script.
 
 def load_eval_funcs(appdir):
@@ -786,6 +842,15 @@ class Evaluation(object):
             self.base_config = pex.config
             self.base_configs = list(permute_config(self.base_config))
 
+            # Start from the most contended synchronization if the user
+            # has profiled it.
+            profile_fn = os.path.join(self.appdir, SYNCPROF_FILE)
+            if os.path.exists(profile_fn):
+                with open(profile_fn) as f:
+                    profile = parse_sync_profile(f)
+                self.base_configs = order_by_contention(self.base_configs,
+                                                        profile)
+
     def precise_times(self, test=False):
         """Generate the durations for the precise executions. Must be
         called after `setup`.
@@ -0,0 +1,44 @@
+"""Generate a synthetic C module with many functions over heap-allocated
+approximate arrays, for measuring the cost of AcceptAA queries from GVN and
+LICM.
+"""
+from __future__ import print_function
+import sys
+
+HEADER = """#include <stdlib.h>
+#include <enerc.h>
+
+APPROX float table[256];
+"""
+
+
+def gen(funcs):
+    print(HEADER)
+    for i in range(funcs):
+        print('float kernel{}(int n, float *in) {{'.format(i))
+        print('  APPROX float *a = (float *)malloc(n * sizeof(float));')
+        print('  APPROX float *b = (float *)malloc(n * sizeof(float));')
+        print('  float *c = (float *)malloc(n * sizeof(float));')
+        print('  APPROX float sum = 0.0f;')
+        print('  float total = 0.0f;')
+        print('  for (int i = 0; i < n; ++i) {')
+        print('    a[i] = in[i] * {}.0f;'.format(i % 7 + 1))
+        print('    b[i] = a[i] + table[i & 255];')
+        print('    c[i] = in[i] + {}.0f;'.format(i % 5))
+        print('  }')
+        print('  for (int i = 1; i < n; ++i) {')
+        print('    b[i] += a[i - 1] * b[i - 1];')
+        print('    table[i & 255] += b[i];')
+        print('    sum += a[i] + b[i] + table[(i + {}) & 255];'.format(i))
+        print('    total += c[i];')
+        print('  }')
+        print('  free(a);')
+        print('  free(b);')
+        print('  free(c);')
+        print('  return ENDORSE(sum) + total;')
+        print('}')
+        print()
+
+
+if __name__ == '__main__':
+    gen(int(sys.argv[1]) if len(sys.argv) > 1 else 100)
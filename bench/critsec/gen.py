@@ -0,0 +1,36 @@
+"""Generate a synthetic C function with many lock/unlock pairs for
+measuring how the desync optimization's analysis scales.
+"""
+from __future__ import print_function
+import sys
+
+HEADER = """#include <pthread.h>
+#include <enerc.h>
+
+pthread_mutex_t locks[16];
+APPROX int counters[16];
+"""
+
+
+def gen(pairs):
+    print(HEADER)
+    print('void work(int n) {')
+    for i in range(pairs):
+        lock = i % 16
+        # Alternate straight-line and branchy sections so the CFG isn't
+        # trivially a single block.
+        if i % 2:
+            print('  if (n > {}) {{'.format(i))
+            print('    pthread_mutex_lock(&locks[{}]);'.format(lock))
+            print('    counters[{}] += n;'.format(lock))
+            print('    pthread_mutex_unlock(&locks[{}]);'.format(lock))
+            print('  }')
+        else:
+            print('  pthread_mutex_lock(&locks[{}]);'.format(lock))
+            print('  counters[{}] += {};'.format(lock, i))
+            print('  pthread_mutex_unlock(&locks[{}]);'.format(lock))
+    print('}')
+
+
+if __name__ == '__main__':
+    gen(int(sys.argv[1]) if len(sys.argv) > 1 else 100)
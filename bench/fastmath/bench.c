@@ -0,0 +1,106 @@
+// Throughput and accuracy of the fast libm replacements in rt/fastmath.c.
+// For each function, time libm and each precision level over the same
+// inputs, and report the worst and mean errors against libm. Errors are
+// relative, except for sin, cos, and log, whose results cross zero, where
+// they are absolute.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Include the runtime directly. Its functions are always inlined, as in a
+// linked ACCEPT program, even with -fno-inline.
+#include "fastmath.c"
+
+#define N 4096
+#define REPS 2000
+
+static double xs[N], ys[N], out[N], ref[N];
+
+// One kernel per function and level, each applying expr to every input.
+#define KERNELS(name, precise, fast) \
+    static void name##_0(void) { KERNEL(precise, 0) } \
+    static void name##_1(void) { KERNEL(fast, 1) } \
+    static void name##_2(void) { KERNEL(fast, 2) } \
+    static void name##_3(void) { KERNEL(fast, 3) } \
+    static void (*name##_kernels[])(void) = { \
+        name##_0, name##_1, name##_2, name##_3 \
+    };
+#define KERNEL(expr, lvl) \
+    enum { level = lvl }; \
+    int i; \
+    for (i = 0; i < N; ++i) { \
+        double x = xs[i], y = ys[i]; \
+        (void)y; \
+        out[i] = (expr); \
+    }
+
+KERNELS(sin, sin(x), accept_fast_sin(x, level))
+KERNELS(cos, cos(x), accept_fast_cos(x, level))
+KERNELS(exp, exp(x), accept_fast_exp(x, level))
+KERNELS(log, log(x), accept_fast_log(x, level))
+KERNELS(sqrt, sqrt(x), accept_fast_sqrt(x, level))
+KERNELS(pow, pow(x, y), accept_fast_pow(x, y, level))
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs a kernel REPS times. Returns ns per call.
+static double run(void (*kernel)(void)) {
+    double start = now();
+    int rep;
+    for (rep = 0; rep < REPS; ++rep)
+        kernel();
+    return (now() - start) * 1e9 / ((double)REPS * N);
+}
+
+static void inputs(double lo, double hi, double ylo, double yhi) {
+    int i;
+    srand(1);
+    for (i = 0; i < N; ++i) {
+        xs[i] = lo + (hi - lo) * rand() / RAND_MAX;
+        ys[i] = ylo + (yhi - ylo) * rand() / RAND_MAX;
+    }
+}
+
+static void bench(const char *name, void (**kernels)(void), int absolute) {
+    int level, i;
+
+    printf("%-5s libm     %6.2f ns\n", name, run(kernels[0]));
+    for (i = 0; i < N; ++i)
+        ref[i] = out[i];
+
+    for (level = 1; level <= 3; ++level) {
+        double ns = run(kernels[level]);
+        double worst = 0.0, total = 0.0;
+        for (i = 0; i < N; ++i) {
+            double err = fabs(out[i] - ref[i]);
+            if (!absolute && ref[i] != 0.0)
+                err /= fabs(ref[i]);
+            if (err > worst)
+                worst = err;
+            total += err;
+        }
+        printf("%-5s level %d  %6.2f ns  max err %8.2e  mean err %8.2e\n",
+               name, level, ns, worst, total / N);
+    }
+}
+
+int main(void) {
+    inputs(-10.0, 10.0, 0.0, 0.0);
+    bench("sin", sin_kernels, 1);
+    bench("cos", cos_kernels, 1);
+    bench("exp", exp_kernels, 0);
+
+    inputs(1e-3, 1e3, 0.0, 0.0);
+    bench("log", log_kernels, 1);
+    bench("sqrt", sqrt_kernels, 0);
+
+    inputs(0.01, 10.0, -4.0, 4.0);
+    bench("pow", pow_kernels, 0);
+    return 0;
+}
@@ -0,0 +1,644 @@
+// npu-train: train multilayer perceptrons for NPU regions from traces
+// captured with -accept-npu-trace (see rt/npu_trace.c).
+//
+// For every region in the trace, a grid of hidden-layer topologies is
+// trained on a shuffled training split with mini-batch Adam. Topologies are
+// trained in parallel, and the kernels use AVX2 or NEON when compiled for
+// them. Each topology's validation error and inference cost are reported,
+// and the chosen network for each region is written in the format the
+// software NPU runtime loads (see rt/npu.c).
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+/**** KERNELS ****/
+
+float dot(const float *a, const float *b, int n) {
+  float sum = 0.0f;
+  int i = 0;
+#if defined(__AVX2__)
+  __m256 acc = _mm256_setzero_ps();
+  float lanes[8];
+  for (; i + 8 <= n; i += 8)
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                           _mm256_loadu_ps(b + i)));
+  _mm256_storeu_ps(lanes, acc);
+  for (int l = 0; l < 8; ++l)
+    sum += lanes[l];
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  float32x4_t acc = vdupq_n_f32(0.0f);
+  float lanes[4];
+  for (; i + 4 <= n; i += 4)
+    acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+  vst1q_f32(lanes, acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i < n; ++i)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+// y += alpha * x
+void axpy(float alpha, const float *x, float *y, int n) {
+  int i = 0;
+#if defined(__AVX2__)
+  __m256 va = _mm256_set1_ps(alpha);
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i),
+        _mm256_mul_ps(va, _mm256_loadu_ps(x + i))));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  float32x4_t va = vdupq_n_f32(alpha);
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32(y + i, vmlaq_f32(vld1q_f32(y + i), va, vld1q_f32(x + i)));
+#endif
+  for (; i < n; ++i)
+    y[i] += alpha * x[i];
+}
+
+float sigmoid(float x) {
+  return 1.0f / (1.0f + std::exp(-x));
+}
+
+
+/**** TRACES ****/
+
+struct Region {
+  std::string name;
+  uint32_t nin;
+  uint32_t nout;
+  // Samples, each nin inputs followed by nout outputs.
+  std::vector<float> data;
+
+  size_t count() const { return data.size() / (nin + nout); }
+  const float *input(size_t i) const { return &data[i * (nin + nout)]; }
+  const float *output(size_t i) const { return input(i) + nin; }
+};
+
+bool readTrace(const char *fn, std::map<uint32_t, Region> &regions) {
+  FILE *f = std::fopen(fn, "rb");
+  if (!f) {
+    std::perror(fn);
+    return false;
+  }
+
+  char tag;
+  bool ok = true;
+  while (std::fread(&tag, 1, 1, f) == 1) {
+    if (tag == 'R') {
+      uint32_t header[4];
+      if (std::fread(header, sizeof(uint32_t), 4, f) != 4) {
+        ok = false;
+        break;
+      }
+      Region &r = regions[header[0]];
+      r.nin = header[1];
+      r.nout = header[2];
+      r.name.resize(header[3]);
+      if (header[3] && std::fread(&r.name[0], 1, header[3], f) != header[3]) {
+        ok = false;
+        break;
+      }
+    } else if (tag == 'S') {
+      uint32_t id;
+      if (std::fread(&id, sizeof(uint32_t), 1, f) != 1 ||
+          !regions.count(id)) {
+        ok = false;
+        break;
+      }
+      Region &r = regions[id];
+      size_t n = r.nin + r.nout;
+      size_t old = r.data.size();
+      r.data.resize(old + n);
+      if (std::fread(&r.data[old], sizeof(float), n, f) != n) {
+        ok = false;
+        break;
+      }
+    } else {
+      ok = false;
+      break;
+    }
+  }
+  std::fclose(f);
+  if (!ok)
+    std::fprintf(stderr, "%s: malformed trace\n", fn);
+  return ok;
+}
+
+
+/**** NETWORKS ****/
+
+// Hidden layers use sigmoid activations; the output layer is linear.
+struct Layer {
+  int nin;
+  int nout;
+  std::vector<float> w;  // nout x nin, row-major
+  std::vector<float> b;
+};
+
+struct Network {
+  std::vector<Layer> layers;
+
+  int inputs() const { return layers.front().nin; }
+  int outputs() const { return layers.back().nout; }
+
+  long macs() const {
+    long total = 0;
+    for (size_t l = 0; l < layers.size(); ++l)
+      total += (long)layers[l].nin * layers[l].nout;
+    return total;
+  }
+};
+
+// A small, reproducible PRNG (xorshift64*).
+struct Random {
+  uint64_t state;
+  explicit Random(uint64_t seed) : state(seed ? seed : 1) {}
+  uint64_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ull;
+  }
+  float uniform() { return (next() >> 40) / (float)(1 << 24); }
+};
+
+void initNetwork(Network &net, int nin, const std::vector<int> &hidden,
+                 int nout, Random &rng) {
+  std::vector<int> sizes;
+  sizes.push_back(nin);
+  sizes.insert(sizes.end(), hidden.begin(), hidden.end());
+  sizes.push_back(nout);
+
+  net.layers.resize(sizes.size() - 1);
+  for (size_t l = 0; l < net.layers.size(); ++l) {
+    Layer &layer = net.layers[l];
+    layer.nin = sizes[l];
+    layer.nout = sizes[l + 1];
+    layer.w.resize(layer.nin * layer.nout);
+    layer.b.assign(layer.nout, 0.0f);
+    float limit = std::sqrt(6.0f / (layer.nin + layer.nout));
+    for (size_t i = 0; i < layer.w.size(); ++i)
+      layer.w[i] = (2.0f * rng.uniform() - 1.0f) * limit;
+  }
+}
+
+// Evaluate the network, keeping every layer's activations (acts[0] is the
+// input).
+void forward(const Network &net, const float *in,
+             std::vector< std::vector<float> > &acts) {
+  acts.resize(net.layers.size() + 1);
+  acts[0].assign(in, in + net.inputs());
+  for (size_t l = 0; l < net.layers.size(); ++l) {
+    const Layer &layer = net.layers[l];
+    bool last = l == net.layers.size() - 1;
+    acts[l + 1].resize(layer.nout);
+    for (int j = 0; j < layer.nout; ++j) {
+      float v = dot(&layer.w[j * layer.nin], &acts[l][0], layer.nin) +
+                layer.b[j];
+      acts[l + 1][j] = last ? v : sigmoid(v);
+    }
+  }
+}
+
+
+/**** TRAINING ****/
+
+struct TrainOptions {
+  int epochs;
+  int batch;
+  float rate;
+  float validation;
+};
+
+// Per-feature normalization, folded into the network after training.
+struct Scaling {
+  std::vector<float> inMean, inScale, outMean, outScale;
+};
+
+void computeScaling(const Region &r, const std::vector<size_t> &train,
+                    Scaling &s) {
+  int n = r.nin + r.nout;
+  std::vector<double> sum(n, 0.0), sumsq(n, 0.0);
+  for (size_t k = 0; k < train.size(); ++k) {
+    const float *x = r.input(train[k]);
+    for (int i = 0; i < n; ++i) {
+      sum[i] += x[i];
+      sumsq[i] += (double)x[i] * x[i];
+    }
+  }
+  std::vector<float> mean(n), scale(n);
+  for (int i = 0; i < n; ++i) {
+    double m = sum[i] / train.size();
+    double var = sumsq[i] / train.size() - m * m;
+    mean[i] = m;
+    scale[i] = var > 1e-12 ? std::sqrt(var) : 1.0;
+  }
+  s.inMean.assign(mean.begin(), mean.begin() + r.nin);
+  s.inScale.assign(scale.begin(), scale.begin() + r.nin);
+  s.outMean.assign(mean.begin() + r.nin, mean.end());
+  s.outScale.assign(scale.begin() + r.nin, scale.end());
+}
+
+// Rewrite a network trained on normalized data to take and produce raw
+// values.
+void foldScaling(Network &net, const Scaling &s) {
+  Layer &first = net.layers.front();
+  for (int j = 0; j < first.nout; ++j) {
+    for (int i = 0; i < first.nin; ++i) {
+      float &w = first.w[j * first.nin + i];
+      w /= s.inScale[i];
+      first.b[j] -= w * s.inMean[i];
+    }
+  }
+  Layer &last = net.layers.back();
+  for (int j = 0; j < last.nout; ++j) {
+    for (int i = 0; i < last.nin; ++i)
+      last.w[j * last.nin + i] *= s.outScale[j];
+    last.b[j] = last.b[j] * s.outScale[j] + s.outMean[j];
+  }
+}
+
+void normalize(const float *raw, const std::vector<float> &mean,
+               const std::vector<float> &scale, std::vector<float> &out) {
+  out.resize(mean.size());
+  for (size_t i = 0; i < mean.size(); ++i)
+    out[i] = (raw[i] - mean[i]) / scale[i];
+}
+
+// Train with mini-batch Adam on normalized samples.
+void train(Network &net, const Region &r, const std::vector<size_t> &samples,
+           const Scaling &s, const TrainOptions &opts, Random &rng) {
+  const float beta1 = 0.9f, beta2 = 0.999f, eps = 1e-8f;
+  size_t nl = net.layers.size();
+  std::vector< std::vector<float> > gw(nl), gb(nl), mw(nl), vw(nl), mb(nl),
+      vb(nl);
+  for (size_t l = 0; l < nl; ++l) {
+    mw[l].assign(net.layers[l].w.size(), 0.0f);
+    vw[l].assign(net.layers[l].w.size(), 0.0f);
+    mb[l].assign(net.layers[l].b.size(), 0.0f);
+    vb[l].assign(net.layers[l].b.size(), 0.0f);
+  }
+
+  std::vector<size_t> order(samples);
+  std::vector< std::vector<float> > acts, deltas(nl + 1);
+  std::vector<float> in, target;
+  long step = 0;
+
+  for (int epoch = 0; epoch < opts.epochs; ++epoch) {
+    // Shuffle.
+    for (size_t i = order.size(); i > 1; --i)
+      std::swap(order[i - 1], order[rng.next() % i]);
+
+    for (size_t start = 0; start < order.size(); start += opts.batch) {
+      size_t end = std::min(order.size(), start + (size_t)opts.batch);
+      for (size_t l = 0; l < nl; ++l) {
+        gw[l].assign(net.layers[l].w.size(), 0.0f);
+        gb[l].assign(net.layers[l].b.size(), 0.0f);
+      }
+
+      // Accumulate gradients over the batch.
+      for (size_t k = start; k < end; ++k) {
+        normalize(r.input(order[k]), s.inMean, s.inScale, in);
+        normalize(r.output(order[k]), s.outMean, s.outScale, target);
+        forward(net, &in[0], acts);
+
+        deltas[nl].resize(r.nout);
+        for (uint32_t j = 0; j < r.nout; ++j)
+          deltas[nl][j] = acts[nl][j] - target[j];
+
+        for (size_t l = nl; l-- > 0;) {
+          const Layer &layer = net.layers[l];
+          deltas[l].assign(layer.nin, 0.0f);
+          for (int j = 0; j < layer.nout; ++j) {
+            float d = deltas[l + 1][j];
+            axpy(d, &acts[l][0], &gw[l][j * layer.nin], layer.nin);
+            gb[l][j] += d;
+            if (l)
+              axpy(d, &layer.w[j * layer.nin], &deltas[l][0], layer.nin);
+          }
+          if (l) {
+            // Through the previous layer's sigmoid.
+            for (int i = 0; i < layer.nin; ++i)
+              deltas[l][i] *= acts[l][i] * (1.0f - acts[l][i]);
+          }
+        }
+      }
+
+      // Adam update.
+      ++step;
+      float scale = 1.0f / (end - start);
+      float corr1 = 1.0f - std::pow(beta1, (float)step);
+      float corr2 = 1.0f - std::pow(beta2, (float)step);
+      float rate = opts.rate * std::sqrt(corr2) / corr1;
+      for (size_t l = 0; l < nl; ++l) {
+        Layer &layer = net.layers[l];
+        for (size_t i = 0; i < layer.w.size(); ++i) {
+          float g = gw[l][i] * scale;
+          mw[l][i] = beta1 * mw[l][i] + (1 - beta1) * g;
+          vw[l][i] = beta2 * vw[l][i] + (1 - beta2) * g * g;
+          layer.w[i] -= rate * mw[l][i] / (std::sqrt(vw[l][i]) + eps);
+        }
+        for (size_t i = 0; i < layer.b.size(); ++i) {
+          float g = gb[l][i] * scale;
+          mb[l][i] = beta1 * mb[l][i] + (1 - beta1) * g;
+          vb[l][i] = beta2 * vb[l][i] + (1 - beta2) * g * g;
+          layer.b[i] -= rate * mb[l][i] / (std::sqrt(vb[l][i]) + eps);
+        }
+      }
+    }
+  }
+}
+
+// Root-mean-square error of a (raw-valued) network, normalized by each
+// output's standard deviation so regions are comparable.
+double evaluate(const Network &net, const Region &r,
+                const std::vector<size_t> &samples, const Scaling &s) {
+  std::vector< std::vector<float> > acts;
+  double sum = 0.0;
+  for (size_t k = 0; k < samples.size(); ++k) {
+    forward(net, r.input(samples[k]), acts);
+    const float *t = r.output(samples[k]);
+    for (uint32_t j = 0; j < r.nout; ++j) {
+      double e = (acts.back()[j] - t[j]) / s.outScale[j];
+      sum += e * e;
+    }
+  }
+  if (samples.empty())
+    return 0.0;
+  return std::sqrt(sum / (samples.size() * r.nout));
+}
+
+
+/**** TOPOLOGY SEARCH ****/
+
+struct Candidate {
+  std::vector<int> hidden;
+  Network net;
+  double error;
+};
+
+struct SearchJob {
+  const Region *region;
+  const std::vector<size_t> *train;
+  const std::vector<size_t> *validate;
+  const Scaling *scaling;
+  const TrainOptions *opts;
+  std::vector<Candidate> *candidates;
+  size_t next;
+  pthread_mutex_t lock;
+};
+
+void *searchWorker(void *arg) {
+  SearchJob *job = static_cast<SearchJob *>(arg);
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    size_t i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->candidates->size())
+      break;
+
+    Candidate &c = (*job->candidates)[i];
+    Random rng(0x9E3779B97F4A7C15ull + i);
+    initNetwork(c.net, job->region->nin, c.hidden, job->region->nout, rng);
+    train(c.net, *job->region, *job->train, *job->scaling, *job->opts, rng);
+    foldScaling(c.net, *job->scaling);
+    c.error = evaluate(c.net, *job->region, *job->validate, *job->scaling);
+  }
+  return NULL;
+}
+
+std::string topologyName(const Region &r, const std::vector<int> &hidden) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%u", r.nin);
+  std::string name = buf;
+  for (size_t i = 0; i < hidden.size(); ++i) {
+    std::snprintf(buf, sizeof(buf), " -> %d", hidden[i]);
+    name += buf;
+  }
+  std::snprintf(buf, sizeof(buf), " -> %u", r.nout);
+  return name + buf;
+}
+
+void writeNetwork(FILE *f, const std::string &name, const Network &net) {
+  std::fprintf(f, "network %s\nlayers %d", name.c_str(), net.inputs());
+  for (size_t l = 0; l < net.layers.size(); ++l)
+    std::fprintf(f, " %d", net.layers[l].nout);
+  std::fprintf(f, "\nactivations");
+  for (size_t l = 0; l < net.layers.size(); ++l)
+    std::fprintf(f, l == net.layers.size() - 1 ? " linear" : " sigmoid");
+  std::fprintf(f, "\n");
+  for (size_t l = 0; l < net.layers.size(); ++l) {
+    const Layer &layer = net.layers[l];
+    for (int j = 0; j < layer.nout; ++j) {
+      for (int i = 0; i < layer.nin; ++i)
+        std::fprintf(f, "%.9g ", layer.w[j * layer.nin + i]);
+      std::fprintf(f, "\n");
+    }
+    for (int j = 0; j < layer.nout; ++j)
+      std::fprintf(f, "%.9g ", layer.b[j]);
+    std::fprintf(f, "\n");
+  }
+  std::fprintf(f, "end\n");
+}
+
+// Parse a comma-separated list of topologies, each an x-separated list of
+// hidden layer sizes (e.g., "4,8,8x8"). "0" means no hidden layer.
+bool parseTopologies(const char *spec,
+                     std::vector< std::vector<int> > &topologies) {
+  std::string s(spec);
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = s.find(',', start);
+    if (end == std::string::npos)
+      end = s.size();
+    std::string item = s.substr(start, end - start);
+    std::vector<int> hidden;
+    size_t p = 0;
+    while (p <= item.size()) {
+      size_t q = item.find('x', p);
+      if (q == std::string::npos)
+        q = item.size();
+      int size = std::atoi(item.substr(p, q - p).c_str());
+      if (size < 0)
+        return false;
+      if (size)
+        hidden.push_back(size);
+      p = q + 1;
+    }
+    topologies.push_back(hidden);
+    start = end + 1;
+  }
+  return !topologies.empty();
+}
+
+void usage(const char *prog) {
+  std::fprintf(stderr,
+      "usage: %s [options] trace.bin\n"
+      "  -o FILE   write networks to FILE (default accept_npu.nn)\n"
+      "  -t LIST   hidden topologies to try (default 0,2,4,8,16,32,4x4,8x8,"
+      "16x16)\n"
+      "  -e N      training epochs (default 100)\n"
+      "  -b N      mini-batch size (default 32)\n"
+      "  -l RATE   learning rate (default 0.01)\n"
+      "  -j N      worker threads (default: one per CPU)\n"
+      "  -E ERR    choose the cheapest network with at most this\n"
+      "            normalized RMSE (default: the most accurate)\n"
+      "  -r NAME   only train the named region\n",
+      prog);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *outFile = "accept_npu.nn";
+  const char *topoSpec = "0,2,4,8,16,32,4x4,8x8,16x16";
+  const char *onlyRegion = NULL;
+  double maxError = -1.0;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = ncpu > 0 ? ncpu : 1;
+  TrainOptions opts;
+  opts.epochs = 100;
+  opts.batch = 32;
+  opts.rate = 0.01f;
+  opts.validation = 0.2f;
+
+  int c;
+  while ((c = getopt(argc, argv, "o:t:e:b:l:j:E:r:h")) != -1) {
+    switch (c) {
+    case 'o': outFile = optarg; break;
+    case 't': topoSpec = optarg; break;
+    case 'e': opts.epochs = std::atoi(optarg); break;
+    case 'b': opts.batch = std::max(1, std::atoi(optarg)); break;
+    case 'l': opts.rate = std::atof(optarg); break;
+    case 'j': threads = std::max(1, std::atoi(optarg)); break;
+    case 'E': maxError = std::atof(optarg); break;
+    case 'r': onlyRegion = optarg; break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 2;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::vector< std::vector<int> > topologies;
+  if (!parseTopologies(topoSpec, topologies)) {
+    std::fprintf(stderr, "bad topology list: %s\n", topoSpec);
+    return 2;
+  }
+
+  std::map<uint32_t, Region> regions;
+  if (!readTrace(argv[optind], regions))
+    return 1;
+
+  FILE *out = std::fopen(outFile, "w");
+  if (!out) {
+    std::perror(outFile);
+    return 1;
+  }
+
+  int trained = 0;
+  for (std::map<uint32_t, Region>::iterator ri = regions.begin();
+       ri != regions.end(); ++ri) {
+    const Region &r = ri->second;
+    if (onlyRegion && r.name != onlyRegion)
+      continue;
+    if (r.count() < 2) {
+      std::printf("%s: too few samples (%lu)\n", r.name.c_str(),
+                  (unsigned long)r.count());
+      continue;
+    }
+
+    // Split into training and validation sets.
+    std::vector<size_t> order(r.count());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    Random rng(42);
+    for (size_t i = order.size(); i > 1; --i)
+      std::swap(order[i - 1], order[rng.next() % i]);
+    size_t nval = std::max((size_t)1, (size_t)(order.size() * opts.validation));
+    std::vector<size_t> validate(order.begin(), order.begin() + nval);
+    std::vector<size_t> trainSet(order.begin() + nval, order.end());
+
+    Scaling scaling;
+    computeScaling(r, trainSet, scaling);
+
+    std::vector<Candidate> candidates(topologies.size());
+    for (size_t i = 0; i < topologies.size(); ++i)
+      candidates[i].hidden = topologies[i];
+
+    SearchJob job;
+    job.region = &r;
+    job.train = &trainSet;
+    job.validate = &validate;
+    job.scaling = &scaling;
+    job.opts = &opts;
+    job.candidates = &candidates;
+    job.next = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    std::vector<pthread_t> workers(std::min((size_t)threads,
+                                            candidates.size()));
+    for (size_t i = 0; i < workers.size(); ++i)
+      pthread_create(&workers[i], NULL, searchWorker, &job);
+    for (size_t i = 0; i < workers.size(); ++i)
+      pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    // Report and choose.
+    std::printf("%s: %lu training, %lu validation samples\n", r.name.c_str(),
+                (unsigned long)trainSet.size(), (unsigned long)nval);
+    std::printf("  %-28s %12s %10s\n", "topology", "nrmse", "MACs");
+    size_t best = 0;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      const Candidate &cand = candidates[i];
+      std::printf("  %-28s %12.6f %10ld\n",
+                  topologyName(r, cand.hidden).c_str(), cand.error,
+                  cand.net.macs());
+
+      const Candidate &cur = candidates[best];
+      bool better;
+      if (maxError >= 0.0) {
+        bool ok = cand.error <= maxError, curOk = cur.error <= maxError;
+        if (ok != curOk)
+          better = ok;
+        else if (ok)
+          better = cand.net.macs() < cur.net.macs();
+        else
+          better = cand.error < cur.error;
+      } else {
+        better = cand.error < cur.error;
+      }
+      if (better)
+        best = i;
+    }
+    std::printf("  chose %s\n", topologyName(r, candidates[best].hidden).c_str());
+    writeNetwork(out, r.name, candidates[best].net);
+    ++trained;
+  }
+
+  std::fclose(out);
+  if (!trained) {
+    std::fprintf(stderr, "no regions trained\n");
+    return 1;
+  }
+  return 0;
+}
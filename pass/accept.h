@@ -11,6 +11,7 @@
 
 #include <set>
 #include <map>
+#include <vector>
 #include <string>
 #include <cassert>
 
@@ -24,6 +25,8 @@
 
 
 namespace llvm {
+  class PostDominatorTree;
+
   ImmutablePass *createAcceptAAPass();
   void initializeAcceptAAPass(PassRegistry &Registry);
   FunctionPass *createAcceptTransformPass();
@@ -180,6 +183,8 @@ struct ACCEPTPass : public llvm::FunctionPass {
 
   bool shouldSkipFunc(llvm::Function &F);
   std::string siteName(std::string kind, llvm::Instruction *at);
+  std::string funcSiteName(std::string kind, llvm::Function &F);
+  LogDescription *logAddFunction(llvm::Function &F);
 
   void collectFuncDebug(llvm::Module &M);
   void collectSubprogram(llvm::DISubprogram sp);
@@ -191,16 +196,113 @@ struct ACCEPTPass : public llvm::FunctionPass {
   bool optimizeSync(llvm::Function &F);
   bool optimizeAcquire(llvm::Instruction *inst);
   bool optimizeBarrier(llvm::Instruction *bar1);
+  void relaxBarrier(llvm::Instruction *bar, int logperiod);
+  std::vector< std::pair<llvm::Instruction*, int> > pendingBarriers;
+  void quorumBarrier(llvm::Instruction *bar, int param);
+  std::vector< std::pair<llvm::Instruction*, int> > pendingQuorums;
+  bool usedQuorumBarriers;
+  void hookBarrierInit();
+  std::map<llvm::Instruction*, llvm::Instruction*> syncEnds;
+  std::map<llvm::Instruction*, std::vector<llvm::BasicBlock*> > syncSections;
+  void pairSyncs(llvm::Function &F);
+  void finishSection(llvm::Instruction *acq,
+      const std::vector<llvm::BasicBlock*> &blocks,
+      llvm::PostDominatorTree &postDomTree);
   llvm::Instruction *findCritSec(llvm::Instruction *acq,
       std::set<llvm::Instruction*> &cs, LogDescription *desc);
   llvm::Instruction *findApproxCritSec(llvm::Instruction *acq,
-      LogDescription *desc);
+      LogDescription *desc, std::set<llvm::Instruction*> *section = NULL);
+  void privatizeReduction(llvm::Instruction *acq, llvm::Instruction *rel,
+      llvm::StoreInst *store, int param);
+  bool usedReductions;
+  void flushReductionsAtBarriers();
+  void profileSync(llvm::Instruction *acq, llvm::Instruction *rel);
+  std::vector< std::pair<llvm::Instruction*, llvm::Instruction*> >
+      pendingProfiles;
   bool nullifyApprox(llvm::Function &F);
+
+  bool optimizeMemo(llvm::Function &F);
+  bool memoizable(llvm::CallInst *call, LogDescription *desc);
+  void memoizeCall(llvm::CallInst *call, llvm::StringRef optName, int param);
+
+  bool optimizeLUT(llvm::Function &F);
+  bool lutCandidate(llvm::CallInst *call, LogDescription *desc);
+  void lutCall(llvm::CallInst *call, int param);
+
+  bool optimizeFastMath(llvm::Function &F);
+  void fastMathCall(llvm::CallInst *call, int param);
+
+  bool optimizeArith(llvm::Function &F);
+  llvm::Value *arithReciprocal(llvm::Instruction *inst, llvm::Value *divisor,
+                               int steps, LogDescription *desc);
+  void reduceArith(llvm::Instruction *inst, int param, LogDescription *desc);
+
+  bool relaxFPFlags(llvm::Function &F);
+
+  bool optimizeDemotion(llvm::Function &F);
+  void demoteChain(const std::set<llvm::Instruction*> &chain);
+  llvm::Value *demotedValue(llvm::Value *v, llvm::Instruction *user,
+                            std::map<llvm::Value*, llvm::Value*> &demoted,
+                            const std::set<llvm::Instruction*> &chain);
+
+  struct NarrowRange {
+    bool known;
+    bool nonNegative;
+    bool fitsSigned;
+    bool fitsUnsigned;
+  };
+  bool optimizeNarrowing(llvm::Function &F);
+  NarrowRange narrowRange(llvm::Value *v, unsigned width);
+  void findNarrowable(llvm::Function &F, unsigned width,
+                      std::set<llvm::Instruction*> &chain, bool &isUnsigned);
+  void narrowChain(const std::set<llvm::Instruction*> &chain, unsigned width,
+                   bool isUnsigned);
+  llvm::Value *narrowedValue(llvm::Value *v, llvm::Instruction *user,
+                             unsigned width, bool isUnsigned,
+                             std::map<llvm::Value*, llvm::Value*> &narrowed,
+                             const std::set<llvm::Instruction*> &chain);
+  llvm::Value *saturatingOp(llvm::BinaryOperator *op, llvm::Value *lhs,
+                            llvm::Value *rhs, unsigned width,
+                            bool isUnsigned);
+
+  bool optimizeFixedPoint(llvm::Function &F);
+  void fixChain(const std::set<llvm::Instruction*> &chain, int frac);
+  llvm::Value *fixedValue(llvm::Value *v, llvm::Instruction *user, int frac,
+                          std::map<llvm::Value*, llvm::Value*> &fixed,
+                          const std::set<llvm::Instruction*> &chain);
+
+  bool optimizeAlias(llvm::Function &F);
+
+  bool optimizeCompression(llvm::Function &F);
+  void compressAlloc(llvm::Instruction *inst, llvm::Type *elemTy, int param);
+  std::string compressSiteName(llvm::Instruction *inst);
+
+  bool optimizeParallel(llvm::Function &F);
+  bool parallelizable(llvm::Loop *loop, llvm::BasicBlock *&bodyBlock,
+                      std::map<llvm::AllocaInst*, bool> &privates,
+                      LogDescription *desc);
+  void parallelizeLoop(llvm::Loop *loop, llvm::BasicBlock *bodyBlock,
+                       const std::map<llvm::AllocaInst*, bool> &privates,
+                       int param);
 };
 
 // Information about individual instructions is always available.
 bool isApprox(const llvm::Instruction *instr);
 bool isApproxPtr(const llvm::Value *value);
+bool hasOnlyApproxUses(const llvm::Instruction *inst);
+void addChainPhis(std::set<llvm::Instruction*> &chain,
+                  std::set<llvm::PHINode*> &phis);
 bool isCallOf(llvm::Instruction *inst, const char *fname);
+enum SyncKind {
+  SYNC_NONE,
+  SYNC_ACQUIRE,
+  SYNC_RELEASE,
+  SYNC_BARRIER
+};
+extern const char *FUNC_ACQUIRE;
+extern const char *FUNC_BARRIER;
+SyncKind syncKind(llvm::Instruction *inst);
 bool isAcquire(llvm::Instruction *inst);
 bool isRelease(llvm::Instruction *inst);
+bool isBarrier(llvm::Instruction *inst);
+bool isSyncPair(llvm::Instruction *acq, llvm::Instruction *rel);
@@ -4,6 +4,8 @@
 #include "llvm/DataLayout.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/GlobalVariable.h"
+#include "llvm/Instructions.h"
+#include "llvm/ADT/ValueMap.h"
 #include "accept.h"
 #include <fstream>
 #include <string>
@@ -21,14 +23,70 @@ namespace {
       return false;
   }
 
+  bool approxStore(const Value *val) {
+    const StoreInst *store = dyn_cast<StoreInst>(val);
+    return store && (isApproxPtr(store) || isApprox(store));
+  }
+
+  bool hasApproxStore(const Value *val) {
+    for (Value::const_use_iterator ui = val->use_begin();
+         ui != val->use_end(); ++ui)
+      if (approxStore(*ui))
+        return true;
+    return false;
+  }
+
+  // Is this a heap allocation (or a cast of one) that is used for
+  // approximate data, judging by the stores and GEPs it feeds?
+  bool approxAlloc(const Value *val) {
+    if (const BitCastInst *cast = dyn_cast<BitCastInst>(val))
+      return isMalloc(cast->getOperand(0)) && hasApproxStore(cast);
+    if (!isMalloc(val))
+      return false;
+    for (Value::const_use_iterator ui = val->use_begin();
+         ui != val->use_end(); ++ui) {
+      if (approxStore(*ui))
+        return true;
+      if (isa<GetElementPtrInst>(*ui) && isApproxPtr(*ui))
+        return true;
+      if (isa<BitCastInst>(*ui) && hasApproxStore(*ui))
+        return true;
+    }
+    return false;
+  }
+
+  // Cache entries must not move to a replacement value: it may not be
+  // approximate.
+  struct NoRAUWConfig : public ValueMapConfig<const Value*> {
+    enum { FollowRAUW = false };
+  };
+
+  bool approxLoc(const Value *val) {
+    if (isApproxPtr(val))
+      return true;
+    if (const Instruction *inst = dyn_cast<Instruction>(val))
+      if (isApprox(inst))
+        return true;
+    return false;
+  }
+
   struct AcceptAA : public ImmutablePass, public AliasAnalysis {
     static char ID;
     ACCEPTPass *transformPass;
-    int relaxId;
-    int relaxParam;
+
+    // Per-function and per-pointer answers are cached, since AA clients
+    // like GVN and LICM ask about the same values over and over. The maps
+    // drop entries for deleted values.
+    ValueMap<const Function*, bool> relaxedFuncs;
+    enum {
+      PtrApprox = 1,       // approxLoc
+      PtrApproxAlloc = 2   // approxAlloc
+    };
+    ValueMap<const Value*, int, NoRAUWConfig> ptrFlags;
 
     AcceptAA() : ImmutablePass(ID) {
       initializeAcceptAAPass(*PassRegistry::getPassRegistry());
+      transformPass = NULL;
       if (!sharedAcceptTransformPass) {
         errs() << "Alias analysis loaded without transform pass!\n";
         return;
@@ -47,34 +105,84 @@ namespace {
 
     virtual void initializePass() {
       InitializeAliasAnalysis(this);
+    }
 
-      // One global optimization parameter controls whether we should enable
-      // alias relaxation. (For now.)
-      std::string relaxName = "alias relaxation";
-      if (transformPass->relax) {
-        relaxParam = transformPass->relaxConfig[relaxName];
-      } else {
-        relaxParam = 0;
-        transformPass->relaxConfig[relaxName] = 0;
+    // Alias relaxation is controlled per function: the transform pass
+    // registers an "alias" site for each function with approximate memory
+    // accesses. Queries are relaxed when the value they concern is in a
+    // relaxed function.
+    bool relaxedAt(const Value *val) {
+      if (!transformPass || !transformPass->relax)
+        return false;
+
+      const Function *func = NULL;
+      if (const Instruction *inst = dyn_cast<Instruction>(val)) {
+        if (inst->getParent())
+          func = inst->getParent()->getParent();
+      } else if (const Argument *arg = dyn_cast<Argument>(val)) {
+        func = arg->getParent();
       }
+      if (!func)
+        return false;
+
+      ValueMap<const Function*, bool>::iterator i = relaxedFuncs.find(func);
+      if (i != relaxedFuncs.end())
+        return i->second;
+      std::string optName = transformPass->funcSiteName("alias",
+          *const_cast<Function*>(func));
+      std::map<std::string, int>::iterator param =
+          transformPass->relaxConfig.find(optName);
+      bool relaxed = param != transformPass->relaxConfig.end() &&
+                     param->second;
+      relaxedFuncs[func] = relaxed;
+      if (relaxed)
+        precomputeAllocs(func);
+      return relaxed;
     }
 
-    bool approxLoc(const Value *val) {
-      if (isApproxPtr(val))
-        return true;
-      if (const Instruction *inst = dyn_cast<Instruction>(val))
-        if (isApprox(inst))
-          return true;
-      return false;
+    int pointerFlags(const Value *ptr) {
+      ValueMap<const Value*, int, NoRAUWConfig>::iterator i =
+          ptrFlags.find(ptr);
+      if (i != ptrFlags.end())
+        return i->second;
+      int flags = (::approxLoc(ptr) ? PtrApprox : 0) |
+                  (approxAlloc(ptr) ? PtrApproxAlloc : 0);
+      ptrFlags[ptr] = flags;
+      return flags;
+    }
+
+    // Classify a relaxed function's heap allocations in one pass, before
+    // its queries start walking their use lists.
+    void precomputeAllocs(const Function *func) {
+      for (Function::const_iterator bi = func->begin(); bi != func->end();
+           ++bi) {
+        for (BasicBlock::const_iterator ii = bi->begin(); ii != bi->end();
+             ++ii) {
+          if (!isMalloc(ii))
+            continue;
+          pointerFlags(ii);
+          for (Value::const_use_iterator ui = ii->use_begin();
+               ui != ii->use_end(); ++ui)
+            if (isa<BitCastInst>(*ui))
+              pointerFlags(*ui);
+        }
+      }
     }
+
     bool approxLoc(const Location &Loc) {
-      return approxLoc(Loc.Ptr);
+      return pointerFlags(Loc.Ptr) & PtrApprox;
+    }
+    bool approxPointer(const Location &Loc) {
+      return pointerFlags(Loc.Ptr) != 0;
     }
 
-    virtual bool pointToConstantMemory(const Location &Loc,
+    virtual bool pointsToConstantMemory(const Location &Loc,
         bool OrLocal=false) {
       bool result = AliasAnalysis::pointsToConstantMemory(Loc, OrLocal);
-      if (!relaxParam)
+      // With OrLocal, a "yes" lets FunctionAttrs mark a function that
+      // writes approximate memory as readnone, and then its calls can be
+      // deleted. Only the constant-memory question is relaxed.
+      if (OrLocal || !relaxedAt(Loc.Ptr))
         return result;
 
       if (approxLoc(Loc)) {
@@ -85,7 +193,7 @@ namespace {
     }
     virtual ModRefBehavior getModRefBehavior (ImmutableCallSite CS) {
       ModRefBehavior result = AliasAnalysis::getModRefBehavior(CS);
-      if (!relaxParam)
+      if (!relaxedAt(CS.getInstruction()))
         return result;
 
       if (result == UnknownModRefBehavior) {
@@ -97,23 +205,16 @@ namespace {
 
       return result;
     }
+    // Without a call site, there is no site to attribute the query to, so
+    // the answer is never relaxed. (Calls are handled by the call-site
+    // version above.)
     virtual ModRefBehavior getModRefBehavior (const Function *F) {
-      ModRefBehavior result = AliasAnalysis::getModRefBehavior(F);
-      if (!relaxParam)
-        return result;
-
-      if (result == UnknownModRefBehavior) {
-        if (transformPass->AI->isPrecisePure(const_cast<Function*>(F))) {
-          return OnlyReadsMemory;
-        }
-      }
-
-      return result;
+      return AliasAnalysis::getModRefBehavior(F);
     }
     virtual ModRefResult getModRefInfo (ImmutableCallSite CS,
         const Location &Loc) {
       ModRefResult result = AliasAnalysis::getModRefInfo(CS, Loc);
-      if (!relaxParam)
+      if (!relaxedAt(CS.getInstruction()))
         return result;
 
       const Function *func = CS.getCalledFunction();
@@ -128,7 +229,7 @@ namespace {
     virtual ModRefResult getModRefInfo (ImmutableCallSite CS1,
         ImmutableCallSite CS2) {
       ModRefResult result = AliasAnalysis::getModRefInfo(CS1, CS2);
-      if (!relaxParam)
+      if (!relaxedAt(CS1.getInstruction()))
         return result;
 
       const Function *func1 = CS1.getCalledFunction();
@@ -143,157 +244,17 @@ namespace {
 
     virtual AliasResult alias(const Location &LocA, const Location &LocB) {
       AliasResult result = AliasAnalysis::alias(LocA, LocB);
-      if (!relaxParam)
+      if (result == MustAlias || result == NoAlias)
+        return result;
+      if (!relaxedAt(LocA.Ptr) && !relaxedAt(LocB.Ptr))
         return result;
 
-      if (result == MustAlias) {
-        return MustAlias;
-      } else if (approxLoc(LocA) || approxLoc(LocB)) {
+      // Approximate pointers (including globals on the approximate globals
+      // list) and heap allocations used for approximate data.
+      if (approxPointer(LocA) || approxPointer(LocB))
         return NoAlias;
-      }
-
-      // Mallocs, callocs...
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr)) {
-        if (isMalloc(inst)) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              if (const Instruction *user = dyn_cast<Instruction>(*ui)) {
-                if (const StoreInst *si = dyn_cast<StoreInst>(user)) {
-                  if (isApproxPtr(si) || isApprox(si)) {
-                      return NoAlias;
-                  }
-                } else if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(user)) {
-                  if (isApproxPtr(user)) {
-                      return NoAlias;
-                  }
-                } else if (const BitCastInst *bc = dyn_cast<BitCastInst>(user)) {
-                  for (Value::const_use_iterator bc_ui = user->use_begin();
-                        bc_ui != user->use_end();
-                        ++bc_ui) {
-                    if (const Instruction *bc_user = dyn_cast<Instruction>(*bc_ui))
-                      if (const StoreInst *si_bc_user = dyn_cast<StoreInst>(bc_user))
-                        if (isApproxPtr(si_bc_user) || isApprox(si_bc_user)) {
-                            return NoAlias;
-                        }
-                  }
-                }
-              }
-            }
-        }
-      }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr)) {
-        if (isMalloc(inst)) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              if (const Instruction *user = dyn_cast<Instruction>(*ui)) {
-                if (const StoreInst *si = dyn_cast<StoreInst>(user)) {
-                  if (isApproxPtr(si) || isApprox(si)) {
-                      return NoAlias;
-                  }
-                } else if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(user)) {
-                  if (isApproxPtr(user)) {
-                      return NoAlias;
-                  }
-                } else if (const BitCastInst *bc = dyn_cast<BitCastInst>(user)) {
-                  for (Value::const_use_iterator bc_ui = user->use_begin();
-                        bc_ui != user->use_end();
-                        ++bc_ui) {
-                    if (const Instruction *bc_user = dyn_cast<Instruction>(*bc_ui))
-                      if (const StoreInst *si_bc_user = dyn_cast<StoreInst>(bc_user))
-                        if (isApproxPtr(si_bc_user) || isApprox(si_bc_user)) {
-                            return NoAlias;
-                        }
-                  }
-                }
-              }
-            }
-        }
-      }
-
-      // Globals
-      if (const GlobalValue *GV = dyn_cast<GlobalValue>(LocA.Ptr))
-        if (const GlobalVariable *V = dyn_cast<GlobalVariable>(GV))
-          if (isApproxPtr(V)) {
-              return NoAlias;
-          }
-      if (const GlobalValue *GV = dyn_cast<GlobalValue>(LocB.Ptr))
-        if (const GlobalVariable *V = dyn_cast<GlobalVariable>(GV))
-          if (isApproxPtr(V)) {
-              return NoAlias;
-          }
-
-      // Getelementptr
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr))
-        if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(inst))
-          if (isApproxPtr(GEP)) {
-              return NoAlias;
-          }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr))
-        if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(inst))
-          if (isApproxPtr(GEP)) {
-              return NoAlias;
-          }
 
-      // Bitcasts
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr))
-        if (const BitCastInst *BC = dyn_cast<BitCastInst>(inst)) {
-          if (isMalloc(inst->getOperand(0))) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              const Instruction *user = dyn_cast<Instruction>(*ui);
-              if (const StoreInst *st = dyn_cast<StoreInst>(user))
-                if (isApprox(st) || isApproxPtr(st)) {
-                    return NoAlias;
-                }
-            }
-          }
-        }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr))
-        if (const BitCastInst *BC = dyn_cast<BitCastInst>(inst)) {
-          if (isMalloc(inst->getOperand(0))) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              const Instruction *user = dyn_cast<Instruction>(*ui);
-              if (const StoreInst *st = dyn_cast<StoreInst>(user))
-                if (isApprox(st) || isApproxPtr(st)) {
-                    return NoAlias;
-                }
-            }
-          }
-        }
-
-      // Ordinary instructions
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr))
-        if (isApprox(inst) || isApproxPtr(inst)) {
-            return NoAlias;
-        }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr))
-        if (isApprox(inst) || isApproxPtr(inst)) {
-            return NoAlias;
-        } 
-
-      /* DEBUG
-      else if (instA && instB) {
-        errs() << "instructions:\n";
-        instA->dump();
-        instB->dump();
-      } else {
-        const GlobalValue *gvA = dyn_cast<GlobalValue>(LocA.Ptr);
-        const GlobalValue *gvB = dyn_cast<GlobalValue>(LocB.Ptr);
-        if (gvA && gvB) {
-          errs() << "global values:\n";
-          gvA->dump();
-          gvB->dump();
-        }
-      }
-      */
-
-      // Delegate to other alias analyses.
-      return AliasAnalysis::alias(LocA, LocB);
+      return result;
     }
 
     // This required bit works around C++'s multiple inheritance weirdness.
@@ -306,6 +267,40 @@ namespace {
   };
 }
 
+// Register an alias relaxation site for each function with approximate
+// memory accesses. The relaxation itself happens in AcceptAA, when later
+// passes query it.
+bool ACCEPTPass::optimizeAlias(Function &F) {
+  int accesses = 0;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      Value *ptr = NULL;
+      if (LoadInst *load = dyn_cast<LoadInst>(ii))
+        ptr = load->getPointerOperand();
+      else if (StoreInst *store = dyn_cast<StoreInst>(ii))
+        ptr = store->getPointerOperand();
+      if (ptr && approxLoc(ptr))
+        ++accesses;
+    }
+  }
+  if (!accesses)
+    return false;
+
+  std::string optName = funcSiteName("alias", F);
+  LogDescription *desc = logAddFunction(F);
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << accesses << " approximate memory accesses\n";
+
+  if (relax) {
+    if (relaxConfig[optName])
+      ACCEPT_LOG << "relaxing alias analysis\n";
+  } else {
+    ACCEPT_LOG << "can relax alias analysis\n";
+    relaxConfig[optName] = 0;
+  }
+  return false;
+}
+
 char AcceptAA::ID = 0;
 INITIALIZE_AG_PASS(AcceptAA, AliasAnalysis, "acceptaa",
                    "ACCEPT approximate alias analysis",
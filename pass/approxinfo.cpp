@@ -167,9 +167,127 @@ bool isApproxPtr(const Value *value) {
   return isApproxPtr(value, seen);
 }
 
-// Identification of lock acquire and release calls.
+// Identification of synchronization calls. Each primitive belongs to a
+// family so that an acquire is only paired with a matching release.
+// Substring entries catch helpers that are mangled as internal symbols when
+// they are inlined (e.g., libstdc++'s std::mutex wrappers).
+struct SyncPrimitive {
+  const char *name;
+  SyncKind kind;
+  const char *family;
+  bool substring;
+};
+const SyncPrimitive _syncPrimitives[] = {
+  // POSIX threads.
+  { "pthread_mutex_lock", SYNC_ACQUIRE, "pthread_mutex", false },
+  { "pthread_mutex_unlock", SYNC_RELEASE, "pthread_mutex", false },
+  { "pthread_spin_lock", SYNC_ACQUIRE, "pthread_spin", false },
+  { "pthread_spin_unlock", SYNC_RELEASE, "pthread_spin", false },
+  { "pthread_rwlock_rdlock", SYNC_ACQUIRE, "pthread_rwlock", false },
+  { "pthread_rwlock_wrlock", SYNC_ACQUIRE, "pthread_rwlock", false },
+  { "pthread_rwlock_unlock", SYNC_RELEASE, "pthread_rwlock", false },
+  { "pthread_barrier_wait", SYNC_BARRIER, "pthread_barrier", false },
+
+  // C11 threads.
+  { "mtx_lock", SYNC_ACQUIRE, "mtx", false },
+  { "mtx_unlock", SYNC_RELEASE, "mtx", false },
+
+  // C++11 std::mutex, both as calls and inlined down to gthreads.
+  { "_ZNSt5mutex4lockEv", SYNC_ACQUIRE, "pthread_mutex", false },
+  { "_ZNSt5mutex6unlockEv", SYNC_RELEASE, "pthread_mutex", false },
+  { "__gthread_mutex_lock", SYNC_ACQUIRE, "pthread_mutex", true },
+  { "__gthread_mutex_unlock", SYNC_RELEASE, "pthread_mutex", true },
+
+  // OpenMP (LLVM/Intel and GNU runtimes).
+  { "__kmpc_critical", SYNC_ACQUIRE, "kmpc_critical", false },
+  { "__kmpc_critical_with_hint", SYNC_ACQUIRE, "kmpc_critical", false },
+  { "__kmpc_end_critical", SYNC_RELEASE, "kmpc_critical", false },
+  { "__kmpc_barrier", SYNC_BARRIER, "kmpc_barrier", false },
+  { "GOMP_critical_start", SYNC_ACQUIRE, "gomp_critical", false },
+  { "GOMP_critical_end", SYNC_RELEASE, "gomp_critical", false },
+  { "GOMP_critical_name_start", SYNC_ACQUIRE, "gomp_critical_name", false },
+  { "GOMP_critical_name_end", SYNC_RELEASE, "gomp_critical_name", false },
+  { "GOMP_barrier", SYNC_BARRIER, "gomp_barrier", false },
+
+  // PARSEC's barrier wrapper.
+  { "_Z19parsec_barrier_waitP16parsec_barrier_t", SYNC_BARRIER,
+    "parsec_barrier", false },
+};
+const SyncPrimitive *_findSyncPrimitive(Instruction *inst) {
+  CallInst *call = dyn_cast<CallInst>(inst);
+  if (!call)
+    return NULL;
+  Function *func = call->getCalledFunction();
+  if (!func)
+    return NULL;
+  StringRef name = func->getName();
+  for (unsigned i = 0;
+       i < sizeof(_syncPrimitives) / sizeof(_syncPrimitives[0]); ++i) {
+    const SyncPrimitive &prim = _syncPrimitives[i];
+    if (prim.substring ? name.find(prim.name) != StringRef::npos
+                       : name == prim.name)
+      return &prim;
+  }
+  return NULL;
+}
+
+// Determine whether a value is only used approximately: either the
+// instruction itself is approximate or all of its users are.
+bool hasOnlyApproxUses(const Instruction *inst) {
+  if (isApprox(inst))
+    return true;
+  if (inst->use_empty())
+    return false;
+  for (Value::const_use_iterator ui = inst->use_begin();
+       ui != inst->use_end(); ++ui) {
+    const Instruction *user = dyn_cast<Instruction>(*ui);
+    if (!user || !isApprox(user))
+      return false;
+  }
+  return true;
+}
+
+// Extend a chain of instructions (e.g., operations to be rewritten at a
+// different precision) with the phi nodes from `phis` that only connect the
+// chain: all of their incoming values are constants, chain instructions, or
+// other such phis, and all of their users are in the chain or such phis.
+// Phis are assumed to qualify until shown otherwise, so cycles of phis
+// through loops are included.
+void addChainPhis(std::set<Instruction*> &chain, std::set<PHINode*> &phis) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (std::set<PHINode*>::iterator i = phis.begin(); i != phis.end();) {
+      PHINode *phi = *i++;
+      bool ok = true;
+      for (unsigned j = 0; ok && j < phi->getNumIncomingValues(); ++j) {
+        Value *in = phi->getIncomingValue(j);
+        if (PHINode *inPhi = dyn_cast<PHINode>(in))
+          ok = phis.count(inPhi);
+        else if (Instruction *inInst = dyn_cast<Instruction>(in))
+          ok = chain.count(inInst);
+        else
+          ok = isa<Constant>(in);
+      }
+      for (Value::use_iterator ui = phi->use_begin();
+           ok && ui != phi->use_end(); ++ui) {
+        Instruction *user = cast<Instruction>(*ui);
+        if (PHINode *userPhi = dyn_cast<PHINode>(user))
+          ok = phis.count(userPhi);
+        else
+          ok = chain.count(user);
+      }
+      if (!ok) {
+        phis.erase(phi);
+        changed = true;
+      }
+    }
+  }
+  chain.insert(phis.begin(), phis.end());
+}
+
 const char *FUNC_ACQUIRE = "pthread_mutex_lock";
-const char *FUNC_RELEASE = "pthread_mutex_unlock";
+const char *FUNC_BARRIER = "pthread_barrier_wait";
 bool isCallOf(Instruction *inst, const char *fname) {
   CallInst *call = dyn_cast<CallInst>(inst);
   if (call) {
@@ -180,11 +298,25 @@ bool isCallOf(Instruction *inst, const char *fname) {
   }
   return false;
 }
+SyncKind syncKind(Instruction *inst) {
+  const SyncPrimitive *prim = _findSyncPrimitive(inst);
+  return prim ? prim->kind : SYNC_NONE;
+}
 bool isAcquire(Instruction *inst) {
-  return isCallOf(inst, FUNC_ACQUIRE);
+  return syncKind(inst) == SYNC_ACQUIRE;
 }
 bool isRelease(Instruction *inst) {
-  return isCallOf(inst, FUNC_RELEASE);
+  return syncKind(inst) == SYNC_RELEASE;
+}
+bool isBarrier(Instruction *inst) {
+  return syncKind(inst) == SYNC_BARRIER;
+}
+bool isSyncPair(Instruction *acq, Instruction *rel) {
+  const SyncPrimitive *acqPrim = _findSyncPrimitive(acq);
+  const SyncPrimitive *relPrim = _findSyncPrimitive(rel);
+  if (!acqPrim || !relPrim)
+    return false;
+  return StringRef(acqPrim->family) == relPrim->family;
 }
 
 // An internal whitelist for functions considered to be pure.
@@ -432,7 +564,8 @@ int ApproxInfo::preciseEscapeCheckHelper(std::map<Instruction*, bool> &flags,
       bool found = false;
       for (std::map<Instruction*, bool>::iterator j = flags.begin();
           j != flags.end(); ++j) {
-        if (!j->second && isRelease(j->first)) {
+        if (!j->second && isRelease(j->first) &&
+            isSyncPair(i->first, j->first)) {
           // Balanced acquire/release pair.
           i->second = true;
           j->second = true;
@@ -0,0 +1,284 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+#include "llvm/IntrinsicInst.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace llvm;
+
+// Approximate strength reduction. Approximate divisions, remainders, and
+// square roots are rewritten in terms of multiplication:
+//
+// - A loop-invariant (or constant) divisor's reciprocal is computed once,
+//   before the loop, and the division becomes a multiplication. This is
+//   exact up to rounding.
+// - Otherwise, the reciprocal (or reciprocal square root) starts from the
+//   bit-level estimate and is refined by Newton steps.
+//
+// Integer divisions go through double-precision arithmetic, and quotients
+// saturate to the integer type's range. The site's
+// parameter p (1 to ARITH_MAX_PARAM) selects ARITH_MAX_PARAM - p Newton
+// steps, so p = 3 uses the bare estimate.
+
+#define ARITH_MAX_PARAM 3
+
+namespace {
+  // The bit-level estimates for 1/x and 1/sqrt(x), indexed by whether the
+  // type is double.
+  const uint64_t recipMagic[] = {0x7ef311c3ull, 0x7fde623822fc16e6ull};
+  const uint64_t rsqrtMagic[] = {0x5f3759dfull, 0x5fe6eb50c7b537a9ull};
+
+  IntegerType *bitsType(Type *type) {
+    return IntegerType::get(type->getContext(),
+                            type->getPrimitiveSizeInBits());
+  }
+
+  // Estimate 1/x with `steps` Newton steps. The estimate is computed on |x|,
+  // and x's sign is copied to the result.
+  Value *recipEstimate(IRBuilder<> &builder, Value *x, int steps) {
+    Type *type = x->getType();
+    IntegerType *intTy = bitsType(type);
+    uint64_t signBit = UINT64_C(1) << (intTy->getBitWidth() - 1);
+
+    Value *bits = builder.CreateBitCast(x, intTy);
+    Value *sign = builder.CreateAnd(bits, ConstantInt::get(intTy, signBit));
+    Value *mag = builder.CreateAnd(bits, ConstantInt::get(intTy, ~signBit));
+    Value *est = builder.CreateSub(
+        ConstantInt::get(intTy, recipMagic[type->isDoubleTy()]), mag);
+    Value *y = builder.CreateBitCast(builder.CreateOr(est, sign), type,
+                                     "recip_est");
+
+    // y = y * (2 - x * y)
+    Value *two = ConstantFP::get(type, 2.0);
+    for (int i = 0; i < steps; ++i)
+      y = builder.CreateFMul(y, builder.CreateFSub(two,
+          builder.CreateFMul(x, y)), "recip_step");
+    return y;
+  }
+
+  // Estimate 1/sqrt(x) with `steps` Newton steps.
+  Value *rsqrtEstimate(IRBuilder<> &builder, Value *x, int steps) {
+    Type *type = x->getType();
+    IntegerType *intTy = bitsType(type);
+
+    Value *bits = builder.CreateBitCast(x, intTy);
+    Value *est = builder.CreateSub(
+        ConstantInt::get(intTy, rsqrtMagic[type->isDoubleTy()]),
+        builder.CreateLShr(bits, 1));
+    Value *y = builder.CreateBitCast(est, type, "rsqrt_est");
+
+    // y = y * (1.5 - 0.5 * x * y * y)
+    Value *halfX = builder.CreateFMul(ConstantFP::get(type, 0.5), x);
+    Value *threeHalves = ConstantFP::get(type, 1.5);
+    for (int i = 0; i < steps; ++i)
+      y = builder.CreateFMul(y, builder.CreateFSub(threeHalves,
+          builder.CreateFMul(halfX, builder.CreateFMul(y, y))), "rsqrt_step");
+    return y;
+  }
+
+  // Convert x to an integer of type intTy, saturating where the conversion
+  // would overflow. (Out-of-range conversions produce undefined values.)
+  // NaNs convert to the minimum.
+  Value *fpToIntSat(IRBuilder<> &builder, Value *x, IntegerType *intTy,
+                    bool isSigned) {
+    Type *type = x->getType();
+    unsigned bits = intTy->getBitWidth() - (isSigned ? 1 : 0);
+    int mantissa = type->isDoubleTy() ? 53 : 24;
+    // The largest value of the type that is no more than 2^bits - 1.
+    double hi = (int)bits <= mantissa ? std::ldexp(1.0, bits) - 1.0 :
+        std::ldexp(1.0, bits) - std::ldexp(1.0, bits - mantissa);
+    Constant *hiC = ConstantFP::get(type, hi);
+    Constant *loC = ConstantFP::get(type, isSigned ? -std::ldexp(1.0, bits)
+                                                   : 0.0);
+    x = builder.CreateSelect(builder.CreateFCmpOGT(x, hiC), hiC, x);
+    x = builder.CreateSelect(builder.CreateFCmpULT(x, loC), loC, x);
+    return isSigned ? builder.CreateFPToSI(x, intTy) :
+                      builder.CreateFPToUI(x, intTy);
+  }
+
+  bool isScalarFP(Type *type) {
+    return type->isFloatTy() || type->isDoubleTy();
+  }
+
+  bool isSqrt(Instruction *inst) {
+    if (IntrinsicInst *intr = dyn_cast<IntrinsicInst>(inst))
+      return intr->getIntrinsicID() == Intrinsic::sqrt &&
+             isScalarFP(intr->getType());
+    return false;
+  }
+}
+
+// Compute the reciprocal of a divisor for the division `inst`. Integer
+// divisors are converted to double first.
+Value *ACCEPTPass::arithReciprocal(Instruction *inst, Value *divisor,
+                                   int steps, LogDescription *desc) {
+  Type *fpTy = isScalarFP(divisor->getType()) ? divisor->getType() :
+               Type::getDoubleTy(module->getContext());
+  bool isSigned = inst->getOpcode() == Instruction::SDiv ||
+                  inst->getOpcode() == Instruction::SRem;
+
+  // Integer quotients are truncated, so nudge the reciprocal up to keep
+  // exact quotients from rounding down to the next integer.
+  Constant *one = ConstantFP::get(fpTy,
+      isScalarFP(divisor->getType()) ? 1.0 :
+                                       1.0 + 1.0 / (UINT64_C(1) << 44));
+
+  // Constant divisor: fold the reciprocal.
+  if (Constant *c = dyn_cast<Constant>(divisor)) {
+    ACCEPT_LOG << "constant divisor\n";
+    if (!isScalarFP(c->getType()))
+      c = isSigned ? ConstantExpr::getSIToFP(c, fpTy) :
+                     ConstantExpr::getUIToFP(c, fpTy);
+    return ConstantExpr::getFDiv(one, c);
+  }
+
+  // Loop-invariant divisor: compute the exact reciprocal in the preheader.
+  LoopInfo &loopInfo = getAnalysis<LoopInfo>();
+  Loop *loop = loopInfo.getLoopFor(inst->getParent());
+  if (loop && loop->isLoopInvariant(divisor) && loop->getLoopPreheader()) {
+    ACCEPT_LOG << "loop-invariant divisor\n";
+    IRBuilder<> builder(loop->getLoopPreheader()->getTerminator());
+    Value *fpDivisor = divisor;
+    if (!isScalarFP(divisor->getType()))
+      fpDivisor = isSigned ? builder.CreateSIToFP(divisor, fpTy) :
+                             builder.CreateUIToFP(divisor, fpTy);
+    return builder.CreateFDiv(one, fpDivisor, "recip");
+  }
+
+  ACCEPT_LOG << "reciprocal estimate with " << steps << " Newton steps\n";
+  IRBuilder<> builder(inst);
+  Value *fpDivisor = divisor;
+  if (!isScalarFP(divisor->getType()))
+    fpDivisor = isSigned ? builder.CreateSIToFP(divisor, fpTy) :
+                           builder.CreateUIToFP(divisor, fpTy);
+  return recipEstimate(builder, fpDivisor, steps);
+}
+
+// Rewrite a division, remainder, or square root.
+void ACCEPTPass::reduceArith(Instruction *inst, int param,
+                             LogDescription *desc) {
+  int steps = ARITH_MAX_PARAM - std::min(param, ARITH_MAX_PARAM);
+  Type *type = inst->getType();
+  Value *result;
+
+  if (isSqrt(inst)) {
+    // sqrt(x) = x * (1 / sqrt(x))
+    IRBuilder<> builder(inst);
+    Value *x = cast<CallInst>(inst)->getArgOperand(0);
+    result = builder.CreateFMul(x, rsqrtEstimate(builder, x, steps));
+  } else {
+    Value *dividend = inst->getOperand(0);
+    Value *divisor = inst->getOperand(1);
+    Value *recip = arithReciprocal(inst, divisor, steps, desc);
+    IRBuilder<> builder(inst);
+
+    switch (inst->getOpcode()) {
+    case Instruction::FDiv:
+      result = builder.CreateFMul(dividend, recip);
+      break;
+    case Instruction::FRem: {
+      // a - trunc(a / b) * b; the truncation goes through an integer.
+      // Quotients of 2^(mantissa bits) or more are already integers, and
+      // converting them could overflow, so they are used as they are.
+      IntegerType *intTy = bitsType(type);
+      Value *quot = builder.CreateFMul(dividend, recip);
+      double big = std::ldexp(1.0, type->isDoubleTy() ? 52 : 23);
+      Value *small = builder.CreateAnd(
+          builder.CreateFCmpOLT(quot, ConstantFP::get(type, big)),
+          builder.CreateFCmpOGT(quot, ConstantFP::get(type, -big)));
+      Value *truncated = builder.CreateSIToFP(builder.CreateFPToSI(
+          builder.CreateSelect(small, quot, ConstantFP::get(type, 0.0)),
+          intTy), type);
+      quot = builder.CreateSelect(small, truncated, quot);
+      result = builder.CreateFSub(dividend, builder.CreateFMul(quot,
+                                                              divisor));
+      break;
+    }
+    default: {
+      // Integer division and remainder.
+      bool isSigned = inst->getOpcode() == Instruction::SDiv ||
+                      inst->getOpcode() == Instruction::SRem;
+      Type *fpTy = recip->getType();
+      Value *fpDividend = isSigned ?
+          builder.CreateSIToFP(dividend, fpTy) :
+          builder.CreateUIToFP(dividend, fpTy);
+      // An estimated reciprocal can push the quotient out of range.
+      Value *fpQuot = builder.CreateFMul(fpDividend, recip);
+      Value *quot = fpToIntSat(builder, fpQuot, cast<IntegerType>(type),
+                               isSigned);
+      if (inst->getOpcode() == Instruction::SDiv ||
+          inst->getOpcode() == Instruction::UDiv)
+        result = quot;
+      else
+        result = builder.CreateSub(dividend,
+                                   builder.CreateMul(quot, divisor));
+      break;
+    }
+    }
+  }
+
+  result->takeName(inst);
+  inst->replaceAllUsesWith(result);
+  inst->eraseFromParent();
+}
+
+bool ACCEPTPass::optimizeArith(Function &F) {
+  std::vector<Instruction*> insts;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      switch (ii->getOpcode()) {
+      case Instruction::FDiv:
+      case Instruction::FRem:
+        if (isScalarFP(ii->getType()))
+          insts.push_back(ii);
+        break;
+      case Instruction::SDiv:
+      case Instruction::UDiv:
+      case Instruction::SRem:
+      case Instruction::URem:
+        // LLVM already reduces division by integer constants.
+        if (ii->getType()->isIntegerTy() && !isa<Constant>(ii->getOperand(1)))
+          insts.push_back(ii);
+        break;
+      case Instruction::Call:
+        if (isSqrt(ii))
+          insts.push_back(ii);
+        break;
+      }
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<Instruction*>::iterator i = insts.begin();
+       i != insts.end(); ++i) {
+    Instruction *inst = *i;
+    // All reducible operations on a source line share a site.
+    std::string optName = siteName("arith", inst);
+    LogDescription *desc = AI->logAdd("Arithmetic", inst);
+    ACCEPT_LOG << optName << ": " << inst->getOpcodeName() << "\n";
+
+    if (AI->instMarker(inst) == markerForbid) {
+      ACCEPT_LOG << "optimization forbidden\n";
+      continue;
+    }
+    // The sqrt intrinsic is a call, so check its uses instead.
+    if (isa<CallInst>(inst) ? !hasOnlyApproxUses(inst) : !isApprox(inst)) {
+      ACCEPT_LOG << "precise\n";
+      continue;
+    }
+
+    if (relax) {
+      int param = relaxConfig[optName];
+      if (param) {
+        reduceArith(inst, param, desc);
+        modified = true;
+      }
+    } else {
+      ACCEPT_LOG << "can reduce\n";
+      relaxConfig[optName] = 0;
+    }
+  }
+  return modified;
+}
@@ -0,0 +1,437 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Module.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include <sstream>
+
+using namespace llvm;
+
+// Compressed storage. When an allocation's site is relaxed, its approximate
+// float or double array is stored in a narrower format, so streaming over it
+// moves less memory. The allocation shrinks and every element load and store
+// converts to and from the storage format. The conversions are plain integer
+// and FP casts (no library calls), so loops over the array still vectorize.
+//
+// The site's parameter picks the format, from most to least precise among
+// those narrower than the element type: for doubles, 1 is float, 2 is
+// bfloat16 (a float with a truncated mantissa), and 3 is IEEE half
+// precision; for floats, 1 is bfloat16, 2 is half precision, and 3 is an
+// 8-bit float (a half with a truncated mantissa, or E5M2).
+//
+// This only applies to allocations whose elements are accessed exclusively
+// through loads and stores in the allocating function: stack arrays and
+// malloc/calloc results whose pointers only flow through GEPs, local pointer
+// variables, and free().
+
+namespace {
+  enum CompressFormat {
+    compressFloat,
+    compressBFloat16,
+    compressHalf,
+    compressFP8
+  };
+
+  bool compressibleElem(Type *type) {
+    return type->isFloatTy() || type->isDoubleTy();
+  }
+
+  CompressFormat compressFormat(Type *elemTy, int param) {
+    if (elemTy->isDoubleTy()) {
+      if (param <= 1)
+        return compressFloat;
+      return param == 2 ? compressBFloat16 : compressHalf;
+    }
+    if (param <= 1)
+      return compressBFloat16;
+    return param == 2 ? compressHalf : compressFP8;
+  }
+
+  Type *storageType(LLVMContext &ctx, CompressFormat format) {
+    if (format == compressFloat)
+      return Type::getFloatTy(ctx);
+    if (format == compressFP8)
+      return Type::getInt8Ty(ctx);
+    return Type::getInt16Ty(ctx);
+  }
+
+  // Can the elements pointed to by `ptr` be stored in another format? Only
+  // simple loads and stores qualify, along with single-index GEPs, pointer
+  // variables that are only assigned once, and casts for free().
+  // Approximate pointers among these set `approx`.
+  bool compressibleUses(Value *ptr, bool &approx) {
+    if (isApproxPtr(ptr))
+      approx = true;
+
+    for (Value::use_iterator ui = ptr->use_begin(); ui != ptr->use_end();
+         ++ui) {
+      if (LoadInst *load = dyn_cast<LoadInst>(*ui)) {
+        if (!load->isSimple())
+          return false;
+      } else if (StoreInst *store = dyn_cast<StoreInst>(*ui)) {
+        if (!store->isSimple())
+          return false;
+        if (store->getValueOperand() != ptr)
+          continue;
+
+        // Storing the pointer into a local variable. The variable's loads
+        // are element pointers too.
+        AllocaInst *slot = dyn_cast<AllocaInst>(store->getPointerOperand());
+        if (!slot || slot->isArrayAllocation())
+          return false;
+        for (Value::use_iterator si = slot->use_begin();
+             si != slot->use_end(); ++si) {
+          if (*si == store)
+            continue;
+          LoadInst *slotLoad = dyn_cast<LoadInst>(*si);
+          if (!slotLoad || !slotLoad->isSimple() ||
+              !compressibleUses(slotLoad, approx))
+            return false;
+        }
+      } else if (GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(*ui)) {
+        if (gep->getPointerOperand() != ptr || gep->getNumIndices() != 1 ||
+            !compressibleUses(gep, approx))
+          return false;
+      } else if (BitCastInst *cast = dyn_cast<BitCastInst>(*ui)) {
+        for (Value::use_iterator ci = cast->use_begin();
+             ci != cast->use_end(); ++ci) {
+          Instruction *user = dyn_cast<Instruction>(*ci);
+          if (!user || !isCallOf(user, "free"))
+            return false;
+        }
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The element type of an allocation that looks like a float or double
+  // array, or NULL.
+  Type *allocElemType(Instruction *inst) {
+    if (AllocaInst *alloca = dyn_cast<AllocaInst>(inst)) {
+      Type *type = alloca->getAllocatedType();
+      if (ArrayType *arrayTy = dyn_cast<ArrayType>(type)) {
+        if (!alloca->isArrayAllocation() &&
+            compressibleElem(arrayTy->getElementType()))
+          return arrayTy->getElementType();
+      } else if (alloca->isArrayAllocation() && compressibleElem(type)) {
+        return type;
+      }
+      return NULL;
+    }
+
+    if (isCallOf(inst, "malloc") || isCallOf(inst, "calloc")) {
+      for (Value::use_iterator ui = inst->use_begin(); ui != inst->use_end();
+           ++ui) {
+        if (BitCastInst *cast = dyn_cast<BitCastInst>(*ui)) {
+          PointerType *ptrTy = dyn_cast<PointerType>(cast->getType());
+          if (ptrTy && compressibleElem(ptrTy->getElementType()))
+            return ptrTy->getElementType();
+        }
+      }
+    }
+    return NULL;
+  }
+
+  // Check every use of an allocation with the given element type.
+  bool compressibleAlloc(Instruction *inst, Type *elemTy, bool &approx) {
+    if (isApproxPtr(inst))
+      approx = true;
+
+    AllocaInst *alloca = dyn_cast<AllocaInst>(inst);
+    if (alloca && !alloca->getAllocatedType()->isArrayTy())
+      return compressibleUses(alloca, approx);
+
+    for (Value::use_iterator ui = inst->use_begin(); ui != inst->use_end();
+         ++ui) {
+      if (alloca) {
+        // Stack arrays: element pointers come from two-index GEPs.
+        GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(*ui);
+        if (!gep || gep->getPointerOperand() != alloca ||
+            gep->getNumIndices() != 2 || !compressibleUses(gep, approx))
+          return false;
+      } else {
+        // Heap arrays: element pointers are casts of the allocation.
+        Instruction *user = dyn_cast<Instruction>(*ui);
+        if (user && isCallOf(user, "free"))
+          continue;
+        BitCastInst *cast = dyn_cast<BitCastInst>(*ui);
+        if (!cast || cast->getType() != PointerType::getUnqual(elemTy) ||
+            !compressibleUses(cast, approx))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // Convert an element to the storage format. Rounding is to nearest;
+  // half-precision (and 8-bit) subnormals flush to zero.
+  Value *compressValue(IRBuilder<> &builder, Value *v,
+                       CompressFormat format) {
+    if (!v->getType()->isFloatTy())
+      v = builder.CreateFPTrunc(v, builder.getFloatTy());
+    if (format == compressFloat)
+      return v;
+
+    Value *bits = builder.CreateBitCast(v, builder.getInt32Ty());
+    if (format == compressBFloat16) {
+      bits = builder.CreateAdd(bits, builder.getInt32(0x8000));
+      return builder.CreateTrunc(builder.CreateLShr(bits, 16),
+                                 builder.getInt16Ty());
+    }
+
+    // Rebias the exponent from 127 to 15 and round the mantissa to ten
+    // bits, then handle overflow, NaNs, and underflow.
+    Value *sign = builder.CreateAnd(builder.CreateLShr(bits, 16),
+                                    builder.getInt32(0x8000));
+    Value *mag = builder.CreateAnd(bits, builder.getInt32(0x7fffffff));
+    Value *half = builder.CreateSub(
+        builder.CreateLShr(builder.CreateAdd(mag, builder.getInt32(0x1000)),
+                           13),
+        builder.getInt32(112 << 10));
+    half = builder.CreateSelect(
+        builder.CreateICmpUGE(mag, builder.getInt32(0x477ff000)),
+        builder.getInt32(0x7c00), half);
+    half = builder.CreateSelect(
+        builder.CreateICmpUGT(mag, builder.getInt32(0x7f800000)),
+        builder.getInt32(0x7e00), half);
+    half = builder.CreateSelect(
+        builder.CreateICmpULT(mag, builder.getInt32(0x38800000)),
+        builder.getInt32(0), half);
+    half = builder.CreateOr(sign, half);
+    if (format == compressFP8) {
+      // Round the half's mantissa again, to two bits. This can only carry
+      // into the exponent, never the sign.
+      half = builder.CreateAdd(half, builder.getInt32(0x80));
+      return builder.CreateTrunc(builder.CreateLShr(half, 8),
+                                 builder.getInt8Ty());
+    }
+    return builder.CreateTrunc(half, builder.getInt16Ty());
+  }
+
+  // Convert a stored value back to the element type.
+  Value *decompressValue(IRBuilder<> &builder, Value *v,
+                         CompressFormat format, Type *elemTy) {
+    if (format != compressFloat) {
+      Value *bits = builder.CreateZExt(v, builder.getInt32Ty());
+      if (format == compressFP8)
+        bits = builder.CreateShl(bits, 8);
+      if (format == compressBFloat16) {
+        bits = builder.CreateShl(bits, 16);
+      } else {
+        Value *sign = builder.CreateShl(
+            builder.CreateAnd(bits, builder.getInt32(0x8000)), 16);
+        Value *mag = builder.CreateAnd(bits, builder.getInt32(0x7fff));
+        Value *shifted = builder.CreateShl(mag, 13);
+        Value *single = builder.CreateAdd(shifted,
+                                          builder.getInt32(112 << 23));
+        single = builder.CreateSelect(
+            builder.CreateICmpUGE(mag, builder.getInt32(0x7c00)),
+            builder.CreateOr(shifted, builder.getInt32(0x7f800000)), single);
+        single = builder.CreateSelect(
+            builder.CreateICmpULT(mag, builder.getInt32(0x0400)),
+            builder.getInt32(0), single);
+        bits = builder.CreateOr(sign, single);
+      }
+      v = builder.CreateBitCast(bits, builder.getFloatTy());
+    }
+    if (elemTy->isDoubleTy())
+      v = builder.CreateFPExt(v, elemTy);
+    return v;
+  }
+
+  // Rewrite the accesses through an element pointer (as accepted by
+  // compressibleUses) to go through `newPtr` instead, then remove them.
+  void compressUses(Value *ptr, Value *newPtr, CompressFormat format,
+                    Type *elemTy) {
+    std::vector<User*> users(ptr->use_begin(), ptr->use_end());
+    for (std::vector<User*>::iterator i = users.begin(); i != users.end();
+         ++i) {
+      if (LoadInst *load = dyn_cast<LoadInst>(*i)) {
+        IRBuilder<> builder(load);
+        LoadInst *newLoad = builder.CreateLoad(newPtr);
+        newLoad->setMetadata("quals", load->getMetadata("quals"));
+        Value *v = decompressValue(builder, newLoad, format, elemTy);
+        v->takeName(load);
+        load->replaceAllUsesWith(v);
+        load->eraseFromParent();
+      } else if (StoreInst *store = dyn_cast<StoreInst>(*i)) {
+        IRBuilder<> builder(store);
+        if (store->getPointerOperand() == ptr) {
+          Value *v = compressValue(builder, store->getValueOperand(), format);
+          StoreInst *newStore = builder.CreateStore(v, newPtr);
+          newStore->setMetadata("quals", store->getMetadata("quals"));
+        } else {
+          // A pointer variable: replace it with one of the new type.
+          AllocaInst *slot = cast<AllocaInst>(store->getPointerOperand());
+          AllocaInst *newSlot = new AllocaInst(newPtr->getType(), "", slot);
+          newSlot->takeName(slot);
+          builder.CreateStore(newPtr, newSlot);
+          std::vector<User*> slotUsers(slot->use_begin(), slot->use_end());
+          for (std::vector<User*>::iterator si = slotUsers.begin();
+               si != slotUsers.end(); ++si) {
+            if (LoadInst *slotLoad = dyn_cast<LoadInst>(*si)) {
+              IRBuilder<> loadBuilder(slotLoad);
+              LoadInst *newLoad = loadBuilder.CreateLoad(newSlot);
+              newLoad->setMetadata("quals",
+                                   slotLoad->getMetadata("quals"));
+              compressUses(slotLoad, newLoad, format, elemTy);
+              slotLoad->eraseFromParent();
+            }
+          }
+          store->eraseFromParent();
+          slot->eraseFromParent();
+          continue;
+        }
+        store->eraseFromParent();
+      } else if (GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(*i)) {
+        IRBuilder<> builder(gep);
+        Value *newGep = builder.CreateGEP(newPtr, *gep->idx_begin());
+        newGep->takeName(gep);
+        compressUses(gep, newGep, format, elemTy);
+        gep->eraseFromParent();
+      } else {
+        // A cast for free().
+        cast<BitCastInst>(*i)->setOperand(0, newPtr);
+      }
+    }
+  }
+}
+
+void ACCEPTPass::compressAlloc(Instruction *inst, Type *elemTy, int param) {
+  CompressFormat format = compressFormat(elemTy, param);
+  Type *storeTy = storageType(module->getContext(), format);
+  unsigned ratio = elemTy->getPrimitiveSizeInBits() /
+                   storeTy->getPrimitiveSizeInBits();
+
+  if (AllocaInst *alloca = dyn_cast<AllocaInst>(inst)) {
+    ArrayType *arrayTy = dyn_cast<ArrayType>(alloca->getAllocatedType());
+    AllocaInst *newAlloca;
+    if (arrayTy)
+      newAlloca = new AllocaInst(
+          ArrayType::get(storeTy, arrayTy->getNumElements()), "", alloca);
+    else
+      newAlloca = new AllocaInst(storeTy, alloca->getArraySize(), "",
+                                 alloca);
+    newAlloca->takeName(alloca);
+
+    if (arrayTy) {
+      std::vector<User*> users(alloca->use_begin(), alloca->use_end());
+      for (std::vector<User*>::iterator i = users.begin(); i != users.end();
+           ++i) {
+        GetElementPtrInst *gep = cast<GetElementPtrInst>(*i);
+        std::vector<Value*> indices(gep->idx_begin(), gep->idx_end());
+        IRBuilder<> builder(gep);
+        Value *newGep = builder.CreateGEP(newAlloca, indices);
+        newGep->takeName(gep);
+        compressUses(gep, newGep, format, elemTy);
+        gep->eraseFromParent();
+      }
+    } else {
+      compressUses(alloca, newAlloca, format, elemTy);
+    }
+    alloca->eraseFromParent();
+    return;
+  }
+
+  // Shrink the allocation: the size is malloc's only argument and calloc's
+  // second one.
+  CallInst *call = cast<CallInst>(inst);
+  unsigned sizeArg = call->getNumArgOperands() - 1;
+  IRBuilder<> builder(call);
+  Value *size = call->getArgOperand(sizeArg);
+  size = builder.CreateUDiv(
+      builder.CreateAdd(size, ConstantInt::get(size->getType(), ratio - 1)),
+      ConstantInt::get(size->getType(), ratio));
+  call->setArgOperand(sizeArg, size);
+
+  std::vector<User*> users(call->use_begin(), call->use_end());
+  for (std::vector<User*>::iterator i = users.begin(); i != users.end();
+       ++i) {
+    BitCastInst *cast = dyn_cast<BitCastInst>(*i);
+    if (!cast)
+      continue;  // free()
+    BitCastInst *newCast = new BitCastInst(
+        call, PointerType::getUnqual(storeTy), "", cast);
+    newCast->takeName(cast);
+    compressUses(cast, newCast, format, elemTy);
+    cast->eraseFromParent();
+  }
+}
+
+// Name an allocation's site. Allocas have no location of their own, so a
+// stack array is named after its variable and its declaration.
+std::string ACCEPTPass::compressSiteName(Instruction *inst) {
+  if (!isa<AllocaInst>(inst))
+    return siteName("compress", inst);
+
+  std::stringstream ss;
+  ss << "compress of ";
+  DbgDeclareInst *declare = FindAllocaDbgDeclare(inst);
+  if (declare && DIVariable(declare->getVariable()).getName().size())
+    ss << DIVariable(declare->getVariable()).getName().str();
+  else if (inst->hasName())
+    ss << inst->getName().str();
+  else
+    ss << "array";
+  ss << " at ";
+  if (declare && !declare->getDebugLoc().isUnknown())
+    ss << srcPosDesc(*module, declare->getDebugLoc());
+  else
+    ss << inst->getParent()->getParent()->getName().str();
+  return ss.str();
+}
+
+bool ACCEPTPass::optimizeCompression(Function &F) {
+  std::vector<Instruction*> allocs;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (allocElemType(ii))
+        allocs.push_back(ii);
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<Instruction*>::iterator i = allocs.begin();
+       i != allocs.end(); ++i) {
+    Instruction *inst = *i;
+    Type *elemTy = allocElemType(inst);
+
+    std::string optName = compressSiteName(inst);
+    Instruction *where = inst;
+    if (isa<AllocaInst>(inst))
+      if (DbgDeclareInst *declare = FindAllocaDbgDeclare(inst))
+        where = declare;
+    LogDescription *desc = AI->logAdd("Allocation", where);
+    ACCEPT_LOG << optName << "\n";
+
+    if (AI->instMarker(inst) == markerForbid) {
+      ACCEPT_LOG << "optimization forbidden\n";
+      continue;
+    }
+    bool approx = false;
+    if (!compressibleAlloc(inst, elemTy, approx)) {
+      ACCEPT_LOG << "array is used other than by loads and stores\n";
+      continue;
+    }
+    if (!approx) {
+      ACCEPT_LOG << "array is not approximate\n";
+      continue;
+    }
+
+    if (relax) {
+      int param = relaxConfig[optName];
+      if (param) {
+        ACCEPT_LOG << "compressing with format " << param << "\n";
+        compressAlloc(inst, elemTy, param);
+        modified = true;
+      }
+    } else {
+      ACCEPT_LOG << "can compress\n";
+      relaxConfig[optName] = 0;
+    }
+  }
+  return modified;
+}
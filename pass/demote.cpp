@@ -0,0 +1,157 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+
+using namespace llvm;
+
+// Precision demotion. When a function's site is relaxed, its approximate
+// double-precision arithmetic is carried out in single precision instead.
+// Chains of approximate operations (and the phi nodes that connect them)
+// are demoted together, so conversions only appear at their boundaries:
+// where a chain reads a precise or non-arithmetic value (e.g., a load or a
+// call result) and where one of its results is used outside the chain. The
+// memory layout doesn't change: loads and stores still use doubles.
+
+namespace {
+  bool isDemotable(Instruction *inst) {
+    return isa<BinaryOperator>(inst) && inst->getType()->isDoubleTy() &&
+           isApprox(inst);
+  }
+
+  // Find the values to demote: approximate double arithmetic plus the
+  // double phis that only connect such arithmetic (and constants).
+  void findDemotable(Function &F, std::set<Instruction*> &chain) {
+    std::set<PHINode*> phis;
+    for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+      for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+        if (isDemotable(ii))
+          chain.insert(ii);
+        else if (PHINode *phi = dyn_cast<PHINode>(ii))
+          if (phi->getType()->isDoubleTy())
+            phis.insert(phi);
+      }
+    }
+
+    addChainPhis(chain, phis);
+  }
+}
+
+// Get the single-precision version of a value used at `user`.
+Value *ACCEPTPass::demotedValue(Value *v, Instruction *user,
+                                std::map<Value*, Value*> &demoted,
+                                const std::set<Instruction*> &chain) {
+  Type *floatTy = Type::getFloatTy(module->getContext());
+
+  if (demoted.count(v))
+    return demoted[v];
+  if (Constant *c = dyn_cast<Constant>(v))
+    return ConstantExpr::getFPTrunc(c, floatTy);
+
+  Instruction *inst = dyn_cast<Instruction>(v);
+  if (inst && chain.count(inst)) {
+    // Demote the operation itself, right before the original. Its operands
+    // dominate it, so their demoted versions can be created first. (Phis
+    // are created up front, so this recursion stops at them.)
+    BinaryOperator *op = cast<BinaryOperator>(inst);
+    Value *lhs = demotedValue(op->getOperand(0), op, demoted, chain);
+    Value *rhs = demotedValue(op->getOperand(1), op, demoted, chain);
+    IRBuilder<> builder(op);
+    Value *result = builder.CreateBinOp(op->getOpcode(), lhs, rhs,
+                                        op->getName() + ".f");
+    if (Instruction *resultInst = dyn_cast<Instruction>(result))
+      resultInst->setMetadata("quals", op->getMetadata("quals"));
+    demoted[v] = result;
+    return result;
+  }
+
+  // A boundary: narrow the value where it's used. (Only arithmetic has
+  // boundary operands; phis in the chain only have chain or constant
+  // incoming values.) If the value was just widened from a float, use the
+  // float directly.
+  if (FPExtInst *ext = dyn_cast<FPExtInst>(v))
+    if (ext->getSrcTy()->isFloatTy())
+      return ext->getOperand(0);
+  return new FPTruncInst(v, floatTy, v->getName() + ".f", user);
+}
+
+void ACCEPTPass::demoteChain(const std::set<Instruction*> &chain) {
+  Type *floatTy = Type::getFloatTy(module->getContext());
+  std::map<Value*, Value*> demoted;
+
+  // Create the demoted phis first so loop-carried values can refer to them.
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    if (PHINode *phi = dyn_cast<PHINode>(*i))
+      demoted[phi] = PHINode::Create(floatTy, phi->getNumIncomingValues(),
+                                     phi->getName() + ".f", phi);
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    if (PHINode *phi = dyn_cast<PHINode>(inst)) {
+      PHINode *newPhi = cast<PHINode>(demoted[phi]);
+      for (unsigned j = 0; j < phi->getNumIncomingValues(); ++j) {
+        Value *in = demotedValue(phi->getIncomingValue(j), phi, demoted,
+                                 chain);
+        newPhi->addIncoming(in, phi->getIncomingBlock(j));
+      }
+    } else {
+      demotedValue(inst, inst, demoted, chain);
+    }
+  }
+
+  // Widen results that escape the chain, then remove the originals. Users
+  // inside the chain are about to be removed too, so most of these
+  // widenings end up unused.
+  std::vector<Instruction*> exts;
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    Instruction *insertAt = inst;
+    if (isa<PHINode>(inst))
+      insertAt = inst->getParent()->getFirstNonPHI();
+    FPExtInst *ext = new FPExtInst(demoted[inst], inst->getType(),
+                                   inst->getName() + ".d", insertAt);
+    inst->replaceAllUsesWith(ext);
+    exts.push_back(ext);
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    (*i)->dropAllReferences();
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    (*i)->eraseFromParent();
+  }
+  for (std::vector<Instruction*>::iterator i = exts.begin();
+       i != exts.end(); ++i) {
+    if ((*i)->use_empty())
+      (*i)->eraseFromParent();
+  }
+}
+
+bool ACCEPTPass::optimizeDemotion(Function &F) {
+  std::set<Instruction*> chain;
+  findDemotable(F, chain);
+  if (chain.empty())
+    return false;
+
+  // One site per function.
+  std::string optName = funcSiteName("demote", F);
+  LogDescription *desc = logAddFunction(F);
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << chain.size() << " approximate double-precision values\n";
+
+  if (relax) {
+    int param = relaxConfig[optName];
+    if (param) {
+      ACCEPT_LOG << "demoting to single precision\n";
+      demoteChain(chain);
+      return true;
+    }
+  } else {
+    ACCEPT_LOG << "can demote\n";
+    relaxConfig[optName] = 0;
+  }
+  return false;
+}
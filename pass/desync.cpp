@@ -1,136 +1,187 @@
 #include "accept.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+#include "llvm/Support/CommandLine.h"
 
 #include <sstream>
 
 using namespace llvm;
 
-const char *FUNC_BARRIER = "pthread_barrier_wait";
-const char *FUNC_PARSEC_BARRIER = "_Z19parsec_barrier_waitP16parsec_barrier_t";
-bool isBarrier(Instruction *inst) {
-  return isCallOf(inst, FUNC_BARRIER) || isCallOf(inst, FUNC_PARSEC_BARRIER);
+// Barrier relaxation parameters below this value make the barrier
+// synchronize only every 2^param arrivals; this value elides it entirely.
+#define BARRIER_ELIDE_PARAM 7
+
+namespace {
+  // Instrument relaxable synchronization sites for contention profiling
+  // (see rt/syncprof.c).
+  cl::opt<bool> optSyncProf("accept-syncprof",
+      cl::desc("ACCEPT: profile lock and barrier contention"));
 }
 
-void instructionsBetweenHelper(Instruction *end,
-    std::set<Instruction *> &instrs, BasicBlock *curBB,
-    std::set<BasicBlock *> &visited) {
-  // Mark visit.
-  if (visited.count(curBB))
-    return;
-  visited.insert(curBB);
+// Pair every acquire with its release and every barrier with the next
+// barrier in a single walk over the dominator tree. A stack holds the
+// acquires and barriers that dominate the current instruction, innermost on
+// top. A release (or barrier) ends the section begun by the top of the stack
+// when it post-dominates it; since we visit dominators first, this finds the
+// nearest such end. Sections containing other synchronization are rejected
+// later by findCritSec.
+//
+// The same walk collects each section's blocks: every block goes to the
+// innermost section that can contain it. A section's blocks are dominated by
+// its start and post-dominated by its end, and they must be closed under
+// successors until the end. Sections that aren't (for example, ones whose
+// blocks went to a nested section) get no block list.
+void ACCEPTPass::pairSyncs(Function &F) {
+  syncEnds.clear();
+  syncSections.clear();
+  DominatorTree &domTree = getAnalysis<DominatorTree>();
+  PostDominatorTree &postDomTree = getAnalysis<PostDominatorTree>();
+
+  // Explicit DFS over the dominator tree. Each stack frame remembers how
+  // many sync entries it pushed so they can be popped on the way out.
+  std::vector<Instruction*> open;
+  std::vector< std::vector<BasicBlock*> > openBlocks;
+  std::vector< std::pair<DomTreeNode*, unsigned> > work;
+  std::vector<unsigned> openSizes;
+  work.push_back(std::make_pair(domTree.getRootNode(), 0u));
+  while (!work.empty()) {
+    DomTreeNode *node = work.back().first;
+    unsigned &child = work.back().second;
+
+    if (child == 0) {
+      // First visit: scan the block's synchronization.
+      openSizes.push_back(open.size());
+      BasicBlock *bb = node->getBlock();
+      if (!open.empty()) {
+        std::map<Instruction*, Instruction*>::iterator end =
+            syncEnds.find(open.back());
+        if (end == syncEnds.end() ||
+            postDomTree.dominates(end->second->getParent(), bb))
+          openBlocks.back().push_back(bb);
+      }
+
+      for (BasicBlock::iterator bi = bb->begin(); bi != bb->end(); ++bi) {
+        SyncKind kind = syncKind(bi);
+        if (kind == SYNC_NONE)
+          continue;
 
-  // Collect instructions.
-  for (BasicBlock::iterator i = curBB->begin(); i != curBB->end(); ++i) {
-    if (end == i) {
-      return;
+        if (!open.empty() && !syncEnds.count(open.back())) {
+          Instruction *start = open.back();
+          bool ends = (kind == SYNC_RELEASE && isAcquire(start) &&
+                       isSyncPair(start, bi)) ||
+                      (kind == SYNC_BARRIER && isBarrier(start));
+          if (ends && postDomTree.dominates(bb, start->getParent()))
+            syncEnds[start] = bi;
+        }
+
+        if (kind == SYNC_ACQUIRE || kind == SYNC_BARRIER) {
+          open.push_back(bi);
+          openBlocks.push_back(std::vector<BasicBlock*>(1, bb));
+        }
+      }
     }
-    instrs.insert(i);
-  }
 
-  // Recurse into successors.
-  TerminatorInst *term = curBB->getTerminator();
-  if (term->getNumSuccessors() == 0) {
-    errs() << "found exit in begin/end chain!\n";
-    return;
-  }
-  for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
-    instructionsBetweenHelper(end, instrs, term->getSuccessor(i), visited);
+    if (child < node->getNumChildren()) {
+      DomTreeNode *next = node->getChildren()[child];
+      ++child;
+      work.push_back(std::make_pair(next, 0u));
+    } else {
+      // Done with this subtree, so the sections begun here are complete.
+      for (unsigned i = openSizes.back(); i < open.size(); ++i)
+        finishSection(open[i], openBlocks[i], postDomTree);
+      open.resize(openSizes.back());
+      openBlocks.resize(openSizes.back());
+      openSizes.pop_back();
+      work.pop_back();
+    }
   }
 }
 
-void instructionsBetween(Instruction *start, Instruction *end,
-                         std::set<Instruction *> &instrs) {
-  // Handle the first basic block.
-  BasicBlock *startBB = start->getParent();
-  bool entered = false;
-  for (BasicBlock::iterator i = startBB->begin(); i != startBB->end(); ++i) {
-    if (!entered && start == i) {
-      entered = true;
-    } else if (entered && end == i) {
-      return;
-    } else if (entered && start != i) {
-      instrs.insert(i);
-    }
+// Record the blocks of a paired section, keeping only those post-dominated
+// by its end. The section is dropped unless every path from its start stays
+// in these blocks until it reaches the end.
+void ACCEPTPass::finishSection(Instruction *acq,
+                               const std::vector<BasicBlock*> &blocks,
+                               PostDominatorTree &postDomTree) {
+  std::map<Instruction*, Instruction*>::iterator end = syncEnds.find(acq);
+  if (end == syncEnds.end())
+    return;
+  BasicBlock *acqBB = acq->getParent();
+  BasicBlock *relBB = end->second->getParent();
+  if (acqBB == relBB) {
+    syncSections[acq] = std::vector<BasicBlock*>(1, acqBB);
+    return;
   }
 
-  // Recurse into successors.
-  std::set<BasicBlock *> visited;
-  visited.insert(startBB);
-  TerminatorInst *term = startBB->getTerminator();
-  if (term->getNumSuccessors() == 0) {
-    errs() << "found exit in begin/end chain!\n";
-    return;
+  std::vector<BasicBlock*> members;
+  std::set<BasicBlock*> memberSet;
+  for (std::vector<BasicBlock*>::const_iterator i = blocks.begin();
+       i != blocks.end(); ++i) {
+    if (*i == acqBB || postDomTree.dominates(relBB, *i)) {
+      members.push_back(*i);
+      memberSet.insert(*i);
+    }
   }
-  for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
-    instructionsBetweenHelper(end, instrs, term->getSuccessor(i), visited);
+  for (std::vector<BasicBlock*>::iterator i = members.begin();
+       i != members.end(); ++i) {
+    if (*i == relBB)
+      continue;
+    TerminatorInst *term = (*i)->getTerminator();
+    for (unsigned j = 0; j < term->getNumSuccessors(); ++j)
+      if (!memberSet.count(term->getSuccessor(j)))
+        return;
   }
+  syncSections[acq].swap(members);
 }
 
 // Given an acquire call or a barrier call, find all the instructions between
 // it and a corresponding release call or the next barrier. The instructions
 // in the critical section are collected into the set supplied. Returns the
-// release/next barrier instruction if one is found or NULL otherwise.
+// release/next barrier instruction if one is found or NULL otherwise. The
+// pairing comes from pairSyncs, which must run on the function first.
 Instruction *ACCEPTPass::findCritSec(Instruction *acq,
                                      std::set<Instruction*> &cs,
                                      LogDescription *desc) {
-  bool acquired = false;
-  BasicBlock *bb = acq->getParent();
-
-  bool isLock;
-  if (isAcquire(acq)) {
-    isLock = true;
-  } else if (isBarrier(acq)) {
-    isLock = false;
-  } else {
+  if (!isAcquire(acq) && !isBarrier(acq)) {
     errs() << "not a critical section entry!\n";
     return NULL;
   }
 
-  // Look for a release call that is dominated by the acquire and
-  // post-dominates the acquire.
-  DominatorTree &domTree = getAnalysis<DominatorTree>();
-  PostDominatorTree &postDomTree = getAnalysis<PostDominatorTree>();
-  Function *func = acq->getParent()->getParent();
-  Instruction *rel = NULL;
-  for (Function::iterator fi = func->begin(); fi != func->end(); ++fi) {
-    for (BasicBlock::iterator bi = fi->begin(); bi != fi->end(); ++bi) {
-      if ((isLock && isRelease(bi)) ||
-          (!isLock && acq != bi && isBarrier(bi))) {
-        // Candidate pair.
-        if (domTree.dominates(acq, bi) &&
-            postDomTree.dominates(bi->getParent(), acq->getParent())) {
-
-          // Evaluate the candidate critical section.
-          bool good = true;
-          rel = bi;
-          cs.clear();
-          instructionsBetween(acq, rel, cs);
-          for (std::set<Instruction *>::iterator i = cs.begin();
-                i != cs.end(); ++i) {
-            if (isAcquire(*i) || isRelease(*i) || isBarrier(*i)) {
-              good = false;
-              break;
-            }
-          }
-
-          if (good)
-            break;
-          else
-            rel = NULL;
-
-        }
-      }
-    }
-    if (rel)
-      break;
+  std::map<Instruction*, Instruction*>::iterator end = syncEnds.find(acq);
+  if (end == syncEnds.end()) {
+    ACCEPT_LOG << "no matching sync found\n";
+    return NULL;
   }
 
-  if (rel == NULL) {
-    ACCEPT_LOG << "no matching sync found\n";
+  std::map<Instruction*, std::vector<BasicBlock*> >::iterator section =
+      syncSections.find(acq);
+  if (section == syncSections.end()) {
+    ACCEPT_LOG << "critical section is not a single region\n";
     return NULL;
   }
 
+  // Collect the instructions after the start and before the end.
+  Instruction *rel = end->second;
+  cs.clear();
+  for (std::vector<BasicBlock*>::iterator bi = section->second.begin();
+       bi != section->second.end(); ++bi) {
+    BasicBlock::iterator ii = (*bi)->begin();
+    if (*bi == acq->getParent())
+      ii = ++BasicBlock::iterator(acq);
+    for (; ii != (*bi)->end() && &*ii != rel; ++ii)
+      cs.insert(ii);
+  }
+
+  // Evaluate the critical section: it may not contain other synchronization.
+  for (std::set<Instruction *>::iterator i = cs.begin(); i != cs.end(); ++i) {
+    if (syncKind(*i) != SYNC_NONE) {
+      ACCEPT_LOG << "critical section contains other synchronization\n";
+      return NULL;
+    }
+  }
+
   return rel;
 }
 
@@ -141,12 +192,36 @@ std::string ACCEPTPass::siteName(std::string kind, Instruction *at) {
   return ss.str();
 }
 
+// Name a per-function site after the function's definition.
+std::string ACCEPTPass::funcSiteName(std::string kind, Function &F) {
+  std::stringstream ss;
+  ss << kind << " at ";
+  if (funcDebugInfo.count(&F)) {
+    DISubprogram funcInfo = funcDebugInfo[&F];
+    ss << funcInfo.getFilename().str() << ":" << funcInfo.getLineNumber();
+  } else {
+    ss << F.getName().str();
+  }
+  return ss.str();
+}
+
+LogDescription *ACCEPTPass::logAddFunction(Function &F) {
+  if (funcDebugInfo.count(&F)) {
+    DISubprogram funcInfo = funcDebugInfo[&F];
+    return AI->logAdd("Function", funcInfo.getFilename(),
+                      funcInfo.getLineNumber());
+  }
+  return AI->logAdd("Function", "", 0);
+}
+
 // Find the critical section beginning with an acquire (or barrier), check for
 // approximateness, and return the release (or next barrier). If the critical
-// section cannot be identified or is not approximate, return null.
+// section cannot be identified or is not approximate, return null. If
+// `section` is supplied, it receives the section's instructions.
 Instruction *ACCEPTPass::findApproxCritSec(
     Instruction *acq,
-    LogDescription *desc) {
+    LogDescription *desc,
+    std::set<Instruction*> *section) {
   // Find all the instructions between this acquire and the next release.
   std::set<Instruction*> critSec;
   Instruction *rel = findCritSec(acq, critSec, desc);
@@ -169,9 +244,149 @@ Instruction *ACCEPTPass::findApproxCritSec(
     return NULL;
   }
 
+  if (section)
+    section->swap(critSec);
   return rel;
 }
 
+// Look for a critical section whose only effect is accumulating into one
+// shared location: `*p = *p + x` (or `- x`) on an integer or floating-point
+// value. Returns the store that completes the update, or null if the section
+// does anything else to memory.
+static StoreInst *findReduction(const std::set<Instruction*> &critSec,
+                                Instruction *rel) {
+  StoreInst *store = NULL;
+  for (std::set<Instruction*>::const_iterator i = critSec.begin();
+        i != critSec.end(); ++i) {
+    if (*i == rel)
+      continue;
+    if (StoreInst *si = dyn_cast<StoreInst>(*i)) {
+      if (store)
+        return NULL;
+      store = si;
+    }
+  }
+  if (!store || store->isVolatile())
+    return NULL;
+
+  Type *ty = store->getValueOperand()->getType();
+  if (!ty->isIntegerTy(32) && !ty->isIntegerTy(64) &&
+      !ty->isFloatTy() && !ty->isDoubleTy())
+    return NULL;
+
+  // The address must be computed outside the section.
+  Value *ptr = store->getPointerOperand();
+  if (Instruction *ptrInst = dyn_cast<Instruction>(ptr)) {
+    if (critSec.count(ptrInst))
+      return NULL;
+  }
+
+  BinaryOperator *op = dyn_cast<BinaryOperator>(store->getValueOperand());
+  if (!op || !op->hasOneUse() || !critSec.count(op))
+    return NULL;
+  unsigned opcode = op->getOpcode();
+  if (opcode != Instruction::Add && opcode != Instruction::FAdd &&
+      opcode != Instruction::Sub && opcode != Instruction::FSub)
+    return NULL;
+
+  // The old value must be loaded in the section and used only here. For
+  // subtraction it must be the minuend.
+  LoadInst *load = dyn_cast<LoadInst>(op->getOperand(0));
+  if (!load && (opcode == Instruction::Add || opcode == Instruction::FAdd))
+    load = dyn_cast<LoadInst>(op->getOperand(1));
+  if (!load || load->getPointerOperand() != ptr || !load->hasOneUse() ||
+      load->isVolatile() || !critSec.count(load))
+    return NULL;
+
+  // Nothing else in the section may read the shared location.
+  for (std::set<Instruction*>::const_iterator i = critSec.begin();
+        i != critSec.end(); ++i) {
+    if (LoadInst *li = dyn_cast<LoadInst>(*i)) {
+      if (li != load && li->getPointerOperand() == ptr)
+        return NULL;
+    }
+  }
+
+  return store;
+}
+
+// Replace the update at `store` with an accumulation into a per-thread
+// partial (see rt/reduce.c) and remove the lock around it. Partials are
+// merged into the shared value every 2^param updates; parameters at the
+// maximum merge only at barriers and at thread exit.
+void ACCEPTPass::privatizeReduction(Instruction *acq, Instruction *rel,
+                                    StoreInst *store, int param) {
+  LLVMContext &ctx = module->getContext();
+  BinaryOperator *op = cast<BinaryOperator>(store->getValueOperand());
+  LoadInst *load = dyn_cast<LoadInst>(op->getOperand(0));
+  Value *delta = op->getOperand(1);
+  if (!load || load->getPointerOperand() != store->getPointerOperand()) {
+    load = cast<LoadInst>(op->getOperand(1));
+    delta = op->getOperand(0);
+  }
+
+  Type *ty = delta->getType();
+  const char *funcName;
+  if (ty->isIntegerTy(32))
+    funcName = "accept_reduce_add_i32";
+  else if (ty->isIntegerTy(64))
+    funcName = "accept_reduce_add_i64";
+  else if (ty->isFloatTy())
+    funcName = "accept_reduce_add_f32";
+  else
+    funcName = "accept_reduce_add_f64";
+
+  Type *bytePtrTy = Type::getInt8PtrTy(ctx);
+  IntegerType *intTy = Type::getInt32Ty(ctx);
+  Constant *addFunc = module->getOrInsertFunction(funcName,
+      Type::getVoidTy(ctx), bytePtrTy, ty, bytePtrTy, intTy, NULL);
+
+  // The update happens where the store was, which may be conditional
+  // within the section.
+  IRBuilder<> builder(store);
+  if (op->getOpcode() == Instruction::Sub)
+    delta = builder.CreateNeg(delta);
+  else if (op->getOpcode() == Instruction::FSub)
+    delta = builder.CreateFNeg(delta);
+  Value *shared = builder.CreateBitCast(store->getPointerOperand(),
+                                        bytePtrTy);
+  Value *lock = builder.CreateBitCast(cast<CallInst>(acq)->getArgOperand(0),
+                                      bytePtrTy);
+  builder.CreateCall4(addFunc, shared, delta, lock,
+                      ConstantInt::get(intTy, param));
+
+  store->eraseFromParent();
+  op->eraseFromParent();
+  load->eraseFromParent();
+
+  if (!acq->use_empty())
+    acq->replaceAllUsesWith(Constant::getNullValue(acq->getType()));
+  if (!rel->use_empty())
+    rel->replaceAllUsesWith(Constant::getNullValue(rel->getType()));
+  acq->eraseFromParent();
+  rel->eraseFromParent();
+
+  // Partials must also be merged at barriers.
+  usedReductions = true;
+}
+
+// Merge privatized reduction partials before every barrier in the module.
+void ACCEPTPass::flushReductionsAtBarriers() {
+  Constant *flushFunc = module->getOrInsertFunction("accept_reduce_flush",
+      Type::getVoidTy(module->getContext()), NULL);
+  for (Module::iterator fi = module->begin(); fi != module->end(); ++fi) {
+    // Skip the runtime's own barrier implementations.
+    if (fi->getName().startswith("accept_"))
+      continue;
+    for (Function::iterator bbi = fi->begin(); bbi != fi->end(); ++bbi) {
+      for (BasicBlock::iterator ii = bbi->begin(); ii != bbi->end(); ++ii) {
+        if (isBarrier(ii) || isCallOf(ii, "accept_quorum_barrier_wait"))
+          CallInst::Create(flushFunc, "", ii);
+      }
+    }
+  }
+}
+
 bool ACCEPTPass::optimizeAcquire(Instruction *acq) {
   // Generate a name for this opportunity site.
   std::string optName = siteName("lock acquire", acq);
@@ -179,24 +394,57 @@ bool ACCEPTPass::optimizeAcquire(Instruction *acq) {
   LogDescription *desc = AI->logAdd("Loop", acq);
   ACCEPT_LOG << optName << "\n";
 
-  Instruction *rel = findApproxCritSec(acq, desc);
+  std::set<Instruction*> critSec;
+  Instruction *rel = findApproxCritSec(acq, desc, &critSec);
   if (!rel) {
     return false;
   }
 
   // Success.
   ACCEPT_LOG << "can elide lock\n";
+
+  // Sections that only accumulate into a shared variable can also be
+  // privatized into per-thread partial sums. The runtime merges partials
+  // under the original mutex, so this is limited to pthread mutexes.
+  std::string reductionName;
+  StoreInst *reduction = NULL;
+  if (isCallOf(acq, FUNC_ACQUIRE)) {
+    reduction = findReduction(critSec, rel);
+    if (reduction) {
+      reductionName = siteName("reduction", acq);
+      ACCEPT_LOG << "can privatize reduction\n";
+    }
+  }
+
   if (relax) {
     int param = relaxConfig[optName];
     if (param) {
       // Remove the acquire and release calls.
       ACCEPT_LOG << "eliding lock\n";
+      // Status-returning primitives report success (zero) when elided.
+      if (!acq->use_empty())
+        acq->replaceAllUsesWith(Constant::getNullValue(acq->getType()));
+      if (!rel->use_empty())
+        rel->replaceAllUsesWith(Constant::getNullValue(rel->getType()));
       acq->eraseFromParent();
       rel->eraseFromParent();
       return true;
     }
+
+    if (reduction) {
+      int reductionParam = relaxConfig[reductionName];
+      if (reductionParam) {
+        ACCEPT_LOG << "privatizing reduction\n";
+        privatizeReduction(acq, rel, reduction, reductionParam);
+        return true;
+      }
+    }
   } else {
     relaxConfig[optName] = 0;
+    if (reduction)
+      relaxConfig[reductionName] = 0;
+    if (optSyncProf)
+      pendingProfiles.push_back(std::make_pair(acq, rel));
   }
   return false;
 }
@@ -212,38 +460,219 @@ bool ACCEPTPass::optimizeBarrier(Instruction *bar1) {
   }
 
   // Success.
-  ACCEPT_LOG << "can elide barrier\n";
+  ACCEPT_LOG << "can relax barrier\n";
+
+  // Ordinary pthread barriers can also become quorum barriers. This is a
+  // separate site so the tuner can choose between the two relaxations.
+  std::string quorumName;
+  if (isCallOf(bar1, FUNC_BARRIER)) {
+    quorumName = siteName("quorum barrier", bar1);
+    ACCEPT_LOG << "can use quorum barrier\n";
+  }
+
   if (relax) {
     int param = relaxConfig[optName];
-    if (param) {
-      // Remove the first barrier.
+    // Barriers may end other sites' critical sections and relaxation
+    // splits blocks, so all barrier changes happen after analysis.
+    if (param >= BARRIER_ELIDE_PARAM) {
       ACCEPT_LOG << "eliding barrier wait\n";
-      bar1->eraseFromParent();
+      pendingBarriers.push_back(std::make_pair(bar1, param));
       return true;
+    } else if (param) {
+      ACCEPT_LOG << "synchronizing every 2^" << param << " arrivals\n";
+      pendingBarriers.push_back(std::make_pair(bar1, param));
+      return true;
+    }
+
+    if (!quorumName.empty()) {
+      int quorumParam = relaxConfig[quorumName];
+      if (quorumParam) {
+        ACCEPT_LOG << "releasing after " << (8 - quorumParam)
+                   << "/8 of threads arrive\n";
+        pendingQuorums.push_back(std::make_pair(bar1, quorumParam));
+        return true;
+      }
     }
   } else {
     relaxConfig[optName] = 0;
+    if (!quorumName.empty())
+      relaxConfig[quorumName] = 0;
+    if (optSyncProf)
+      pendingProfiles.push_back(std::make_pair(bar1, (Instruction*)NULL));
   }
   return false;
 }
 
+// Replace a pthread_barrier_wait call with a quorum barrier from the runtime,
+// which releases waiting threads once (8 - param)/8 of them have arrived.
+void ACCEPTPass::quorumBarrier(Instruction *bar, int param) {
+  CallInst *call = cast<CallInst>(bar);
+  LLVMContext &ctx = module->getContext();
+  Value *barObj = call->getArgOperand(0);
+  IntegerType *intTy = Type::getInt32Ty(ctx);
+  Constant *waitFunc = module->getOrInsertFunction(
+      "accept_quorum_barrier_wait",
+      call->getType(), barObj->getType(), intTy, NULL);
+
+  IRBuilder<> builder(bar);
+  Value *result = builder.CreateCall2(waitFunc, barObj,
+      ConstantInt::get(intTy, param));
+  bar->replaceAllUsesWith(result);
+  bar->eraseFromParent();
+
+  // The runtime needs to learn the participant counts.
+  usedQuorumBarriers = true;
+}
+
+// Redirect barrier initialization to the runtime so quorum barriers know how
+// many threads participate.
+void ACCEPTPass::hookBarrierInit() {
+  Function *initFunc = module->getFunction("pthread_barrier_init");
+  if (!initFunc)
+    return;
+  Constant *hookFunc = module->getOrInsertFunction("accept_barrier_init",
+      initFunc->getFunctionType());
+  Constant *hook = ConstantExpr::getBitCast(hookFunc, initFunc->getType());
+
+  // Only redirect the program's own calls. The runtime's hook (linked in
+  // before optimization) must still reach the real function.
+  std::vector<CallInst*> calls;
+  for (Value::use_iterator ui = initFunc->use_begin();
+       ui != initFunc->use_end(); ++ui) {
+    CallInst *call = dyn_cast<CallInst>(*ui);
+    if (call && call->getCalledValue() == initFunc &&
+        !shouldSkipFunc(*call->getParent()->getParent()))
+      calls.push_back(call);
+  }
+  for (std::vector<CallInst*>::iterator i = calls.begin(); i != calls.end();
+       ++i)
+    (*i)->setCalledFunction(hook);
+}
+
+// Bracket a synchronization site with calls to the contention profiler. For
+// locks, `rel` is the matching release, which ends the hold time; barriers
+// only record waiting.
+void ACCEPTPass::profileSync(Instruction *acq, Instruction *rel) {
+  LLVMContext &ctx = module->getContext();
+  Type *bytePtrTy = Type::getInt8PtrTy(ctx);
+  Type *voidTy = Type::getVoidTy(ctx);
+  Constant *waitFunc = module->getOrInsertFunction("accept_syncprof_wait",
+      voidTy, bytePtrTy, NULL);
+  Constant *acquiredFunc = module->getOrInsertFunction(
+      "accept_syncprof_acquired", voidTy, bytePtrTy, NULL);
+  Constant *releasedFunc = module->getOrInsertFunction(
+      "accept_syncprof_released", voidTy, bytePtrTy, NULL);
+
+  // Sites are identified by their configuration names.
+  std::string kind = rel ? "lock acquire" : "barrier";
+  IRBuilder<> builder(acq);
+  Value *site = builder.CreateGlobalStringPtr(siteName(kind, acq),
+                                              "accept_syncprof_site");
+
+  builder.CreateCall(waitFunc, site);
+  builder.SetInsertPoint(++BasicBlock::iterator(acq));
+  builder.CreateCall(acquiredFunc, site);
+  if (rel) {
+    builder.SetInsertPoint(++BasicBlock::iterator(rel));
+    builder.CreateCall(releasedFunc, site);
+  }
+}
+
+// Make a barrier call conditional so that only every 2^logperiod-th arrival
+// actually waits. The runtime (rt/barrier.c) keeps per-thread arrival counts.
+void ACCEPTPass::relaxBarrier(Instruction *bar, int logperiod) {
+  CallInst *call = cast<CallInst>(bar);
+  LLVMContext &ctx = module->getContext();
+  Type *voidPtrTy = Type::getInt8PtrTy(ctx);
+  IntegerType *intTy = Type::getInt32Ty(ctx);
+  Constant *relaxFunc = module->getOrInsertFunction("accept_barrier_relax",
+      intTy, voidPtrTy, intTy, NULL);
+
+  // Identify the barrier by its first argument (the barrier object) if it has
+  // one. Otherwise, all calls to the same function share a counter.
+  IRBuilder<> builder(bar);
+  Value *key;
+  if (call->getNumArgOperands() &&
+      call->getArgOperand(0)->getType()->isPointerTy()) {
+    key = builder.CreateBitCast(call->getArgOperand(0), voidPtrTy);
+  } else {
+    key = ConstantExpr::getBitCast(call->getCalledFunction(), voidPtrTy);
+  }
+  Value *sync = builder.CreateCall2(relaxFunc, key,
+      ConstantInt::get(intTy, logperiod), "accept_sync");
+  sync = builder.CreateIsNotNull(sync, "accept_sync_cmp");
+
+  // Split the block so the barrier sits alone in a block that can be
+  // skipped.
+  BasicBlock *head = bar->getParent();
+  BasicBlock *waitBB = head->splitBasicBlock(BasicBlock::iterator(bar),
+                                             "accept_barrier_wait");
+  BasicBlock *contBB = waitBB->splitBasicBlock(
+      ++BasicBlock::iterator(bar), "accept_barrier_cont");
+  head->getTerminator()->eraseFromParent();
+  builder.SetInsertPoint(head);
+  builder.CreateCondBr(sync, waitBB, contBB);
+
+  // Skipped arrivals produce a zero result (i.e., not the "serial" thread).
+  if (!bar->use_empty()) {
+    builder.SetInsertPoint(contBB->begin());
+    PHINode *phi = builder.CreatePHI(bar->getType(), 2,
+                                     "accept_barrier_result");
+    bar->replaceAllUsesWith(phi);
+    phi->addIncoming(bar, waitBB);
+    phi->addIncoming(Constant::getNullValue(bar->getType()), head);
+  }
+}
+
 bool ACCEPTPass::optimizeSync(Function &F) {
-  bool changed = false;
+  // Collect the synchronization sites first: relaxing a barrier splits its
+  // block, so we can't transform while iterating.
+  std::vector<Instruction*> sites;
+  pendingBarriers.clear();
+  pendingQuorums.clear();
+  pendingProfiles.clear();
   for (Function::iterator fi = F.begin(); fi != F.end(); ++fi) {
     for (BasicBlock::iterator bi = fi->begin(); bi != fi->end(); ++bi) {
-      if (isAcquire(bi) || isBarrier(bi)) {
-        bool optimized;
-        if (isAcquire(bi))
-          optimized = optimizeAcquire(bi);
-        else
-          optimized = optimizeBarrier(bi);
-        changed |= optimized;
-        if (optimized)
-          // Stop iterating over this block, since it changed (and there's
-          // almost certainly not another critical section in here anyway).
-          break;
-      }
+      if (isAcquire(bi) || isBarrier(bi))
+        sites.push_back(bi);
+    }
+  }
+  if (sites.empty())
+    return false;
+
+  pairSyncs(F);
+
+  bool changed = false;
+  for (std::vector<Instruction*>::iterator i = sites.begin();
+        i != sites.end(); ++i) {
+    if (isAcquire(*i))
+      changed |= optimizeAcquire(*i);
+    else
+      changed |= optimizeBarrier(*i);
+  }
+  syncEnds.clear();
+  syncSections.clear();
+
+  for (std::vector< std::pair<Instruction*, int> >::iterator
+        i = pendingBarriers.begin(); i != pendingBarriers.end(); ++i) {
+    Instruction *bar = i->first;
+    if (i->second >= BARRIER_ELIDE_PARAM) {
+      // Remove the barrier entirely.
+      if (!bar->use_empty())
+        bar->replaceAllUsesWith(Constant::getNullValue(bar->getType()));
+      bar->eraseFromParent();
+    } else {
+      relaxBarrier(bar, i->second);
     }
   }
+  for (std::vector< std::pair<Instruction*, int> >::iterator
+        i = pendingQuorums.begin(); i != pendingQuorums.end(); ++i) {
+    quorumBarrier(i->first, i->second);
+  }
+  for (std::vector< std::pair<Instruction*, Instruction*> >::iterator
+        i = pendingProfiles.begin(); i != pendingProfiles.end(); ++i) {
+    profileSync(i->first, i->second);
+    changed = true;
+  }
   return changed;
 }
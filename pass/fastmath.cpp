@@ -0,0 +1,100 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+
+#include <vector>
+
+using namespace llvm;
+
+// Fast libm substitution. Calls to common math functions whose results are
+// only used approximately are redirected to the polynomial and bit-trick
+// approximations in rt/fastmath.c. Each site's parameter is the precision
+// level passed to the replacement. The replacements are always inlined, so
+// the level folds away and a loop that calls them can vectorize.
+
+namespace {
+  const char *fastMathFuncs[] = {
+    "sin", "cos", "exp", "log", "pow", "sqrt",
+    "sinf", "cosf", "expf", "logf", "powf", "sqrtf",
+  };
+
+  bool hasFastVersion(StringRef name) {
+    for (unsigned i = 0; i < sizeof(fastMathFuncs) / sizeof(fastMathFuncs[0]);
+         ++i) {
+      if (name == fastMathFuncs[i])
+        return true;
+    }
+    return false;
+  }
+}
+
+// Replace:
+//     r = f(args)
+// with:
+//     r = accept_fast_f(args, level)
+void ACCEPTPass::fastMathCall(CallInst *call, int param) {
+  Function *func = call->getCalledFunction();
+  FunctionType *funcTy = func->getFunctionType();
+
+  std::vector<Type*> paramTys(funcTy->param_begin(), funcTy->param_end());
+  paramTys.push_back(Type::getInt32Ty(module->getContext()));
+  Constant *fastFunc = module->getOrInsertFunction(
+      ("accept_fast_" + func->getName()).str(),
+      FunctionType::get(funcTy->getReturnType(), paramTys, false));
+
+  std::vector<Value*> args;
+  for (unsigned i = 0; i < call->getNumArgOperands(); ++i)
+    args.push_back(call->getArgOperand(i));
+  IRBuilder<> builder(call);
+  args.push_back(builder.getInt32(param));
+  Value *fast = builder.CreateCall(fastFunc, args);
+  fast->takeName(call);
+  call->replaceAllUsesWith(fast);
+  call->eraseFromParent();
+}
+
+bool ACCEPTPass::optimizeFastMath(Function &F) {
+  std::vector<CallInst*> calls;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (CallInst *call = dyn_cast<CallInst>(ii)) {
+        // Only calls to the library versions: a program may define its own
+        // function with the same name.
+        Function *callee = call->getCalledFunction();
+        if (callee && callee->empty() && hasFastVersion(callee->getName()))
+          calls.push_back(call);
+      }
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<CallInst*>::iterator i = calls.begin();
+       i != calls.end(); ++i) {
+    CallInst *call = *i;
+    std::string optName = siteName("fastmath", call);
+    LogDescription *desc = AI->logAdd("Call", call);
+    ACCEPT_LOG << optName << "\n";
+
+    if (AI->instMarker(call) == markerForbid) {
+      ACCEPT_LOG << "optimization forbidden\n";
+      continue;
+    }
+    if (!hasOnlyApproxUses(call)) {
+      ACCEPT_LOG << "result is used precisely\n";
+      continue;
+    }
+
+    if (relax) {
+      int param = relaxConfig[optName];
+      if (param) {
+        ACCEPT_LOG << "using the fast version at level " << param << "\n";
+        fastMathCall(call, param);
+        modified = true;
+      }
+    } else {
+      ACCEPT_LOG << "can use fast version\n";
+      relaxConfig[optName] = 0;
+    }
+  }
+  return modified;
+}
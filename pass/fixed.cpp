@@ -0,0 +1,267 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+// Fixed-point conversion. When a function's site is relaxed, its approximate
+// single-precision arithmetic runs on 32-bit fixed-point numbers instead.
+// This is meant for targets without an FPU (like the MSP430), but integer
+// arithmetic can win on others too. Precision demotion runs first, so
+// demoted double arithmetic is converted as well.
+//
+// The site's parameter p selects the Q format: 4p fractional bits (so
+// Q27.4 up to Q3.28). As in precision demotion, whole chains of
+// approximate operations and the phis connecting them are converted
+// together. Values entering a chain are scaled and saturated; results
+// leaving it are scaled back to float. Arithmetic inside the chain is done
+// in 64 bits and saturated to 32.
+
+#define FIXED_FRAC_STEP 4
+#define FIXED_MAX_PARAM 7
+
+namespace {
+  bool isFixable(Instruction *inst) {
+    if (!isa<BinaryOperator>(inst) || !inst->getType()->isFloatTy() ||
+        !isApprox(inst))
+      return false;
+    switch (inst->getOpcode()) {
+    case Instruction::FAdd:
+    case Instruction::FSub:
+    case Instruction::FMul:
+    case Instruction::FDiv:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  void findFixable(Function &F, std::set<Instruction*> &chain) {
+    std::set<PHINode*> phis;
+    for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+      for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+        if (isFixable(ii))
+          chain.insert(ii);
+        else if (PHINode *phi = dyn_cast<PHINode>(ii))
+          if (phi->getType()->isFloatTy())
+            phis.insert(phi);
+      }
+    }
+    addChainPhis(chain, phis);
+  }
+
+  // Convert a constant to fixed point with `frac` fractional bits,
+  // saturating and rounding to nearest. Constant expressions get the same
+  // conversion as a boundary value, folded where possible.
+  Constant *fixedConstant(Constant *c, IntegerType *fixedTy, int frac) {
+    if (isa<UndefValue>(c))
+      return UndefValue::get(fixedTy);
+    ConstantFP *cfp = dyn_cast<ConstantFP>(c);
+    if (!cfp) {
+      Type *floatTy = c->getType();
+      Constant *scaled = ConstantExpr::getFMul(c,
+          ConstantFP::get(floatTy, (double)(INT64_C(1) << frac)));
+      Constant *lo = ConstantFP::get(floatTy, -2147483648.0);
+      Constant *hi = ConstantFP::get(floatTy, 2147483520.0);
+      scaled = ConstantExpr::getSelect(ConstantExpr::getFCmp(
+          CmpInst::FCMP_OLT, scaled, lo), lo, scaled);
+      scaled = ConstantExpr::getSelect(ConstantExpr::getFCmp(
+          CmpInst::FCMP_OGT, scaled, hi), hi, scaled);
+      return ConstantExpr::getFPToSI(scaled, fixedTy);
+    }
+
+    double val = cfp->getValueAPF().convertToFloat();
+    val *= (double)(INT64_C(1) << frac);
+    if (val > 2147483647.0)
+      val = 2147483647.0;
+    if (val < -2147483648.0)
+      val = -2147483648.0;
+    int64_t fixed = (int64_t)(val < 0 ? val - 0.5 : val + 0.5);
+    return ConstantInt::get(fixedTy, fixed, true);
+  }
+}
+
+// Get the fixed-point version of a value used at `user`.
+Value *ACCEPTPass::fixedValue(Value *v, Instruction *user, int frac,
+                              std::map<Value*, Value*> &fixed,
+                              const std::set<Instruction*> &chain) {
+  IntegerType *fixedTy = Type::getInt32Ty(module->getContext());
+  IntegerType *wideTy = Type::getInt64Ty(module->getContext());
+
+  if (fixed.count(v))
+    return fixed[v];
+  if (Constant *c = dyn_cast<Constant>(v))
+    return fixedConstant(c, fixedTy, frac);
+
+  Instruction *inst = dyn_cast<Instruction>(v);
+  if (inst && chain.count(inst)) {
+    // Convert the operation itself, right before the original. (Phis are
+    // created up front, so this recursion stops at them.)
+    BinaryOperator *op = cast<BinaryOperator>(inst);
+    Value *lhs = fixedValue(op->getOperand(0), op, frac, fixed, chain);
+    Value *rhs = fixedValue(op->getOperand(1), op, frac, fixed, chain);
+    IRBuilder<> builder(op);
+    Value *wideLhs = builder.CreateSExt(lhs, wideTy);
+    Value *wideRhs = builder.CreateSExt(rhs, wideTy);
+    Value *wide;
+    switch (op->getOpcode()) {
+    case Instruction::FAdd:
+      wide = builder.CreateAdd(wideLhs, wideRhs);
+      break;
+    case Instruction::FSub:
+      wide = builder.CreateSub(wideLhs, wideRhs);
+      break;
+    case Instruction::FMul:
+      // (a * b) >> frac.
+      wide = builder.CreateAShr(builder.CreateMul(wideLhs, wideRhs), frac);
+      break;
+    default: {
+      // (a << frac) / b. Division by zero must not trap, so divide by one
+      // instead.
+      Value *den = builder.CreateSelect(builder.CreateICmpEQ(wideRhs,
+          ConstantInt::get(wideTy, 0)), ConstantInt::get(wideTy, 1), wideRhs);
+      wide = builder.CreateSDiv(builder.CreateShl(wideLhs, frac), den);
+      break;
+    }
+    }
+
+    // None of these overflow 64 bits. Saturate the result to 32.
+    Value *lo = ConstantInt::get(wideTy, INT32_MIN, true);
+    Value *hi = ConstantInt::get(wideTy, INT32_MAX, true);
+    wide = builder.CreateSelect(builder.CreateICmpSLT(wide, lo), lo, wide);
+    wide = builder.CreateSelect(builder.CreateICmpSGT(wide, hi), hi, wide);
+    Value *result = builder.CreateTrunc(wide, fixedTy);
+
+    if (isa<Instruction>(result))
+      result->setName(op->getName() + ".q");
+    fixed[v] = result;
+    return result;
+  }
+
+  // A boundary. An integer converted to float just needs a shift, after
+  // saturating to the integers the format can hold, [-2^(31 - frac),
+  // 2^(31 - frac)). Sources narrow enough to always fit skip that.
+  IRBuilder<> builder(user);
+  if (SIToFPInst *conv = dyn_cast<SIToFPInst>(v)) {
+    Value *src = conv->getOperand(0);
+    unsigned bits = src->getType()->getIntegerBitWidth();
+    if (bits < 32)
+      src = builder.CreateSExt(src, fixedTy);
+    if ((int)bits - 1 > 31 - frac) {
+      Type *srcTy = src->getType();
+      Value *lo = ConstantInt::get(srcTy, -(INT64_C(1) << (31 - frac)), true);
+      Value *hi = ConstantInt::get(srcTy, (INT64_C(1) << (31 - frac)) - 1,
+                                   true);
+      src = builder.CreateSelect(builder.CreateICmpSLT(src, lo), lo, src);
+      src = builder.CreateSelect(builder.CreateICmpSGT(src, hi), hi, src);
+    }
+    if (bits > 32)
+      src = builder.CreateTrunc(src, fixedTy);
+    return builder.CreateShl(src, frac);
+  }
+
+  // Otherwise, scale and saturate. (The upper bound is the largest float
+  // below 2^31.)
+  Type *floatTy = v->getType();
+  Value *scaled = builder.CreateFMul(v,
+      ConstantFP::get(floatTy, (double)(INT64_C(1) << frac)));
+  Value *lo = ConstantFP::get(floatTy, -2147483648.0);
+  Value *hi = ConstantFP::get(floatTy, 2147483520.0);
+  scaled = builder.CreateSelect(builder.CreateFCmpOLT(scaled, lo), lo,
+                                scaled);
+  scaled = builder.CreateSelect(builder.CreateFCmpOGT(scaled, hi), hi,
+                                scaled);
+  return builder.CreateFPToSI(scaled, fixedTy, v->getName() + ".q");
+}
+
+void ACCEPTPass::fixChain(const std::set<Instruction*> &chain, int frac) {
+  IntegerType *fixedTy = Type::getInt32Ty(module->getContext());
+  std::map<Value*, Value*> fixed;
+
+  // Create the fixed-point phis first so loop-carried values can refer to
+  // them.
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    if (PHINode *phi = dyn_cast<PHINode>(*i))
+      fixed[phi] = PHINode::Create(fixedTy, phi->getNumIncomingValues(),
+                                   phi->getName() + ".q", phi);
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    if (PHINode *phi = dyn_cast<PHINode>(inst)) {
+      PHINode *newPhi = cast<PHINode>(fixed[phi]);
+      for (unsigned j = 0; j < phi->getNumIncomingValues(); ++j) {
+        Value *in = fixedValue(phi->getIncomingValue(j), phi, frac, fixed,
+                               chain);
+        newPhi->addIncoming(in, phi->getIncomingBlock(j));
+      }
+    } else {
+      fixedValue(inst, inst, frac, fixed, chain);
+    }
+  }
+
+  // Convert results that escape the chain back to float, then remove the
+  // originals.
+  std::vector<Instruction*> convs;
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    Instruction *insertAt = inst;
+    if (isa<PHINode>(inst))
+      insertAt = inst->getParent()->getFirstNonPHI();
+    IRBuilder<> builder(insertAt);
+    Value *conv = builder.CreateSIToFP(fixed[inst], inst->getType());
+    Value *unscaled = builder.CreateFMul(conv,
+        ConstantFP::get(inst->getType(), 1.0 / (INT64_C(1) << frac)),
+        inst->getName() + ".f");
+    inst->replaceAllUsesWith(unscaled);
+    if (Instruction *convInst = dyn_cast<Instruction>(conv))
+      convs.push_back(convInst);
+    if (Instruction *unscaledInst = dyn_cast<Instruction>(unscaled))
+      convs.push_back(unscaledInst);
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    (*i)->dropAllReferences();
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    (*i)->eraseFromParent();
+  }
+  // Remove unused conversions, users first.
+  for (std::vector<Instruction*>::reverse_iterator i = convs.rbegin();
+       i != convs.rend(); ++i) {
+    if ((*i)->use_empty())
+      (*i)->eraseFromParent();
+  }
+}
+
+bool ACCEPTPass::optimizeFixedPoint(Function &F) {
+  std::set<Instruction*> chain;
+  findFixable(F, chain);
+  if (chain.empty())
+    return false;
+
+  // One site per function.
+  std::string optName = funcSiteName("fixed", F);
+  LogDescription *desc = logAddFunction(F);
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << chain.size() << " approximate single-precision values\n";
+
+  if (relax) {
+    int param = relaxConfig[optName];
+    if (param) {
+      int frac = FIXED_FRAC_STEP * std::min(param, FIXED_MAX_PARAM);
+      ACCEPT_LOG << "converting to Q" << (31 - frac) << "." << frac << "\n";
+      fixChain(chain, frac);
+      return true;
+    }
+  } else {
+    ACCEPT_LOG << "can convert to fixed point\n";
+    relaxConfig[optName] = 0;
+  }
+  return false;
+}
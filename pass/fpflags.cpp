@@ -0,0 +1,68 @@
+#include "accept.h"
+#include "llvm/Operator.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+// Fast-math flags on approximate floating-point arithmetic. LLVM won't
+// reassociate FP operations (and so won't vectorize FP reductions) or
+// replace divisions with reciprocals unless the instructions carry these
+// flags. Clang only sets them for the whole program with -ffast-math, which
+// would also affect precise code. Instead, when relaxing, set the chosen
+// flags on approximate operations only. The ACCEPT passes run before the
+// vectorizers, so they see the flags.
+//
+// LLVM 3.2 has no separate reassociation or contraction flags: "fast" is
+// the only flag that permits reassociation, and FP contraction is a code
+// generation option (llc -fp-contract=fast).
+
+namespace {
+  enum FPFlag {
+    fpFast,
+    fpNoNaNs,
+    fpNoInfs,
+    fpNoSignedZeros,
+    fpAllowReciprocal
+  };
+
+  cl::list<FPFlag> optFPFlags("accept-fast-math",
+      cl::desc("ACCEPT: fast-math flags for approximate FP operations"),
+      cl::CommaSeparated,
+      cl::values(
+        clEnumValN(fpFast, "fast", "all of the flags below, plus "
+                                   "reassociation"),
+        clEnumValN(fpNoNaNs, "nnan", "assume no NaNs"),
+        clEnumValN(fpNoInfs, "ninf", "assume no infinities"),
+        clEnumValN(fpNoSignedZeros, "nsz", "ignore the sign of zero"),
+        clEnumValN(fpAllowReciprocal, "arcp", "allow reciprocals"),
+        clEnumValEnd));
+}
+
+bool ACCEPTPass::relaxFPFlags(Function &F) {
+  if (!relax || optFPFlags.empty())
+    return false;
+
+  bool modified = false;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (!isa<BinaryOperator>(ii) || !isa<FPMathOperator>(ii) ||
+          !isApprox(ii))
+        continue;
+
+      // Add to any flags the instruction already has.
+      FastMathFlags flags = ii->getFastMathFlags();
+      for (unsigned i = 0; i < optFPFlags.size(); ++i) {
+        switch (optFPFlags[i]) {
+        case fpFast: flags.setUnsafeAlgebra(); break;
+        case fpNoNaNs: flags.setNoNaNs(); break;
+        case fpNoInfs: flags.setNoInfs(); break;
+        case fpNoSignedZeros: flags.setNoSignedZeros(); break;
+        case fpAllowReciprocal: flags.setAllowReciprocal(); break;
+        }
+      }
+      ii->setFastMathFlags(flags);
+      modified = true;
+    }
+  }
+  return modified;
+}
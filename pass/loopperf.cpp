@@ -27,11 +27,23 @@ namespace {
     Module *module;
     LoopInfo *LI;
 
-    LoopPerfPass() : LoopPass(ID) {}
+    // The lower bound pointers that the current function passes to the
+    // OpenMP runtime. (See ompIterationVar.)
+    Function *ompFunc;
+    std::set<Value*> ompLowerBounds;
 
+    LoopPerfPass() : LoopPass(ID), ompFunc(NULL) {}
+
+    // Called for each of a function's loops before any of them runs, so
+    // the function's OpenMP calls are collected once here.
     virtual bool doInitialization(Loop *loop, LPPassManager &LPM) {
       transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
       AI = transformPass->AI;
+      Function *func = loop->getHeader()->getParent();
+      if (func != ompFunc) {
+        ompFunc = func;
+        findOmpLowerBounds(func);
+      }
       return false;
     }
     virtual bool runOnLoop(Loop *loop, LPPassManager &LPM) {
@@ -42,6 +54,8 @@ namespace {
       return tryToOptimizeLoop(loop);
     }
     virtual bool doFinalization() {
+      ompFunc = NULL;
+      ompLowerBounds.clear();
       return false;
     }
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
@@ -55,6 +69,85 @@ namespace {
                               layout.getPointerSizeInBits());
     }
 
+    // Collect the lower bound pointers passed to the OpenMP runtime.
+    void findOmpLowerBounds(Function *func) {
+      ompLowerBounds.clear();
+      for (Function::iterator bi = func->begin(); bi != func->end(); ++bi) {
+        for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+          CallInst *call = dyn_cast<CallInst>(ii);
+          if (!call || !call->getCalledFunction())
+            continue;
+          StringRef name = call->getCalledFunction()->getName();
+          if (name.startswith("__kmpc_for_static_init") &&
+              call->getNumArgOperands() > 4)
+            ompLowerBounds.insert(call->getArgOperand(4));
+          else if (name.startswith("__kmpc_dispatch_next") &&
+                   call->getNumArgOperands() > 3)
+            ompLowerBounds.insert(call->getArgOperand(3));
+        }
+      }
+    }
+
+    // Find the iteration variable of an OpenMP worksharing loop. Clang
+    // outlines the body of a "parallel for", and each thread gets a range of
+    // the loop's normalized iterations from __kmpc_for_static_init (or
+    // __kmpc_dispatch_next for dynamic schedules). The thread's loop starts
+    // its iteration variable at the range's lower bound and increments it by
+    // one, so the variable numbers iterations of the whole loop rather than
+    // of the thread's share. Returns NULL for other loops.
+    AllocaInst *ompIterationVar(Loop *loop) {
+      if (ompLowerBounds.empty())
+        return NULL;
+
+      // The header compares the iteration variable to the upper bound.
+      BranchInst *condBranch = dyn_cast_or_null<BranchInst>(
+          loop->getHeader()->getTerminator());
+      if (!condBranch || !condBranch->isConditional())
+        return NULL;
+      ICmpInst *cmp = dyn_cast<ICmpInst>(condBranch->getCondition());
+      if (!cmp)
+        return NULL;
+
+      for (unsigned i = 0; i < 2; ++i) {
+        LoadInst *load = dyn_cast<LoadInst>(cmp->getOperand(i));
+        if (!load)
+          continue;
+        AllocaInst *var = dyn_cast<AllocaInst>(load->getPointerOperand());
+        if (!var || !var->getAllocatedType()->isIntegerTy())
+          continue;
+
+        // The variable must start at a lower bound and only be incremented
+        // in the latch.
+        bool fromLowerBound = false, incremented = false, otherStores = false;
+        for (Value::use_iterator ui = var->use_begin(); ui != var->use_end();
+             ++ui) {
+          StoreInst *store = dyn_cast<StoreInst>(*ui);
+          if (!store || store->getPointerOperand() != var)
+            continue;
+          Value *val = store->getValueOperand();
+          if (!loop->contains(store)) {
+            LoadInst *init = dyn_cast<LoadInst>(val);
+            if (init && ompLowerBounds.count(init->getPointerOperand()))
+              fromLowerBound = true;
+            continue;
+          }
+          BinaryOperator *add = dyn_cast<BinaryOperator>(val);
+          ConstantInt *step = add ?
+              dyn_cast<ConstantInt>(add->getOperand(1)) : NULL;
+          LoadInst *old = add ? dyn_cast<LoadInst>(add->getOperand(0)) : NULL;
+          if (store->getParent() == loop->getLoopLatch() && step && old &&
+              add->getOpcode() == Instruction::Add && step->isOne() &&
+              old->getPointerOperand() == var)
+            incremented = true;
+          else
+            otherStores = true;
+        }
+        if (fromLowerBound && incremented && !otherStores)
+          return var;
+      }
+      return NULL;
+    }
+
     // Assess whether a loop can be optimized and, if so, log some messages and
     // update the configuration map. If optimization is turned on, the
     // configuration map will be used to actually transform the loop. Returns a
@@ -107,8 +200,15 @@ namespace {
 
       // Determine whether this is a for-like or while-like loop. This informs
       // the heuristic that determines which parts of the loop to perforate.
+      // OpenMP worksharing loops are for-like too, and they are perforated
+      // by their global iteration number so that the skipped iterations don't
+      // depend on how the iterations are divided among threads.
       bool isForLike = false;
-      if (loop->getHeader()->getName().startswith("for.cond")) {
+      AllocaInst *ompVar = ompIterationVar(loop);
+      if (ompVar) {
+        ACCEPT_LOG << "OpenMP worksharing loop\n";
+        isForLike = true;
+      } else if (loop->getHeader()->getName().startswith("for.cond")) {
         ACCEPT_LOG << "for-like loop\n";
         isForLike = true;
       } else {
@@ -119,7 +219,7 @@ namespace {
         int param = transformPass->relaxConfig[loopName];
         if (param) {
           ACCEPT_LOG << "perforating with factor 2^" << param << "\n";
-          perforateLoop(loop, param, isForLike);
+          perforateLoop(loop, param, isForLike, ompVar);
           return true;
         } else {
           ACCEPT_LOG << "not perforating\n";
@@ -180,8 +280,10 @@ namespace {
 
     // Transform a loop to skip iterations.
     // The loop should already be validated as perforatable, but checks will be
-    // performed nonetheless to ensure safety.
-    void perforateLoop(Loop *loop, int logfactor, bool isForLike) {
+    // performed nonetheless to ensure safety. If iterVar is given, it counts
+    // the loop's iterations and takes the place of a new counter.
+    void perforateLoop(Loop *loop, int logfactor, bool isForLike,
+                       AllocaInst *iterVar=NULL) {
       // Check whether this loop is perforatable.
       // First, check for required blocks.
       if (!loop->getHeader() || !loop->getLoopLatch()
@@ -218,45 +320,48 @@ namespace {
 
       IRBuilder<> builder(module->getContext());
       Value *result;
+      AllocaInst *counterAlloca = iterVar;
 
       // Allocate stack space for the counter.
       // LLVM "alloca" instructions go in the function's entry block. Otherwise,
       // they have to adjust the frame size dynamically (and, in my experience,
       // can actually segfault!). And we only want one of these per static loop
       // anyway.
-      builder.SetInsertPoint(
-          loop->getLoopPreheader()->getParent()->getEntryBlock().begin()
-      );
+      if (!counterAlloca) {
+        builder.SetInsertPoint(
+            loop->getLoopPreheader()->getParent()->getEntryBlock().begin()
+        );
 
-      IntegerType *nativeInt = getNativeIntegerType();
-      AllocaInst *counterAlloca = builder.CreateAlloca(
-          nativeInt,
-          0,
-          "accept_counter"
-      );
+        IntegerType *nativeInt = getNativeIntegerType();
+        counterAlloca = builder.CreateAlloca(
+            nativeInt,
+            0,
+            "accept_counter"
+        );
 
-      // Initialize the counter in the preheader.
-      builder.SetInsertPoint(loop->getLoopPreheader()->getTerminator());
-      builder.CreateStore(
-          ConstantInt::get(nativeInt, 0, false),
-          counterAlloca
-      );
+        // Initialize the counter in the preheader.
+        builder.SetInsertPoint(loop->getLoopPreheader()->getTerminator());
+        builder.CreateStore(
+            ConstantInt::get(nativeInt, 0, false),
+            counterAlloca
+        );
 
-      // Increment the counter in the latch.
-      builder.SetInsertPoint(loop->getLoopLatch()->getTerminator());
-      result = builder.CreateLoad(
-          counterAlloca,
-          "accept_tmp"
-      );
-      result = builder.CreateAdd(
-          result,
-          ConstantInt::get(nativeInt, 1, false),
-          "accept_inc"
-      );
-      builder.CreateStore(
-          result,
-          counterAlloca
-      );
+        // Increment the counter in the latch.
+        builder.SetInsertPoint(loop->getLoopLatch()->getTerminator());
+        result = builder.CreateLoad(
+            counterAlloca,
+            "accept_tmp"
+        );
+        result = builder.CreateAdd(
+            result,
+            ConstantInt::get(nativeInt, 1, false),
+            "accept_inc"
+        );
+        builder.CreateStore(
+            result,
+            counterAlloca
+        );
+      }
 
       // Check the counter before the loop's body.
       BasicBlock *checkBlock = BasicBlock::Create(
@@ -0,0 +1,117 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/IntrinsicInst.h"
+
+using namespace llvm;
+
+// Lookup-table substitution. Calls to precise-pure unary floating-point
+// functions whose results are only used approximately are replaced with a
+// linearly interpolated table. The runtime (rt/lut.c) profiles the input
+// range over the first calls at each site and then builds the table lazily.
+
+// Table sizes are 2^(param + LUT_LOG_BASE) intervals.
+#define LUT_LOG_BASE 4
+
+bool ACCEPTPass::lutCandidate(CallInst *call, LogDescription *desc) {
+  Function *func = call->getCalledFunction();
+
+  // Only float -> float and double -> double functions.
+  Type *type = call->getType();
+  if (!(type->isFloatTy() || type->isDoubleTy()) ||
+      call->getNumArgOperands() != 1 ||
+      call->getArgOperand(0)->getType() != type ||
+      func->isVarArg()) {
+    ACCEPT_LOG << "not a unary floating-point function\n";
+    return false;
+  }
+
+  // Outside the profiled range, the table falls back to the original
+  // function, so the function must be callable more than once without
+  // precise side effects.
+  if (!AI->isPrecisePure(func)) {
+    ACCEPT_LOG << func->getName().str() << " is not precise-pure\n";
+    return false;
+  }
+  if (!hasOnlyApproxUses(call)) {
+    ACCEPT_LOG << "result is used precisely\n";
+    return false;
+  }
+
+  return true;
+}
+
+// Replace:
+//     r = f(x)
+// with:
+//     r = accept_lut_{f,d}(&state, f, x, logsize)
+// where state is a fresh null pointer that the runtime fills in with the
+// site's table.
+void ACCEPTPass::lutCall(CallInst *call, int param) {
+  Function *func = call->getCalledFunction();
+  Type *type = call->getType();
+  Type *bytePtrTy = Type::getInt8PtrTy(module->getContext());
+
+  GlobalVariable *state = new GlobalVariable(*module, bytePtrTy, false,
+      GlobalValue::InternalLinkage, ConstantPointerNull::get(
+          cast<PointerType>(bytePtrTy)), "accept_lut_state");
+
+  IRBuilder<> builder(call);
+  Constant *lutFunc = module->getOrInsertFunction(
+      type->isFloatTy() ? "accept_lut_f" : "accept_lut_d",
+      type, bytePtrTy->getPointerTo(), func->getType(), type,
+      builder.getInt32Ty(), NULL);
+  Value *lookup = builder.CreateCall4(lutFunc, state, func,
+      call->getArgOperand(0), builder.getInt32(param + LUT_LOG_BASE));
+  lookup->takeName(call);
+  call->replaceAllUsesWith(lookup);
+  call->eraseFromParent();
+}
+
+bool ACCEPTPass::optimizeLUT(Function &F) {
+  std::vector<CallInst*> calls;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (CallInst *call = dyn_cast<CallInst>(ii))
+        if (!isa<IntrinsicInst>(call))
+          calls.push_back(call);
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<CallInst*>::iterator i = calls.begin();
+       i != calls.end(); ++i) {
+    CallInst *call = *i;
+    // Unlike memoization, library functions (e.g., the whitelisted math
+    // functions) are the main targets here.
+    Function *callee = call->getCalledFunction();
+    if (!callee || callee->getName().startswith("accept_"))
+      continue;
+
+    std::string optName = siteName("lut", call);
+    LogDescription *desc = AI->logAdd("Call", call);
+    ACCEPT_LOG << optName << "\n";
+
+    if (AI->instMarker(call) == markerForbid) {
+      ACCEPT_LOG << "optimization forbidden\n";
+      continue;
+    }
+    if (!lutCandidate(call, desc))
+      continue;
+
+    if (relax) {
+      int param = relaxConfig[optName];
+      if (param) {
+        ACCEPT_LOG << "using a table of 2^" << (param + LUT_LOG_BASE)
+                   << " intervals\n";
+        lutCall(call, param);
+        modified = true;
+      }
+    } else {
+      ACCEPT_LOG << "can use a lookup table\n";
+      relaxConfig[optName] = 0;
+    }
+  }
+  return modified;
+}
@@ -0,0 +1,206 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+#include "llvm/IntrinsicInst.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+// Approximate memoization. Calls to precise-pure functions whose results are
+// only used approximately are looked up in a per-thread table keyed on their
+// quantized arguments (see rt/memo.c). On a hit, the call is skipped.
+
+// The runtime's key size.
+#define MEMO_MAX_ARGS 6
+
+namespace {
+  bool memoScalar(Type *type) {
+    return type->isFloatTy() || type->isDoubleTy() ||
+           (type->isIntegerTy() && type->getIntegerBitWidth() <= 64);
+  }
+
+  // Convert a value to its 64-bit representation in the memo table.
+  Value *memoBits(IRBuilder<> &builder, Value *v) {
+    Type *type = v->getType();
+    Type *i64 = builder.getInt64Ty();
+    if (type->isFloatTy())
+      v = builder.CreateBitCast(v, builder.getInt32Ty());
+    else if (type->isDoubleTy())
+      v = builder.CreateBitCast(v, i64);
+    if (v->getType() != i64)
+      v = builder.CreateZExt(v, i64);
+    return v;
+  }
+
+  // The inverse of memoBits.
+  Value *memoUnbits(IRBuilder<> &builder, Value *bits, Type *type) {
+    if (type->isFloatTy())
+      return builder.CreateBitCast(
+          builder.CreateTrunc(bits, builder.getInt32Ty()), type);
+    if (type->isDoubleTy())
+      return builder.CreateBitCast(bits, type);
+    if (type != bits->getType())
+      return builder.CreateTrunc(bits, type);
+    return bits;
+  }
+
+  // Quantize an argument by dropping low-order mantissa bits. Parameter p
+  // drops 2p bits of a float's 23 and 29 + 2p of a double's 52, so a double
+  // is always a little coarser than a float. Integers are used exactly.
+  Value *memoQuantize(IRBuilder<> &builder, Value *arg, int param) {
+    Type *type = arg->getType();
+    Value *bits = memoBits(builder, arg);
+    int drop = 0;
+    if (type->isFloatTy())
+      drop = std::min(2 * param, 23);
+    else if (type->isDoubleTy())
+      drop = std::min(29 + 2 * param, 52);
+    if (!drop)
+      return bits;
+    uint64_t mask = ~((UINT64_C(1) << drop) - 1);
+    return builder.CreateAnd(bits, builder.getInt64(mask), "memo_quant");
+  }
+}
+
+bool ACCEPTPass::memoizable(CallInst *call, LogDescription *desc) {
+  Function *func = call->getCalledFunction();
+
+  // The key holds scalar arguments only: a pointer's contents could change
+  // between calls.
+  if (!memoScalar(call->getType())) {
+    ACCEPT_LOG << "return type is not scalar\n";
+    return false;
+  }
+  if (call->getNumArgOperands() > MEMO_MAX_ARGS) {
+    ACCEPT_LOG << "too many arguments\n";
+    return false;
+  }
+  for (unsigned i = 0; i < call->getNumArgOperands(); ++i) {
+    if (!memoScalar(call->getArgOperand(i)->getType())) {
+      ACCEPT_LOG << "argument " << i << " is not scalar\n";
+      return false;
+    }
+  }
+
+  // Skipping the call must not lose any precise effects, and a stale result
+  // must only affect approximate data.
+  if (!AI->isPrecisePure(func)) {
+    ACCEPT_LOG << func->getName().str() << " is not precise-pure\n";
+    return false;
+  }
+  if (!hasOnlyApproxUses(call)) {
+    ACCEPT_LOG << "result is used precisely\n";
+    return false;
+  }
+
+  return true;
+}
+
+// Replace:
+//     r = f(args)
+// with:
+//     if (accept_memo_lookup(site, quantized args, &cached))
+//       r = cached
+//     else
+//       r = f(args); accept_memo_update(site, quantized args, r)
+void ACCEPTPass::memoizeCall(CallInst *call, StringRef optName, int param) {
+  Function *func = call->getParent()->getParent();
+  unsigned nargs = call->getNumArgOperands();
+  IntegerType *i64 = Type::getInt64Ty(module->getContext());
+  Type *i64PtrTy = i64->getPointerTo();
+  Type *bytePtrTy = Type::getInt8PtrTy(module->getContext());
+
+  // Key and result slots live in the entry block.
+  IRBuilder<> entryBuilder(func->getEntryBlock().begin());
+  AllocaInst *keyAlloca = entryBuilder.CreateAlloca(i64,
+      entryBuilder.getInt32(nargs ? nargs : 1), "memo_key");
+  AllocaInst *resultAlloca = entryBuilder.CreateAlloca(i64, 0, "memo_result");
+
+  BasicBlock *lookupBB = call->getParent();
+  BasicBlock *missBB = lookupBB->splitBasicBlock(call, "memo_miss");
+  BasicBlock *doneBB = missBB->splitBasicBlock(
+      ++BasicBlock::iterator(call), "memo_done");
+
+  // Look up the quantized arguments.
+  IRBuilder<> builder(lookupBB->getTerminator());
+  Value *site = builder.CreateGlobalStringPtr(optName, "accept_memo_site");
+  for (unsigned i = 0; i < nargs; ++i) {
+    builder.CreateStore(memoQuantize(builder, call->getArgOperand(i), param),
+                        builder.CreateConstInBoundsGEP1_32(keyAlloca, i));
+  }
+  Constant *lookupFunc = module->getOrInsertFunction("accept_memo_lookup",
+      builder.getInt32Ty(), bytePtrTy, i64PtrTy, builder.getInt32Ty(),
+      i64PtrTy, NULL);
+  Value *hit = builder.CreateCall4(lookupFunc, site, keyAlloca,
+      builder.getInt32(nargs), resultAlloca, "memo_hit");
+  Value *cached = memoUnbits(builder, builder.CreateLoad(resultAlloca),
+                             call->getType());
+  lookupBB->getTerminator()->eraseFromParent();
+  builder.SetInsertPoint(lookupBB);
+  builder.CreateCondBr(builder.CreateICmpNE(hit, builder.getInt32(0)),
+                       doneBB, missBB);
+
+  // Merge the cached and computed results.
+  builder.SetInsertPoint(doneBB->begin());
+  PHINode *result = builder.CreatePHI(call->getType(), 2, "memo_value");
+  call->replaceAllUsesWith(result);
+  result->addIncoming(cached, lookupBB);
+  result->addIncoming(call, missBB);
+
+  // On a miss, record the computed result.
+  builder.SetInsertPoint(missBB->getTerminator());
+  Constant *updateFunc = module->getOrInsertFunction("accept_memo_update",
+      builder.getVoidTy(), bytePtrTy, i64PtrTy, builder.getInt32Ty(), i64,
+      NULL);
+  builder.CreateCall4(updateFunc, site, keyAlloca, builder.getInt32(nargs),
+                      memoBits(builder, call));
+}
+
+bool ACCEPTPass::optimizeMemo(Function &F) {
+  std::vector<CallInst*> calls;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (CallInst *call = dyn_cast<CallInst>(ii))
+        if (!isa<DbgInfoIntrinsic>(call))
+          calls.push_back(call);
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<CallInst*>::iterator i = calls.begin();
+       i != calls.end(); ++i) {
+    CallInst *call = *i;
+    // Only consider calls to functions defined in this module. (Library
+    // functions, including the whitelisted math functions, are too cheap to
+    // be worth a table lookup.)
+    Function *callee = call->getCalledFunction();
+    if (!callee || callee->empty() || isa<IntrinsicInst>(call) ||
+        callee->getName().startswith("accept_"))
+      continue;
+
+    std::string optName = siteName("memo", call);
+    LogDescription *desc = AI->logAdd("Call", call);
+    ACCEPT_LOG << optName << "\n";
+
+    if (AI->instMarker(call) == markerForbid) {
+      ACCEPT_LOG << "optimization forbidden\n";
+      continue;
+    }
+    if (!memoizable(call, desc))
+      continue;
+
+    if (relax) {
+      int param = relaxConfig[optName];
+      if (param) {
+        ACCEPT_LOG << "memoizing with quantization " << param << "\n";
+        memoizeCall(call, optName, param);
+        modified = true;
+      }
+    } else {
+      ACCEPT_LOG << "can memoize\n";
+      relaxConfig[optName] = 0;
+    }
+  }
+  return modified;
+}
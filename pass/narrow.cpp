@@ -0,0 +1,348 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+
+using namespace llvm;
+
+// Integer narrowing. When a function's site is relaxed, its approximate
+// integer arithmetic runs at 16 bits (parameter 1) or 8 bits (parameter 2),
+// so vectorized loops pack two to eight times as many lanes per register.
+//
+// As with precision demotion, whole chains of approximate operations and the
+// phis connecting them are narrowed together. Values entering a chain saturate
+// to the narrow range (unless ScalarEvolution shows that they already fit).
+// Operations inside the chain that ScalarEvolution shows to fit wrap, like
+// their constants; additions, subtractions, and multiplications that might not
+// fit saturate instead. Results leaving the chain are extended back to their
+// original width. ScalarEvolution's value ranges also keep values out of the
+// chain when they provably don't fit the narrow type, and they decide whether
+// the chain is signed or unsigned: pixel values in [0, 255] only fit in eight
+// bits as unsigned numbers.
+
+namespace {
+  // Only the operations whose low bits don't depend on their operands' high
+  // bits.
+  bool isNarrowable(Instruction *inst, unsigned width) {
+    BinaryOperator *op = dyn_cast<BinaryOperator>(inst);
+    if (!op || !isApprox(op))
+      return false;
+    IntegerType *type = dyn_cast<IntegerType>(op->getType());
+    if (!type || type->getBitWidth() <= width || type->getBitWidth() > 64)
+      return false;
+
+    switch (op->getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::Mul:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+      return true;
+    case Instruction::Shl:
+      if (ConstantInt *amt = dyn_cast<ConstantInt>(op->getOperand(1)))
+        return amt->getZExtValue() < width;
+      return false;
+    default:
+      return false;
+    }
+  }
+
+  int64_t narrowMin(unsigned width, bool isUnsigned) {
+    return isUnsigned ? 0 : -(INT64_C(1) << (width - 1));
+  }
+
+  int64_t narrowMax(unsigned width, bool isUnsigned) {
+    return isUnsigned ? (INT64_C(1) << width) - 1 :
+                        (INT64_C(1) << (width - 1)) - 1;
+  }
+}
+
+// What ScalarEvolution knows about a value's range.
+ACCEPTPass::NarrowRange ACCEPTPass::narrowRange(Value *v, unsigned width) {
+  NarrowRange range;
+  range.known = false;
+  range.nonNegative = false;
+  range.fitsSigned = false;
+  range.fitsUnsigned = false;
+
+  ScalarEvolution &SE = getAnalysis<ScalarEvolution>();
+  if (!v->getType()->isIntegerTy() ||
+      v->getType()->getIntegerBitWidth() > 64)
+    return range;
+  ConstantRange cr = SE.getSignedRange(SE.getSCEV(v));
+  if (cr.isFullSet())
+    return range;
+
+  int64_t lo = cr.getSignedMin().getSExtValue();
+  int64_t hi = cr.getSignedMax().getSExtValue();
+  range.known = true;
+  range.nonNegative = lo >= 0;
+  range.fitsSigned = lo >= narrowMin(width, false) &&
+                     hi <= narrowMax(width, false);
+  range.fitsUnsigned = lo >= 0 && hi <= narrowMax(width, true);
+  return range;
+}
+
+// Find the chain to narrow and decide its signedness.
+void ACCEPTPass::findNarrowable(Function &F, unsigned width,
+                                std::set<Instruction*> &chain,
+                                bool &isUnsigned) {
+  std::set<Instruction*> ops;
+  std::set<PHINode*> phis;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (isNarrowable(ii, width))
+        ops.insert(ii);
+      else if (PHINode *phi = dyn_cast<PHINode>(ii))
+        if (phi->getType()->isIntegerTy() &&
+            phi->getType()->getIntegerBitWidth() > width &&
+            phi->getType()->getIntegerBitWidth() <= 64)
+          phis.insert(phi);
+    }
+  }
+
+  // Drop values that provably don't fit. The chain is unsigned if all of
+  // the remaining values are known to be non-negative.
+  std::map<Instruction*, NarrowRange> ranges;
+  isUnsigned = true;
+  for (std::set<Instruction*>::iterator i = ops.begin(); i != ops.end();
+       ++i) {
+    NarrowRange range = narrowRange(*i, width);
+    if (range.known && !range.fitsSigned && !range.fitsUnsigned)
+      continue;
+    // Only additions, subtractions, and multiplications can saturate, and
+    // bitwise operations can't overflow; a shift must be known to fit.
+    if (!range.known && (*i)->getOpcode() == Instruction::Shl)
+      continue;
+    ranges[*i] = range;
+    isUnsigned = isUnsigned && range.nonNegative;
+  }
+  for (std::map<Instruction*, NarrowRange>::iterator i = ranges.begin();
+       i != ranges.end(); ++i) {
+    // In a signed chain, values that only fit unsigned would change sign.
+    if (isUnsigned || !i->second.known || i->second.fitsSigned)
+      chain.insert(i->first);
+  }
+  for (std::set<PHINode*>::iterator i = phis.begin(); i != phis.end();) {
+    PHINode *phi = *i++;
+    NarrowRange range = narrowRange(phi, width);
+    if (range.known && !(isUnsigned ? range.fitsUnsigned : range.fitsSigned))
+      phis.erase(phi);
+  }
+
+  addChainPhis(chain, phis);
+}
+
+// Get the narrow version of a value used at `user`.
+Value *ACCEPTPass::narrowedValue(Value *v, Instruction *user, unsigned width,
+                                 bool isUnsigned,
+                                 std::map<Value*, Value*> &narrowed,
+                                 const std::set<Instruction*> &chain) {
+  IntegerType *narrowTy = IntegerType::get(module->getContext(), width);
+  int64_t lo = narrowMin(width, isUnsigned);
+  int64_t hi = narrowMax(width, isUnsigned);
+
+  if (narrowed.count(v))
+    return narrowed[v];
+
+  // Constants wrap like the arithmetic: adding -1 must still subtract one
+  // in an unsigned chain. (Saturating operations use the original
+  // constants.)
+  if (ConstantInt *c = dyn_cast<ConstantInt>(v))
+    return ConstantInt::get(narrowTy, c->getValue().trunc(width));
+
+  Instruction *inst = dyn_cast<Instruction>(v);
+  if (inst && chain.count(inst)) {
+    // Narrow the operation itself, right before the original. (Phis are
+    // created up front, so this recursion stops at them.)
+    BinaryOperator *op = cast<BinaryOperator>(inst);
+    Value *lhs = narrowedValue(op->getOperand(0), op, width, isUnsigned,
+                               narrowed, chain);
+    Value *rhs = narrowedValue(op->getOperand(1), op, width, isUnsigned,
+                               narrowed, chain);
+    IRBuilder<> builder(op);
+    Value *result;
+    NarrowRange range = narrowRange(op, width);
+    if ((op->getOpcode() == Instruction::Add ||
+         op->getOpcode() == Instruction::Sub ||
+         op->getOpcode() == Instruction::Mul) &&
+        !(isUnsigned ? range.fitsUnsigned : range.fitsSigned)) {
+      result = saturatingOp(op, lhs, rhs, width, isUnsigned);
+    } else {
+      result = builder.CreateBinOp(op->getOpcode(), lhs, rhs,
+                                   op->getName() + ".n");
+    }
+    if (Instruction *resultInst = dyn_cast<Instruction>(result))
+      resultInst->setMetadata("quals", op->getMetadata("quals"));
+    narrowed[v] = result;
+    return result;
+  }
+
+  // A boundary. If the value was just extended from a narrow enough type,
+  // use that instead.
+  IRBuilder<> builder(user);
+  if (CastInst *ext = dyn_cast<CastInst>(v)) {
+    Value *src = ext->getOperand(0);
+    bool matches = isa<ZExtInst>(ext) ? isUnsigned : isa<SExtInst>(ext);
+    if (matches && src->getType()->isIntegerTy() &&
+        src->getType()->getIntegerBitWidth() <= width) {
+      if (src->getType() == narrowTy)
+        return src;
+      return isUnsigned ? builder.CreateZExt(src, narrowTy) :
+                          builder.CreateSExt(src, narrowTy);
+    }
+  }
+
+  // Saturate, unless the value is known to fit.
+  NarrowRange range = narrowRange(v, width);
+  if (!(isUnsigned ? range.fitsUnsigned : range.fitsSigned)) {
+    Type *type = v->getType();
+    Value *loVal = ConstantInt::get(type, lo, true);
+    Value *hiVal = ConstantInt::get(type, hi, true);
+    v = builder.CreateSelect(builder.CreateICmpSLT(v, loVal), loVal, v);
+    v = builder.CreateSelect(builder.CreateICmpSGT(v, hiVal), hiVal, v,
+                             "sat");
+  }
+  return builder.CreateTrunc(v, narrowTy);
+}
+
+// Perform op at twice the narrow width, where it can't overflow, and
+// saturate the result. Constant operands keep their original values, but
+// are clamped so that the wide operation can't overflow either. Clamping
+// doesn't change the saturated result: a larger addend saturates anyway,
+// and so does a product with a factor outside the narrow range.
+Value *ACCEPTPass::saturatingOp(BinaryOperator *op, Value *lhs, Value *rhs,
+                                unsigned width, bool isUnsigned) {
+  IntegerType *narrowTy = IntegerType::get(module->getContext(), width);
+  IntegerType *wideTy = IntegerType::get(module->getContext(), width * 2);
+  bool isMul = op->getOpcode() == Instruction::Mul;
+  int64_t lo = narrowMin(width, isUnsigned);
+  int64_t hi = narrowMax(width, isUnsigned);
+  int64_t constLo = isMul ? lo : -(INT64_C(1) << width);
+  int64_t constHi = isMul ? hi : INT64_C(1) << width;
+
+  IRBuilder<> builder(op);
+  Value *wide[2];
+  Value *narrow[2] = { lhs, rhs };
+  for (unsigned i = 0; i < 2; ++i) {
+    if (ConstantInt *c = dyn_cast<ConstantInt>(op->getOperand(i))) {
+      int64_t val = c->getSExtValue();
+      val = val < constLo ? constLo : (val > constHi ? constHi : val);
+      wide[i] = ConstantInt::get(wideTy, val, true);
+    } else {
+      wide[i] = isUnsigned ? builder.CreateZExt(narrow[i], wideTy) :
+                             builder.CreateSExt(narrow[i], wideTy);
+    }
+  }
+  Value *result = builder.CreateBinOp(op->getOpcode(), wide[0], wide[1],
+                                      op->getName() + ".wide");
+
+  // An unsigned product of narrow operands is non-negative but may not fit
+  // the wide type as a signed number.
+  Value *loVal = ConstantInt::get(wideTy, lo, true);
+  Value *hiVal = ConstantInt::get(wideTy, hi, true);
+  if (isUnsigned && isMul) {
+    result = builder.CreateSelect(builder.CreateICmpUGT(result, hiVal),
+                                  hiVal, result);
+  } else {
+    result = builder.CreateSelect(builder.CreateICmpSLT(result, loVal),
+                                  loVal, result);
+    result = builder.CreateSelect(builder.CreateICmpSGT(result, hiVal),
+                                  hiVal, result);
+  }
+  return builder.CreateTrunc(result, narrowTy, op->getName() + ".n");
+}
+
+void ACCEPTPass::narrowChain(const std::set<Instruction*> &chain,
+                             unsigned width, bool isUnsigned) {
+  IntegerType *narrowTy = IntegerType::get(module->getContext(), width);
+  std::map<Value*, Value*> narrowed;
+
+  // Create the narrow phis first so loop-carried values can refer to them.
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    if (PHINode *phi = dyn_cast<PHINode>(*i))
+      narrowed[phi] = PHINode::Create(narrowTy, phi->getNumIncomingValues(),
+                                      phi->getName() + ".n", phi);
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    if (PHINode *phi = dyn_cast<PHINode>(inst)) {
+      PHINode *newPhi = cast<PHINode>(narrowed[phi]);
+      for (unsigned j = 0; j < phi->getNumIncomingValues(); ++j) {
+        Value *in = narrowedValue(phi->getIncomingValue(j), phi, width,
+                                  isUnsigned, narrowed, chain);
+        newPhi->addIncoming(in, phi->getIncomingBlock(j));
+      }
+    } else {
+      narrowedValue(inst, inst, width, isUnsigned, narrowed, chain);
+    }
+  }
+
+  // Extend results that escape the chain, then remove the originals.
+  std::vector<Instruction*> exts;
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    Instruction *insertAt = inst;
+    if (isa<PHINode>(inst))
+      insertAt = inst->getParent()->getFirstNonPHI();
+    CastInst *ext = CastInst::Create(
+        isUnsigned ? Instruction::ZExt : Instruction::SExt, narrowed[inst],
+        inst->getType(), inst->getName() + ".w", insertAt);
+    inst->replaceAllUsesWith(ext);
+    exts.push_back(ext);
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    (*i)->dropAllReferences();
+  }
+  for (std::set<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    (*i)->eraseFromParent();
+  }
+  for (std::vector<Instruction*>::iterator i = exts.begin();
+       i != exts.end(); ++i) {
+    if ((*i)->use_empty())
+      (*i)->eraseFromParent();
+  }
+}
+
+bool ACCEPTPass::optimizeNarrowing(Function &F) {
+  // Find the chain at the widest option, 16 bits, for logging.
+  std::set<Instruction*> chain;
+  bool isUnsigned;
+  findNarrowable(F, 16, chain, isUnsigned);
+  if (chain.empty())
+    return false;
+
+  // One site per function.
+  std::string optName = funcSiteName("narrow", F);
+  LogDescription *desc = logAddFunction(F);
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << chain.size() << " approximate integer values\n";
+
+  if (relax) {
+    int param = relaxConfig[optName];
+    if (param) {
+      unsigned width = param >= 2 ? 8 : 16;
+      if (width != 16) {
+        chain.clear();
+        findNarrowable(F, width, chain, isUnsigned);
+      }
+      ACCEPT_LOG << "narrowing " << chain.size() << " values to "
+                 << (isUnsigned ? "unsigned " : "signed ") << width
+                 << " bits\n";
+      if (chain.empty())
+        return false;
+      narrowChain(chain, width, isUnsigned);
+      return true;
+    }
+  } else {
+    ACCEPT_LOG << "can narrow\n";
+    relaxConfig[optName] = 0;
+  }
+  return false;
+}
@@ -7,6 +7,7 @@
 #include "llvm/Argument.h"
 #include "llvm/IntrinsicInst.h"
 #include "llvm/InlineAsm.h"
+#include "llvm/Operator.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/AliasSetTracker.h"
 #include "llvm/Analysis/Passes.h"
@@ -18,13 +19,23 @@
 #include <sstream>
 #include <iostream>
 #include <queue>
+#include <algorithm>
 #include <fstream>
+#include <cstdlib>
 #define BUFFER_LOOP_DEPS 0
 #define BUFFER_STORE_LOOP_DEPS 1
 #define ALIAS 1
 #define ALIAS_DUMP 0
 #define BB_INTERSECTION 1
 
+// Draining a partial batch at loop exit, and so double buffering, tracks
+// the store dependency counters only.
+#if BUFFER_LOOP_DEPS == 0 && BUFFER_STORE_LOOP_DEPS == 1
+#define NPU_DRAIN_SUPPORTED 1
+#else
+#define NPU_DRAIN_SUPPORTED 0
+#endif
+
 using namespace llvm;
 
 namespace {
@@ -39,6 +50,38 @@ namespace {
   cl::opt<int> optNPUBufferSize("accept-npu-bufsize",
       cl::desc("ACCEPT: NPU interface buffer size"));
 
+  // In batch mode, the buffer holds a number of whole invocations rather than
+  // a number of floats. The software backend evaluates each full buffer as
+  // one batch.
+  cl::opt<int> optNPUBatch("accept-npu-batch",
+      cl::desc("ACCEPT: NPU invocations per batch (overrides bufsize)"),
+      cl::init(0));
+
+  // Double buffering for the software backend: the first half of each batch
+  // is evaluated in the background while the loop buffers the second half.
+  cl::opt<bool> optNPUAsync("accept-npu-async",
+      cl::desc("ACCEPT: overlap NPU evaluation with input buffering"));
+
+  // The Zynq backend talks to the FPGA NPU through memory-mapped buffers. The
+  // software backend calls a CPU-side MLP evaluator in the runtime instead
+  // (rt/npu.c).
+  enum NPUBackend {
+    npuZynq,
+    npuSoftware
+  };
+  cl::opt<NPUBackend> optNPUBackend("accept-npu-backend",
+      cl::desc("ACCEPT: NPU target"),
+      cl::values(
+        clEnumValN(npuZynq, "zynq", "Zynq FPGA NPU (default)"),
+        clEnumValN(npuSoftware, "soft", "software MLP runtime"),
+        clEnumValEnd),
+      cl::init(npuZynq));
+
+  // Instead of transforming NPU-able calls, record their inputs and outputs
+  // for training (see rt/npu_trace.c).
+  cl::opt<bool> optNPUTrace("accept-npu-trace",
+      cl::desc("ACCEPT: trace NPU candidate calls' inputs and outputs"));
+
   struct LoopNPU: public LoopPass {
     static char ID;
     bool modified;
@@ -52,7 +95,7 @@ namespace {
     PostDominatorTree *PDT;
     DominatorTree *DT;
 
-    LoopNPU() : LoopPass(ID) {
+    LoopNPU() : LoopPass(ID), shapes_module(NULL) {
       initializeLoopNPUPass(*PassRegistry::getPassRegistry());
     }
 
@@ -110,6 +153,9 @@ namespace {
 
     std::vector<Loop *> loops_to_npu;
     std::vector<Instruction *> calls_to_npu;
+    // Calls already instrumented for tracing (which, unlike transformed
+    // calls, remain visible from enclosing loops).
+    std::set<Instruction *> traced_calls;
     bool find_inst(Instruction *inst) {
       for (int i = 0; i < calls_to_npu.size(); ++i)
         if (calls_to_npu[i] == inst)
@@ -277,6 +323,260 @@ namespace {
 
   } // tryToOptimizeLoop
 
+  // Types that can be marshalled to and from the NPU's floats.
+  bool isNPUScalar(Type *type) {
+    return type->isIntegerTy() || type->isFloatingPointTy();
+  }
+
+  // Convert a marshalled value to float, the NPU's only data type.
+  Value *npuFloat(IRBuilder<> &builder, Value *v) {
+    Type *type = v->getType();
+    Type *floatTy = builder.getFloatTy();
+    if (type->isIntegerTy(1))
+      return builder.CreateUIToFP(v, floatTy, "npu_conv");
+    else if (type->isIntegerTy())
+      return builder.CreateSIToFP(v, floatTy, "npu_conv");
+    else if (type->isFloatTy())
+      return v;
+    else if (type->isFloatingPointTy())
+      return builder.CreateFPCast(v, floatTy, "npu_conv");
+    return NULL;
+  }
+
+  // Convert an NPU output back to the type the program expects.
+  Value *npuUnfloat(IRBuilder<> &builder, Value *v, Type *type) {
+    if (type->isIntegerTy(1))
+      return builder.CreateFCmpUNE(v, ConstantFP::get(v->getType(), 0.0),
+                                   "npu_unconv");
+    else if (type->isIntegerTy())
+      return builder.CreateFPToSI(v, type, "npu_unconv");
+    else if (type->isFloatingPointTy())
+      return builder.CreateFPCast(v, type, "npu_unconv");
+    return NULL;
+  }
+
+  // The statically sized array type that a pointer argument decays from
+  // (e.g., `a` for `float a[16]` is a GEP 0, 0 into [16 x float]), if any.
+  ArrayType *decayedArrayType(Value *arg) {
+    GEPOperator *GEP = dyn_cast<GEPOperator>(arg);
+    if (!GEP || !GEP->hasAllZeroIndices())
+      return NULL;
+    PointerType *ptrTy = dyn_cast<PointerType>(GEP->getPointerOperand()->getType());
+    if (!ptrTy)
+      return NULL;
+    return dyn_cast<ArrayType>(ptrTy->getElementType());
+  }
+
+  // The number of elements in the array a pointer argument decays from: the
+  // element count for a 1D array of scalars, -1 for a 2D array, or 0.
+  int staticArraySize(Value *arg) {
+    ArrayType *arrayTy = decayedArrayType(arg);
+    if (!arrayTy)
+      return 0;
+    Type *elemTy = arrayTy->getElementType();
+    if (isNPUScalar(elemTy))
+      return arrayTy->getNumElements();
+    if (ArrayType *rowTy = dyn_cast<ArrayType>(elemTy))
+      if (isNPUScalar(rowTy->getElementType()))
+        return -1;
+    return 0;
+  }
+
+  // Argument shapes for NPU candidate functions: for each parameter, the
+  // number of elements a pointer parameter points to (0 if unknown, -1 for a
+  // 2D array whose dimensions are found at the call site).
+  //
+  // The frontend records these in the module's accept.npu.args metadata, one
+  // node per function: !{<function>, i32 <shape of param 0>, ...}. Modules
+  // from older frontends have them in accept-npuArrayArgs-info.txt instead,
+  // as a function name followed by its parameters' shapes.
+  std::map<Function *, std::vector<int> > arg_shapes;
+  Module *shapes_module;
+
+  const std::vector<int> &argShapes(Function *f) {
+    if (shapes_module != module) {
+      shapes_module = module;
+      arg_shapes.clear();
+      loadArgShapes();
+    }
+    return arg_shapes[f];
+  }
+
+  void loadArgShapes() {
+    if (NamedMDNode *md = module->getNamedMetadata("accept.npu.args")) {
+      for (unsigned i = 0; i < md->getNumOperands(); ++i) {
+        MDNode *node = md->getOperand(i);
+        if (!node->getNumOperands())
+          continue;
+        Function *func = dyn_cast_or_null<Function>(node->getOperand(0));
+        if (!func)
+          continue;
+        std::vector<int> &shape = arg_shapes[func];
+        for (unsigned j = 1; j < node->getNumOperands(); ++j) {
+          ConstantInt *size = dyn_cast_or_null<ConstantInt>(node->getOperand(j));
+          shape.push_back(size ? size->getSExtValue() : 0);
+        }
+      }
+      return;
+    }
+
+    std::ifstream file("accept-npuArrayArgs-info.txt");
+    std::vector<int> *shape = NULL;
+    std::string word;
+    while (file >> word) {
+      char *end;
+      long size = strtol(word.c_str(), &end, 10);
+      if (*end == '\0') {
+        if (shape)
+          shape->push_back(size);
+      } else {
+        Function *func = module->getFunction(word);
+        shape = func ? &arg_shapes[func] : NULL;
+      }
+    }
+  }
+
+  // Check that every value a call would exchange with the NPU is a scalar
+  // that converts to and from float.
+  bool npuMarshallable(Instruction *inst, unsigned n, std::vector<int> &op_size,
+                       std::vector<bool> &is_matrix,
+                       std::vector<bool> &is_output_arg) {
+    Type *retTy = inst->getType();
+    if (!retTy->isVoidTy() && !isNPUScalar(retTy))
+      return false;
+    for (unsigned i = 0; i < n; ++i) {
+      Type *type = inst->getOperand(i)->getType();
+      if (!type->isPointerTy()) {
+        if (!isNPUScalar(type))
+          return false;
+        continue;
+      }
+      Type *elemTy = cast<PointerType>(type)->getElementType();
+      if (is_matrix[i] && op_size[i])
+        elemTy = cast<ArrayType>(elemTy)->getElementType();
+      if ((op_size[i] || is_output_arg[i]) && !isNPUScalar(elemTy))
+        return false;
+    }
+    return true;
+  }
+
+  // Produce the values a call's arguments are marshalled into, in the order
+  // tryToNPU buffers them: scalars, the first op_size[i] elements of array
+  // arguments, and row-major elements of 2D arrays. Returns false if some
+  // input can't be represented as a float.
+  bool marshalInputs(IRBuilder<> &builder, Instruction *inst, unsigned n,
+                     std::vector<int> &op_size, std::vector<bool> &is_matrix,
+                     std::vector<int> &mdim1, std::vector<int> &mdim2,
+                     std::vector<Value*> &inputs) {
+    IntegerType *nativeInt = getNativeIntegerType();
+    for (unsigned int i = 0; i < n; ++i) {
+      Value *arg = inst->getOperand(i);
+      Type *type = arg->getType();
+      std::vector<Value*> vals;
+      if (!type->isPointerTy()) {
+        vals.push_back(arg);
+      } else if (is_matrix[i]) {
+        for (int k = 0; k < mdim1[i]; ++k) {
+          Value *row = builder.CreateInBoundsGEP(arg,
+              ConstantInt::get(nativeInt, k, true), "geprow");
+          for (int p = 0; p < mdim2[i]; ++p) {
+            Value *idx[2];
+            idx[0] = ConstantInt::get(nativeInt, 0, true);
+            idx[1] = ConstantInt::get(nativeInt, p, true);
+            vals.push_back(builder.CreateLoad(
+                builder.CreateInBoundsGEP(row, idx, "gepcol")));
+          }
+        }
+      } else {
+        for (int j = 0; j < op_size[i]; ++j) {
+          Value *elem = builder.CreateInBoundsGEP(arg,
+              ConstantInt::get(nativeInt, j), "npu_elemGEP");
+          vals.push_back(builder.CreateLoad(elem));
+        }
+      }
+
+      for (unsigned j = 0; j < vals.size(); ++j) {
+        Value *conv = npuFloat(builder, vals[j]);
+        if (!conv)
+          return false;
+        inputs.push_back(conv);
+      }
+    }
+    return true;
+  }
+
+  // Store values into a new float array in the function's entry block and
+  // return a pointer to its first element.
+  Value *npuFloatArray(IRBuilder<> &builder, Function *func,
+                       std::vector<Value*> &vals, const char *name) {
+    IntegerType *nativeInt = getNativeIntegerType();
+    IRBuilder<> entryBuilder(func->getEntryBlock().begin());
+    AllocaInst *array = entryBuilder.CreateAlloca(builder.getFloatTy(),
+        ConstantInt::get(nativeInt, vals.size() ? vals.size() : 1), name);
+    for (unsigned i = 0; i < vals.size(); ++i) {
+      builder.CreateStore(vals[i], builder.CreateInBoundsGEP(array,
+          ConstantInt::get(nativeInt, i)));
+    }
+    return array;
+  }
+
+  // Instrument an NPU candidate call to record its inputs and outputs. The
+  // outputs are the return value followed by the values written through
+  // output arguments.
+  bool traceCall(Instruction *inst, StringRef optName, unsigned n,
+                 std::vector<int> &op_size, std::vector<bool> &is_matrix,
+                 std::vector<int> &mdim1, std::vector<int> &mdim2,
+                 std::vector<bool> &is_output_arg, LogDescription *desc) {
+    CallInst *call = cast<CallInst>(inst);
+    Function *func = inst->getParent()->getParent();
+    IntegerType *nativeInt = getNativeIntegerType();
+    IRBuilder<> builder(inst);
+
+    std::vector<Value*> inputs;
+    if (!marshalInputs(builder, inst, n, op_size, is_matrix, mdim1, mdim2,
+                       inputs)) {
+      ACCEPT_LOG << "cannot trace non-numeric inputs\n";
+      return false;
+    }
+    Value *inArray = npuFloatArray(builder, func, inputs, "npu_trace_in");
+
+    // Outputs are only available after the call.
+    builder.SetInsertPoint(++BasicBlock::iterator(inst));
+    std::vector<Value*> outputs;
+    if (inst->getType()->isIntegerTy() || inst->getType()->isFloatingPointTy())
+      outputs.push_back(npuFloat(builder, inst));
+    for (unsigned i = 0; i < call->getNumArgOperands(); ++i) {
+      if (!is_output_arg[i])
+        continue;
+      Value *out = npuFloat(builder,
+          builder.CreateLoad(call->getArgOperand(i)));
+      if (!out) {
+        ACCEPT_LOG << "cannot trace non-numeric outputs\n";
+        return false;
+      }
+      outputs.push_back(out);
+    }
+    Value *outArray = npuFloatArray(builder, func, outputs, "npu_trace_out");
+
+    Type *bytePtrTy = builder.getInt8PtrTy();
+    Type *floatPtrTy = Type::getFloatPtrTy(module->getContext());
+    Constant *traceFunc = module->getOrInsertFunction("accept_npu_trace",
+        builder.getVoidTy(), bytePtrTy, floatPtrTy, nativeInt, floatPtrTy,
+        nativeInt, NULL);
+    Value *args[] = {
+      builder.CreateGlobalStringPtr(optName, "accept_npu_region"),
+      inArray,
+      ConstantInt::get(nativeInt, inputs.size()),
+      outArray,
+      ConstantInt::get(nativeInt, outputs.size())
+    };
+    builder.CreateCall(traceFunc, args);
+
+    ACCEPT_LOG << "tracing " << inputs.size() << " inputs and "
+               << outputs.size() << " outputs\n";
+    return true;
+  }
+
   IntegerType *getNativeIntegerType() {
     DataLayout layout(module->getDataLayout());
     return Type::getIntNTy(module->getContext(),
@@ -332,6 +632,36 @@ namespace {
     }
   }
 
+  // Is a value computed in the loop body before the call used after it?
+  // The last batch's results are read when the loop exits, on a path from
+  // the header that skips the code before the call.
+  bool valuesCrossCall(Loop *loop, Instruction *inst) {
+    BasicBlock *callBlock = inst->getParent();
+    std::set<Instruction *> before;
+    for (Loop::block_iterator bi = loop->block_begin();
+         bi != loop->block_end(); ++bi) {
+      if (*bi == loop->getHeader() || !DT->dominates(*bi, callBlock))
+        continue;
+      for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end();
+           ++ii) {
+        if (&*ii == inst)
+          break;
+        before.insert(ii);
+      }
+    }
+
+    for (std::set<Instruction *>::iterator i = before.begin();
+         i != before.end(); ++i) {
+      for (Value::use_iterator ui = (*i)->use_begin();
+           ui != (*i)->use_end(); ++ui) {
+        Instruction *user = dyn_cast<Instruction>(*ui);
+        if (user && user != inst && !before.count(user))
+          return true;
+      }
+    }
+    return false;
+  }
+
   bool isApproxGEPChain(StoreInst *SI) {
     Value *ptr = SI->getPointerOperand();
     GetElementPtrInst *GEP;
@@ -539,9 +869,7 @@ namespace {
       return false;
     }
 
-    if (!inst->getType()->isIntegerTy() &&
-        !inst->getType()->isVoidTy() &&
-        !inst->getType()->isFloatTy()) {
+    if (!inst->getType()->isVoidTy() && !isNPUScalar(inst->getType())) {
       ACCEPT_LOG << "call's return type is not int, void, or FP\n";
       return false;
     }
@@ -634,27 +962,20 @@ namespace {
     // be passed as input to the NPU. Rules are:
     // 1 - If it can be determined from the function signature
     // how many elements the argument expects AND it's a small number.
-    // e.g void f(int a[5]);
+    // e.g void f(int a[5]); (The frontend records these; see argShapes.)
     // 2 - If it can be determined *exactly where the pointer points to*
     // and it's a small declaration.
     std::vector<int> op_size;
-    const int input_size_threshold = 10;
-    std::ifstream file("accept-npuArrayArgs-info.txt");
-    if (file.is_open()) {
-      while (file.good()) {
-        std::string line;
-        file >> line;
-        if (line == f->getName().str())
-          break;
-      }
-    }
+    const int input_size_threshold = 64;
+    const std::vector<int> &shapes = argShapes(f);
     for (unsigned int i = 0; i < n; ++i) {
-      int n_array;
-      file >> n_array;
-      op_size.push_back(n_array < input_size_threshold ? n_array : 0);
+      int n_array = i < shapes.size() ? shapes[i] : 0;
+      if (!n_array)
+        n_array = staticArraySize(inst->getOperand(i));
+      op_size.push_back(n_array <= input_size_threshold ? n_array : 0);
     }
-    file.close();
 
+    // 2D arrays: the shape comes from the array the argument decays from.
     std::vector<bool> is_matrix;
     std::vector<int> mdim1(n, 0);
     std::vector<int> mdim2(n, 0);
@@ -664,75 +985,18 @@ namespace {
       if (op_size[i] != -1)
         continue;
 
-      // std::cerr << "op_size " << op_size[i] << std::endl;
-      // std::cerr << "operands: " << inst->getNumOperands() << std::endl;
-      GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(inst->getOperandUse(i));
-      AllocaInst *ainst = dyn_cast<AllocaInst>(inst->getOperandUse(i));
-      GlobalValue *aval = dyn_cast<GlobalValue>(inst->getOperandUse(i));
-      GlobalVariable *avar = dyn_cast<GlobalVariable>(inst->getOperandUse(i));
-      Instruction *bainst = dyn_cast<Instruction>(inst->getOperandUse(i));
-      GlobalAlias *gal = dyn_cast<GlobalAlias>(inst->getOperandUse(i));
-      // std::cerr << "dump bla" << std::endl;
-      /*
-      for (int j = 0; j < 22; ++j) {
-        unsigned char u = j;
-        unsigned c = u;
-        std::cerr << j << "\t" << c << std::endl;
-      }
-      std::cerr << "end dump bla" << std::endl;
-      std::cerr << "special dump 1" << std::endl;
-      inst->getOperandUse(i)->getType()->dump();
-      std::cerr << "end special dump 1" << std::endl;
-            std::string type_str;
-            llvm::raw_string_ostream rso(type_str);
-            rso << *(inst->getOperandUse(i));
-            std::cerr << rso.str() << std::endl;
-            (inst->getOperandUse(i))->dump();
-      if (!ainst) std::cerr << "notalloca" << std::endl;
-      if (!aval) std::cerr << "notgv" << std::endl;
-      if (!avar) std::cerr << "notgvar" << std::endl;
-      if (!bainst) std::cerr << "notinst" << std::endl;
-      if (!bainst) std::cerr << "notgal" << std::endl;
-      std::cerr << "\n\n\n\n\n" <<std::endl;
-      std::cerr << inst->getValueID() << std::cerr;
-      std::cerr << "\n\n\n\n\n" <<std::endl;
-      std::cerr << inst->getOperandUse(i)->getValueID() << std::cerr;
-      std::cerr << "\n\n\n\n\n" <<std::endl;
-      */
-
-      //====================================
-
-
-      if (!GEP || !GEP->hasAllZeroIndices()) {
-        op_size[i] = 0;
-        continue;
-      }
-
-      Value *ptr = GEP->getPointerOperand();
-      AllocaInst *allocai = dyn_cast<AllocaInst>(ptr);
-      if (!allocai) {
+      ArrayType *ty1 = decayedArrayType(inst->getOperand(i));
+      ArrayType *ty2 = ty1 ? dyn_cast<ArrayType>(ty1->getElementType()) : NULL;
+      if (!ty2 || !isNPUScalar(ty2->getElementType()) ||
+          ty1->getNumElements() * ty2->getNumElements() >
+              (uint64_t)input_size_threshold) {
         op_size[i] = 0;
         continue;
       }
 
-      Type *ty1 = allocai->getAllocatedType();
-      // std::cerr << "special dump 2" << std::endl;
-      ty1->dump();
-      // std::cerr << "end special dump 2" << std::endl;
-      if (!ty1->isArrayTy() || !ty1->getNumContainedTypes()) {
-        op_size[i] = 0;
-        continue;
-      }
-
-      Type *ty2 = (ty1->getContainedType(0));
-      if (!ty2->isArrayTy() || !ty2->getNumContainedTypes() || !ty2->getContainedType(0)->isFloatTy()) {
-        op_size[i] = 0;
-        continue;
-      }
-
-      op_size[i] = ty1->getArrayNumElements() * ty2->getArrayNumElements();
-      mdim1[i] = ty1->getArrayNumElements();
-      mdim2[i] = ty2->getArrayNumElements();
+      op_size[i] = ty1->getNumElements() * ty2->getNumElements();
+      mdim1[i] = ty1->getNumElements();
+      mdim2[i] = ty2->getNumElements();
     }
 
     // Check the declaration (alloca) to see if it is a "normal" variable (i.e. not a pointer)
@@ -790,24 +1054,97 @@ namespace {
       if (is_output_arg[i])
         ++n_ptr_args;
 
-    // Success. Ready to transform.
+    if (!npuMarshallable(inst, n, op_size, is_matrix, is_output_arg)) {
+      ACCEPT_LOG << "inputs or outputs are not numeric\n";
+      return false;
+    }
+
+    // In tracing mode, instrument the call instead of transforming it. Output
+    // values written anywhere but through arguments can't be traced.
+    if (optNPUTrace) {
+      if (traced_calls.count(inst))
+        return false;
+      if ((int)escaped_stores.size() != n_ptr_args) {
+        ACCEPT_LOG << "cannot trace outputs not written through arguments\n";
+        return false;
+      }
+      if (!transformPass->relax)
+        transformPass->relaxConfig[optName] = 0;
+      traced_calls.insert(inst);
+      return traceCall(inst, optName, n, op_size, is_matrix, mdim1, mdim2,
+                       is_output_arg, desc);
+    }
+
+    // Success. Ready to transform. With the software backend, a second
+    // site tunes the region's batch depth (the Zynq FIFO has a fixed size).
+    bool soft = optNPUBackend == npuSoftware;
+    std::string depthName = "npu_depth" + optName.substr(optName.find(' ')).str();
+    int depth = 0;
     if (transformPass->relax) {
-      int param = transformPass->relaxConfig[optName];
-      if (param) {
+      if (transformPass->relaxConfig[optName]) {
         ACCEPT_LOG << "NPUifying region\n";
       } else {
         ACCEPT_LOG << "could NPUify region\n";
         return false;
       }
+      if (soft)
+        depth = transformPass->relaxConfig[depthName];
     } else {
       ACCEPT_LOG << "can NPUify region\n";
       transformPass->relaxConfig[optName] = 0;
+      if (soft)
+        transformPass->relaxConfig[depthName] = 0;
       return false;
     }
 
-    // Assume a constant buffer size for now.
+    // The number of floats each invocation buffers, as counted when the
+    // inputs are marshalled below.
+    int n_inputs = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+      Type *type = inst->getOperandUse(i)->getType();
+      if (!type->isPointerTy())
+        n_inputs += 1;
+      else
+        n_inputs += op_size[i];
+    }
+
+    // ...and the number of floats it produces.
+    int n_outputs = escaped_stores.size();
+    if (f->getReturnType()->isIntegerTy() ||
+        f->getReturnType()->isFloatingPointTy())
+      ++n_outputs;
+
+    // The buffer size is global unless the region's depth parameter p
+    // picks one: 2^p invocations.
     int buffer_size = optNPUBufferSize;
-    ACCEPT_LOG << "with buffer size: " << optNPUBufferSize << "\n";
+    int buffer_calls;
+    if (depth) {
+      buffer_calls = 1 << depth;
+      buffer_size = buffer_calls * n_inputs;
+      ACCEPT_LOG << "with region batch size: " << buffer_calls << "\n";
+    } else if (optNPUBatch > 0) {
+      buffer_calls = optNPUBatch;
+      buffer_size = buffer_calls * n_inputs;
+      ACCEPT_LOG << "with batch size: " << buffer_calls << "\n";
+    } else {
+      buffer_calls = n_inputs ? (buffer_size + n_inputs - 1) / n_inputs : 0;
+      ACCEPT_LOG << "with buffer size: " << optNPUBufferSize << "\n";
+    }
+    // A batch that is still filling when the loop exits is evaluated on the
+    // way out, from a check on the header's exit edge. So the loop must exit
+    // from its header, and the code after the call must not use values
+    // computed before it. A batch of one invocation never remains partial.
+    bool drain = n != 0 && buffer_calls > 1;
+    if (drain) {
+      BasicBlock *header = loop->getHeader();
+      if (!NPU_DRAIN_SUPPORTED || loop->getExitingBlock() != header ||
+          !loop->getExitBlock() || inst->getParent() == header ||
+          valuesCrossCall(loop, inst)) {
+        ACCEPT_LOG << "loop exit would drop a partial batch\n";
+        return false;
+      }
+    }
+
     unsigned int ibuff_addr = 0xFFFF0000;
     unsigned int obuff_addr = 0xFFFF8000;
     IntegerType *nativeInt = getNativeIntegerType();
@@ -837,7 +1174,7 @@ namespace {
 
     // An auxiliary buffer to store function arguments' addresses.
     AllocaInst *addrBuffAlloca = builder.CreateAlloca(Type::getFloatPtrTy(module->getContext()),
-                                                      ConstantInt::get(nativeInt, buffer_size, false),
+                                                      ConstantInt::get(nativeInt, std::max(buffer_size, buffer_calls * n_ptr_args), false),
                                                       "npu_addrBuff_alloca");
 
     AllocaInst *iAddrCounterAlloca = builder.CreateAlloca(nativeInt,
@@ -886,12 +1223,82 @@ namespace {
                                                                   "npu_depsStoreInt_counter_alloca");
 
 
+    // Double buffering splits the buffer into two batches. While the
+    // runtime evaluates one, the loop buffers the other; the results of a
+    // batch are read back when the next one is full or when the loop exits.
+    bool async = false;
+    int half_calls = buffer_calls / 2;
+    if (soft && optNPUAsync && NPU_DRAIN_SUPPORTED) {
+      if (half_calls < 1 || n == 0) {
+        ACCEPT_LOG << "buffer too small to double-buffer\n";
+      } else {
+        async = true;
+        ACCEPT_LOG << "double-buffered\n";
+      }
+    }
+
+    // The number of the pending batch (0 for none, or 1 or 2), whether the
+    // loop is reading back the last batch on its way out, where the second
+    // batch's counters start, and where buffering resumes after a batch is
+    // read back.
+    AllocaInst *pendingAlloca = NULL;
+    AllocaInst *drainingAlloca = NULL;
+    if (drain)
+      drainingAlloca = builder.CreateAlloca(nativeInt, 0, "npu_draining");
+    AllocaInst *markIAddrAlloca = NULL;
+    AllocaInst *markStoreIntAlloca = NULL;
+    AllocaInst *markStoreFloatAlloca = NULL;
+    AllocaInst *resumeStoreIntAlloca = NULL;
+    AllocaInst *resumeStoreFloatAlloca = NULL;
+    if (async) {
+      pendingAlloca = builder.CreateAlloca(nativeInt, 0, "npu_pending");
+      markIAddrAlloca = builder.CreateAlloca(nativeInt, 0,
+                                             "npu_mark_iAddr");
+      markStoreIntAlloca = builder.CreateAlloca(nativeInt, 0,
+                                                "npu_mark_depsStoreInt");
+      markStoreFloatAlloca = builder.CreateAlloca(nativeInt, 0,
+                                                  "npu_mark_depsStoreFloat");
+      resumeStoreIntAlloca = builder.CreateAlloca(nativeInt, 0,
+                                                  "npu_resume_depsStoreInt");
+      resumeStoreFloatAlloca = builder.CreateAlloca(nativeInt, 0,
+          "npu_resume_depsStoreFloat");
+    }
+
+    // The software backend identifies the region to the runtime by name.
+    Value *regionName = NULL;
+    Constant *softIBuffFunc = NULL;
+    Constant *softOBuffFunc = NULL;
+    Constant *softInvokeFunc = NULL;
+    Constant *softSubmitFunc = NULL;
+    Constant *softWaitFunc = NULL;
+    if (soft) {
+      regionName = builder.CreateGlobalStringPtr(optName, "accept_npu_region");
+      Type *bytePtrTy = Type::getInt8PtrTy(module->getContext());
+      Type *floatPtrTy = Type::getFloatPtrTy(module->getContext());
+      softIBuffFunc = module->getOrInsertFunction("accept_npu_ibuff",
+          floatPtrTy, bytePtrTy, nativeInt, NULL);
+      softOBuffFunc = module->getOrInsertFunction("accept_npu_obuff",
+          floatPtrTy, bytePtrTy, NULL);
+      softInvokeFunc = module->getOrInsertFunction("accept_npu_invoke",
+          Type::getVoidTy(module->getContext()), bytePtrTy, nativeInt,
+          nativeInt, nativeInt, NULL);
+      softSubmitFunc = module->getOrInsertFunction("accept_npu_submit",
+          Type::getVoidTy(module->getContext()), bytePtrTy, nativeInt,
+          nativeInt, nativeInt, nativeInt, NULL);
+      softWaitFunc = module->getOrInsertFunction("accept_npu_wait",
+          Type::getVoidTy(module->getContext()), bytePtrTy, NULL);
+    }
+
     // Initialize oBuff, iBuff and iBuff counter
     builder.SetInsertPoint(loop->getLoopPreheader()->getTerminator());
     Constant *constInt = ConstantInt::get(nativeInt, ibuff_addr, false);
     Value *constPtr = ConstantExpr::getIntToPtr(constInt,
                                                 Type::getFloatPtrTy(module->getContext()));
-    builder.CreateStore(constPtr, iBuffAlloca, true);
+    if (soft)
+      builder.CreateStore(builder.CreateCall2(softIBuffFunc, regionName,
+          ConstantInt::get(nativeInt, buffer_calls * n_inputs, false)), iBuffAlloca, true);
+    else
+      builder.CreateStore(constPtr, iBuffAlloca, true);
     builder.CreateStore(ConstantInt::get(nativeInt, 0, false), counterAlloca);
     builder.CreateStore(ConstantInt::get(nativeInt, 0, false), depsFloatCounterAlloca);
     builder.CreateStore(ConstantInt::get(nativeInt, 0, false), depsIntCounterAlloca);
@@ -900,6 +1307,10 @@ namespace {
 
     if (n_ptr_args)
       builder.CreateStore(ConstantInt::get(nativeInt, 0, false), iAddrCounterAlloca);
+    if (async)
+      builder.CreateStore(ConstantInt::get(nativeInt, 0, false), pendingAlloca);
+    if (drain)
+      builder.CreateStore(ConstantInt::get(nativeInt, 0, false), drainingAlloca);
 
     // Start inserting instructions to buffer the inputs of the function call
     // right before the call itself.
@@ -934,31 +1345,19 @@ namespace {
       std::string s = makestr("npu_conv_", i);
       Type *type = inst->getOperandUse(i)->getType();
 
-      // Get the next argument and convert it if it's not float.
+      // Get the next argument and convert it if it's not float. Elements
+      // of array arguments are converted as they're loaded.
       v = inst->getOperandUse(i);
-            std::string type_str;
-            llvm::raw_string_ostream rso(type_str);
-            Instruction *bla = (Instruction*)v;
-            rso << "onev: " << *bla << "\n";
-      if (type->isIntegerTy()) {
-        IntegerType *it = static_cast<IntegerType *>(type);
-        if (it->getSignBit())
-          v = builder.CreateSIToFP(v, Type::getFloatTy(module->getContext()), s.c_str());
-        else
-          v = builder.CreateUIToFP(v, Type::getFloatTy(module->getContext()), s.c_str());
-      } else if (type->isDoubleTy()) {
-        v = builder.CreateFPTrunc(v, Type::getFloatTy(module->getContext()), s.c_str());
-      } else if (type->isPointerTy()) {
-        // TODO: Didn't find a way to discover the type of the pointer.
-        // If this is possible, convert the value loaded below.
+      if (!type->isPointerTy()) {
+        v = npuFloat(builder, v);
+      } else if (op_size[i]) {
         if (!is_matrix[i]) {
-          v = builder.CreateLoad(v);
+          v = npuFloat(builder, builder.CreateLoad(v));
         } else {
           for (int k = 0; k < mdim1[i]; ++k) {
             Value *GEP1 = builder.CreateInBoundsGEP(v,
                                                    ConstantInt::get(nativeInt, k, true),
                                                     "geprow");
-            rso << "geprow: " << *GEP1 << "\n";
             for (int p = 0; p < mdim2[i]; ++p) {
               Value *tmp[2];
               tmp[0] = ConstantInt::get(nativeInt, 0, true);
@@ -967,18 +1366,10 @@ namespace {
               Value *GEP2 = builder.CreateInBoundsGEP(GEP1,
                                                       ar,
                                                       "gepcol");
-            rso << "gepcol: " << *GEP2 << "\n";
-              mloads.push_back(builder.CreateLoad(GEP2));
-            rso << "ld: " << *mloads.back() << "\n";
+              mloads.push_back(npuFloat(builder, builder.CreateLoad(GEP2)));
             }
           }
         }
-        /*
-            Instruction *bla2 = (Instruction*)v;
-            rso << "twov: " << *bla2 << "\n";
-            std::cerr << rso.str() << std::endl;
-            v->getType()->dump();
-            */
       }
 
       // Only once (when i == 0) load iBuffAlloca
@@ -996,7 +1387,10 @@ namespace {
         iAddrChainPosition = builder.CreateInBoundsGEP(addrBuffAlloca,
                                                       iAddrChainCounter,
                                                       s.c_str());
-        builder.CreateStore(inst->getOperandUse(i), iAddrChainPosition);
+        // Output addresses are kept as float pointers whatever their type.
+        builder.CreateStore(builder.CreatePointerCast(inst->getOperandUse(i),
+                                Type::getFloatPtrTy(module->getContext())),
+                            iAddrChainPosition);
         s = makestr("npu_iAddrCounter_add_", i);
         iAddrChainCounter = builder.CreateAdd(iAddrChainCounter,
                                               ConstantInt::get(nativeInt, 1, false),
@@ -1031,7 +1425,7 @@ namespace {
             Value *auxGEP = builder.CreateInBoundsGEP(inst->getOperandUse(i),
                                                       ConstantInt::get(nativeInt, j+1),
                                                       s.c_str());
-            v = builder.CreateLoad(auxGEP);
+            v = npuFloat(builder, builder.CreateLoad(auxGEP));
           }
         }
 
@@ -1167,6 +1561,9 @@ namespace {
     // *before* the call) and the call itself will be on the other BB.
     BasicBlock *callBB = inst->getParent();
     BasicBlock *before_callBB = inst->getParent();
+    // Blocks that branch to the latch while inputs are still being buffered.
+    std::set<BasicBlock *> buffering_blocks;
+    buffering_blocks.insert(before_callBB);
     if (n != 0) {
 
       // First get an iterator to the call inst and split the BB there.
@@ -1201,13 +1598,28 @@ namespace {
 
       // Store the result back.
       builder.CreateStore(v, counterAlloca);
+      Value *filled = v;
 
       // Compare the new value of the induction variable to the buffer size.
-      v = builder.CreateICmpEQ(v,
-                                ConstantInt::get(nativeInt,
-                                                  buffer_size,
-                                                  false),
-                                "npu_icmp_iBuffSize");
+      // (Checking for overflow makes a size that isn't a multiple of the
+      // number of inputs round up to a whole invocation.) With double
+      // buffering, each half of the buffer is a batch.
+      if (async) {
+        Value *half = builder.CreateICmpEQ(filled,
+            ConstantInt::get(nativeInt, half_calls * total_buffered, false),
+            "npu_icmp_half");
+        Value *full = builder.CreateICmpEQ(filled,
+            ConstantInt::get(nativeInt, 2 * half_calls * total_buffered,
+                             false),
+            "npu_icmp_full");
+        v = builder.CreateOr(half, full, "npu_batch_full");
+      } else {
+        v = builder.CreateICmpUGE(v,
+                                  ConstantInt::get(nativeInt,
+                                                    buffer_size,
+                                                    false),
+                                  "npu_icmp_iBuffSize");
+      }
 
       // If they're the same, the buffer is full and we jump to
       // the call block. Otherwise, jump to the loop latch to buffer
@@ -1269,68 +1681,169 @@ namespace {
     }
     loop->addBasicBlockToLoop(after_callBB, LI->getBase());
 
-    // We do, in the end of the call BB, everything we should do
-    // only once i.e., not inside the loop that will read oBuff and
-    // execute remaining code.
-    builder.SetInsertPoint(callBB->getTerminator());
-
-    Constant *constInt2 = ConstantInt::get(nativeInt, obuff_addr, false);
-    Value *constPtr2 = ConstantExpr::getIntToPtr(constInt2,
-                                             Type::getFloatPtrTy(module->getContext()));
-    builder.CreateStore(constPtr2, oBuffAlloca, true);
-
-    // Initialize "oBuff read" loop induction variable
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        outLoopCounterAlloca
-    );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        iAddrCounterAlloca
-    );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        oAddrCounterAlloca
-    );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        depsIntCounterAlloca
-    );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        depsFloatCounterAlloca
-    );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        depsStoreIntCounterAlloca
-    );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
+    Value *ibuff_used;
+    if (async) {
+      // Batch events come here when half of the buffer fills and when the
+      // whole buffer fills, and the loop exit comes here when a batch is
+      // still pending. Wait for the pending batch, submit the batch that
+      // just filled, then read back the pending batch's results while the
+      // runtime evaluates the new one.
+      builder.SetInsertPoint(callBB->getTerminator());
+      Value *zero = ConstantInt::get(nativeInt, 0, false);
+      Value *halfCalls = ConstantInt::get(nativeInt, half_calls, false);
+      Value *filled = builder.CreateLoad(counterAlloca, "npu_counter_load");
+      Value *first = builder.CreateICmpEQ(filled,
+          ConstantInt::get(nativeInt, half_calls * total_buffered, false),
+          "npu_first_half");
+      Value *draining = builder.CreateICmpNE(
+          builder.CreateLoad(drainingAlloca, "npu_draining_load"), zero,
+          "npu_is_draining");
+      Value *pending = builder.CreateLoad(pendingAlloca, "npu_pending_load");
+      Value *none = builder.CreateICmpEQ(pending, zero, "npu_none_pending");
+      Value *second = builder.CreateICmpEQ(pending,
+          ConstantInt::get(nativeInt, 2, false), "npu_second_pending");
+
+      builder.CreateCall(softWaitFunc, regionName);
+
+      // The counters where the second batch starts are recorded when the
+      // first batch fills.
+      Value *save = builder.CreateAnd(first, builder.CreateNot(draining),
+                                      "npu_save_marks");
+      AllocaInst *counters[] = {
+        iAddrCounterAlloca, depsStoreIntCounterAlloca,
         depsStoreFloatCounterAlloca
-    );
-
-    // Load the iBuff writing induction variable so we know how many
-    // positions we wrote to in the iBuff.
-    // Then divide this by the number of inputs the function call uses.
-    // This gives the number of times the function would have been called,
-    // which is the number of times we should read from oBuff.
-    // We'll use this latter
-    Value *ibuff_used = builder.CreateLoad(counterAlloca,
-                                           "npu_ibuff_used");
-    ibuff_used = builder.CreateUDiv(ibuff_used,
-        ConstantInt::get(nativeInt, total_buffered, false));
+      };
+      AllocaInst *marks[] = {
+        markIAddrAlloca, markStoreIntAlloca, markStoreFloatAlloca
+      };
+      for (unsigned i = 0; i < 3; ++i)
+        builder.CreateStore(builder.CreateSelect(save,
+            builder.CreateLoad(counters[i]), builder.CreateLoad(marks[i])),
+            marks[i]);
+
+      Value *args[] = {
+        regionName,
+        builder.CreateSelect(first, zero, halfCalls),
+        builder.CreateSelect(draining, zero, halfCalls),
+        ConstantInt::get(nativeInt, total_buffered, false),
+        ConstantInt::get(nativeInt, n_outputs, false)
+      };
+      builder.CreateCall(softSubmitFunc, args);
+      builder.CreateStore(builder.CreateSelect(draining, zero,
+          builder.CreateSelect(first, ConstantInt::get(nativeInt, 1, false),
+                               ConstantInt::get(nativeInt, 2, false))),
+          pendingAlloca);
+
+      // Read back the pending batch from its start. Buffering resumes
+      // there afterward, so the counters also stay put when nothing was
+      // pending.
+      Value *starts[3];
+      for (unsigned i = 0; i < 3; ++i) {
+        Value *start = builder.CreateSelect(second,
+                                            builder.CreateLoad(marks[i]), zero);
+        starts[i] = builder.CreateSelect(none, builder.CreateLoad(counters[i]),
+                                         start);
+        builder.CreateStore(starts[i], counters[i]);
+      }
+      builder.CreateStore(starts[0], oAddrCounterAlloca);
+      builder.CreateStore(starts[1], resumeStoreIntAlloca);
+      builder.CreateStore(starts[2], resumeStoreFloatAlloca);
+      builder.CreateStore(zero, outLoopCounterAlloca);
+      builder.CreateStore(zero, depsIntCounterAlloca);
+      builder.CreateStore(zero, depsFloatCounterAlloca);
+
+      Value *obuff = builder.CreateCall(softOBuffFunc, regionName);
+      obuff = builder.CreateInBoundsGEP(obuff, builder.CreateSelect(second,
+          ConstantInt::get(nativeInt, half_calls * n_outputs, false), zero));
+      builder.CreateStore(obuff, oBuffAlloca, true);
+
+      Value *resume = builder.CreateSelect(none, filled,
+          builder.CreateSelect(second,
+              ConstantInt::get(nativeInt, half_calls * total_buffered, false),
+              zero), "npu_resume");
+      builder.CreateStore(resume, counterAlloca);
+      Value *ibuff = builder.CreateCall2(softIBuffFunc, regionName,
+          ConstantInt::get(nativeInt, buffer_calls * n_inputs, false));
+      builder.CreateStore(builder.CreateInBoundsGEP(ibuff, resume),
+                          iBuffAlloca, true);
+      ibuff_used = halfCalls;
+
+      // With nothing pending yet, go on buffering the second batch.
+      Instruction *term = callBB->getTerminator();
+      builder.CreateCondBr(none, loop->getLoopLatch(), after_callBB);
+      term->eraseFromParent();
+      buffering_blocks.insert(callBB);
+    } else {
+      // We do, in the end of the call BB, everything we should do
+      // only once i.e., not inside the loop that will read oBuff and
+      // execute remaining code.
+      builder.SetInsertPoint(callBB->getTerminator());
+
+      Constant *constInt2 = ConstantInt::get(nativeInt, obuff_addr, false);
+      Value *constPtr2 = ConstantExpr::getIntToPtr(constInt2,
+                                               Type::getFloatPtrTy(module->getContext()));
+      if (soft)
+        builder.CreateStore(builder.CreateCall(softOBuffFunc, regionName),
+                            oBuffAlloca, true);
+      else
+        builder.CreateStore(constPtr2, oBuffAlloca, true);
 
+      // Initialize "oBuff read" loop induction variable
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          outLoopCounterAlloca
+      );
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          iAddrCounterAlloca
+      );
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          oAddrCounterAlloca
+      );
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          depsIntCounterAlloca
+      );
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          depsFloatCounterAlloca
+      );
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          depsStoreIntCounterAlloca
+      );
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          depsStoreFloatCounterAlloca
+      );
 
-    // Reset "iBuff read counter" for the next time.
-    // Also reset iBuff itself.
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        counterAlloca
-    );
-    constInt = ConstantInt::get(nativeInt, ibuff_addr, false);
-    constPtr = ConstantExpr::getIntToPtr(constInt,
-                                         Type::getFloatPtrTy(module->getContext()));
-    builder.CreateStore(constPtr, iBuffAlloca, true);
+      // Load the iBuff writing induction variable so we know how many
+      // positions we wrote to in the iBuff.
+      // Then divide this by the number of inputs the function call uses.
+      // This gives the number of times the function would have been called,
+      // which is the number of times we should read from oBuff.
+      // We'll use this latter
+      ibuff_used = builder.CreateLoad(counterAlloca, "npu_ibuff_used");
+      ibuff_used = builder.CreateUDiv(ibuff_used,
+          ConstantInt::get(nativeInt, total_buffered, false));
+
+
+      // Reset "iBuff read counter" for the next time.
+      // Also reset iBuff itself.
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          counterAlloca
+      );
+      constInt = ConstantInt::get(nativeInt, ibuff_addr, false);
+      constPtr = ConstantExpr::getIntToPtr(constInt,
+                                           Type::getFloatPtrTy(module->getContext()));
+      if (soft)
+        builder.CreateStore(builder.CreateCall2(softIBuffFunc, regionName,
+            ConstantInt::get(nativeInt, buffer_calls * n_inputs, false)), iBuffAlloca, true);
+      else
+        builder.CreateStore(constPtr, iBuffAlloca, true);
+    }
 
     // Now we move to the block after the call BB (probably split
     // from it) to start reading the oBuff.
@@ -1389,6 +1902,13 @@ namespace {
       builder.CreateStore(sfloat_counter_load, depsStoreFloatCounterAlloca);
 #endif // BUFFER_STORE_LOOP_DEPS
 
+    // The types written through each output argument.
+    std::vector<Type *> output_types;
+    for (int i = 0; i < is_output_arg.size(); ++i)
+      if (is_output_arg[i])
+        output_types.push_back(cast<PointerType>(
+            c_inst->getArgOperand(i)->getType())->getElementType());
+
     bool gotRetVal = false;
     Value *retVal;
     if (f->getReturnType()->isIntegerTy() || f->getReturnType()->isFloatingPointTy()) {
@@ -1434,7 +1954,11 @@ namespace {
                                                         oAddrChainCounter,
                                                         s3.c_str());
         Value *addr_buffer_value = builder.CreateLoad(oAddrChainPosition);
-        builder.CreateStore(v, addr_buffer_value, false);
+        Type *out_type = output_types[ptr_args_i];
+        addr_buffer_value = builder.CreatePointerCast(addr_buffer_value,
+                                                      out_type->getPointerTo());
+        builder.CreateStore(npuUnfloat(builder, v, out_type),
+                            addr_buffer_value, false);
         s3 = makestr("npu_oAddrCounter_add_", ptr_args_i);
         oAddrChainCounter = builder.CreateAdd(oAddrChainCounter,
                                               ConstantInt::get(nativeInt, 1, false),
@@ -1455,13 +1979,7 @@ namespace {
 
     // Replace all the uses of inst (the call) by retVal
     if (gotRetVal) {
-      if (inst->getType()->isIntegerTy()) {
-        IntegerType *it = static_cast<IntegerType *>(inst->getType());
-        if (it->getSignBit())
-          retVal = builder.CreateFPToSI(retVal, nativeInt, "npu_conv_retval");
-        else
-          retVal = builder.CreateFPToUI(retVal, nativeInt, "npu_conv_retval");
-      }
+      retVal = npuUnfloat(builder, retVal, inst->getType());
       inst->replaceAllUsesWith(retVal);
     }
 
@@ -1568,16 +2086,73 @@ namespace {
         ConstantInt::get(nativeInt, 0, false),
         depsFloatCounterAlloca
     );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        depsStoreIntCounterAlloca
-    );
-    builder.CreateStore(
-        ConstantInt::get(nativeInt, 0, false),
-        depsStoreFloatCounterAlloca
-    );
-    builder.CreateBr(loop->getLoopLatch());
+    if (async) {
+      // Buffering resumes where the batch that was read back started.
+      builder.CreateStore(builder.CreateLoad(resumeStoreIntAlloca),
+                          depsStoreIntCounterAlloca);
+      builder.CreateStore(builder.CreateLoad(resumeStoreFloatAlloca),
+                          depsStoreFloatCounterAlloca);
+    } else {
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          depsStoreIntCounterAlloca
+      );
+      builder.CreateStore(
+          ConstantInt::get(nativeInt, 0, false),
+          depsStoreFloatCounterAlloca
+      );
+    }
     loop->addBasicBlockToLoop(zeroStoreCountersBB, LI->getBase());
+
+    if (drain) {
+      // The header's exit goes through a check for a partial batch, or with
+      // double buffering for a pending one. If there is one, it is evaluated
+      // and its results are read back before the loop exits.
+      BasicBlock *header = loop->getHeader();
+      BasicBlock *exitBB = loop->getExitBlock();
+      Function *func = header->getParent();
+      BasicBlock *drainCheckBB = BasicBlock::Create(module->getContext(),
+          "npu_drain_check", func, exitBB);
+      BasicBlock *drainBB = BasicBlock::Create(module->getContext(),
+          "npu_drain", func, exitBB);
+      TerminatorInst *headerTerm = header->getTerminator();
+      for (unsigned i = 0; i < headerTerm->getNumSuccessors(); ++i)
+        if (headerTerm->getSuccessor(i) == exitBB)
+          headerTerm->setSuccessor(i, drainCheckBB);
+      for (BasicBlock::iterator ii = exitBB->begin();
+           PHINode *phi = dyn_cast<PHINode>(ii); ++ii) {
+        int idx;
+        while ((idx = phi->getBasicBlockIndex(header)) != -1)
+          phi->setIncomingBlock(idx, drainCheckBB);
+      }
+
+      IRBuilder<> drainBuilder(drainCheckBB);
+      Value *pending;
+      if (async)
+        pending = drainBuilder.CreateICmpNE(
+            drainBuilder.CreateLoad(pendingAlloca, "npu_pending_load"),
+            ConstantInt::get(nativeInt, 0, false), "npu_any_pending");
+      else
+        pending = drainBuilder.CreateICmpNE(
+            drainBuilder.CreateLoad(counterAlloca, "npu_counter_load"),
+            ConstantInt::get(nativeInt, 0, false), "npu_any_buffered");
+      drainBuilder.CreateCondBr(pending, drainBB, exitBB);
+      drainBuilder.SetInsertPoint(drainBB);
+      drainBuilder.CreateStore(ConstantInt::get(nativeInt, 1, false),
+                               drainingAlloca);
+      drainBuilder.CreateBr(callBB);
+      loop->addBasicBlockToLoop(drainCheckBB, LI->getBase());
+      loop->addBasicBlockToLoop(drainBB, LI->getBase());
+
+      // After reading back the last batch, return to the exit check. (The
+      // call block has reset the counter, so a synchronous loop then exits.)
+      Value *draining = builder.CreateICmpNE(
+          builder.CreateLoad(drainingAlloca, "npu_draining_load"),
+          ConstantInt::get(nativeInt, 0, false), "npu_is_draining");
+      builder.CreateCondBr(draining, drainCheckBB, loop->getLoopLatch());
+    } else {
+      builder.CreateBr(loop->getLoopLatch());
+    }
 #endif
 
     // Now that we have all the BB's that jump to the latch,
@@ -1600,7 +2175,7 @@ namespace {
          bi != jump_to_latch.end();
          ++bi) {
 
-      if ((*bi) == before_callBB)
+      if (buffering_blocks.count(*bi))
         continue;
 
       // Get the last inst, which should be a branch and change the
@@ -1659,6 +2234,27 @@ namespace {
 
     builder.SetInsertPoint(inst);
 
+    if (async) {
+      // The batches were submitted in the call block.
+      inst->eraseFromParent();
+      return true;
+    } else if (soft) {
+      // Evaluate the buffered invocations in software.
+      Value *ncalls = builder.CreateUDiv(
+          builder.CreateLoad(counterAlloca, "npu_counter_load"),
+          ConstantInt::get(nativeInt, total_buffered, false),
+          "npu_ncalls");
+      Value *args[] = {
+        regionName,
+        ncalls,
+        ConstantInt::get(nativeInt, total_buffered, false),
+        ConstantInt::get(nativeInt, n_outputs, false)
+      };
+      builder.CreateCall(softInvokeFunc, args);
+      inst->eraseFromParent();
+      return true;
+    }
+
     InlineAsm *asm1 = InlineAsm::get(FunctionType::get(builder.getVoidTy(), false),
                                       StringRef("dsb"),
                                       StringRef(""),
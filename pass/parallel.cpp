@@ -0,0 +1,360 @@
+#include "accept.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+// Approximate parallelization. A loop whose body only has side effects on
+// approximate data (as for perforation) is outlined and run on all the
+// threads of the pool in rt/parallel.c. Dependences through approximate
+// memory, like an accumulator, are allowed to race.
+//
+// Every thread runs the loop's precise control (its condition and
+// increment) in full, so the induction logic doesn't need to be understood.
+// The body's iterations are split into chunks of 4^(p-1) iterations for
+// parameter p, and threads claim chunks from a shared counter as they go.
+// A thread runs the body only for the chunks it claimed, so faster threads
+// take on more of the work.
+//
+// Local variables that the loop writes and that aren't read after it (like
+// the induction variable and body temporaries) become private to each
+// thread, starting from the value they had before the loop. Precise stores
+// are only allowed to such private variables.
+
+#define PARALLEL_MAX_PARAM 5
+
+namespace {
+  // Find the loads and stores of memory derived from an alloca. `escapes`
+  // is set if the memory is used in some other way or through a pointer
+  // computed outside the loop, since then it can't be made private.
+  void allocaAccesses(Value *ptr, Loop *loop,
+                      std::vector<Instruction*> &accesses, bool &escapes) {
+    for (Value::use_iterator ui = ptr->use_begin(); ui != ptr->use_end();
+         ++ui) {
+      Instruction *user = dyn_cast<Instruction>(*ui);
+      if (!user) {
+        escapes = true;
+      } else if (isa<GetElementPtrInst>(user) || isa<BitCastInst>(user)) {
+        std::vector<Instruction*> derived;
+        allocaAccesses(user, loop, derived, escapes);
+        if (!loop->contains(user))
+          for (unsigned i = 0; i < derived.size(); ++i)
+            if (loop->contains(derived[i]))
+              escapes = true;
+        accesses.insert(accesses.end(), derived.begin(), derived.end());
+      } else if (isa<LoadInst>(user)) {
+        accesses.push_back(user);
+      } else if (StoreInst *store = dyn_cast<StoreInst>(user)) {
+        if (store->getPointerOperand() == ptr)
+          accesses.push_back(store);
+        else
+          escapes = true;
+      } else if (!isa<DbgInfoIntrinsic>(user)) {
+        escapes = true;
+      }
+    }
+  }
+
+  // Find the allocas that each thread gets a private copy of. The flag says
+  // whether the copy starts with the shared variable's value.
+  void findPrivates(Function &F, Loop *loop,
+                    std::map<AllocaInst*, bool> &privates) {
+    BasicBlock &entry = F.getEntryBlock();
+    for (BasicBlock::iterator ii = entry.begin(); ii != entry.end(); ++ii) {
+      AllocaInst *alloca = dyn_cast<AllocaInst>(ii);
+      if (!alloca || !isa<ConstantInt>(alloca->getArraySize()))
+        continue;
+
+      std::vector<Instruction*> accesses;
+      bool escapes = false;
+      allocaAccesses(alloca, loop, accesses, escapes);
+      bool used = false, storedInLoop = false;
+      bool loadedOutside = false, storedOutside = false;
+      for (unsigned i = 0; i < accesses.size(); ++i) {
+        bool inLoop = loop->contains(accesses[i]);
+        bool isStore = isa<StoreInst>(accesses[i]);
+        used = used || inLoop;
+        storedInLoop = storedInLoop || (inLoop && isStore);
+        loadedOutside = loadedOutside || (!inLoop && !isStore);
+        storedOutside = storedOutside || (!inLoop && isStore);
+      }
+      if (!used || escapes || loadedOutside)
+        continue;
+
+      // Arrays are only private when they're entirely local to the loop.
+      // Read-only scalars can just be shared.
+      Type *type = alloca->getAllocatedType();
+      if (type->isSingleValueType() && !alloca->isArrayAllocation()) {
+        if (storedInLoop)
+          privates[alloca] = storedOutside;
+      } else if (!storedOutside) {
+        privates[alloca] = false;
+      }
+    }
+  }
+}
+
+// Check whether a loop can be parallelized and find its private variables.
+bool ACCEPTPass::parallelizable(Loop *loop, BasicBlock *&bodyBlock,
+                                std::map<AllocaInst*, bool> &privates,
+                                LogDescription *desc) {
+  BasicBlock *header = loop->getHeader();
+  BasicBlock *latch = loop->getLoopLatch();
+  if (!latch || !loop->getLoopPreheader() || !loop->getExitBlock()) {
+    ACCEPT_LOG << "loop not in parallelizable form\n";
+    return false;
+  }
+
+  // As in perforation, the header must decide between the body and the
+  // exit, and the latch must be separate from the body (a for-like loop).
+  BranchInst *condBranch = dyn_cast<BranchInst>(header->getTerminator());
+  if (!condBranch || !condBranch->isConditional() || header == latch) {
+    ACCEPT_LOG << "loop not in parallelizable form\n";
+    return false;
+  }
+  if (condBranch->getSuccessor(0) == loop->getExitBlock())
+    bodyBlock = condBranch->getSuccessor(1);
+  else if (condBranch->getSuccessor(1) == loop->getExitBlock())
+    bodyBlock = condBranch->getSuccessor(0);
+  else
+    bodyBlock = NULL;
+  if (!bodyBlock || bodyBlock == latch || isa<PHINode>(bodyBlock->front()) ||
+      isa<PHINode>(latch->front())) {
+    ACCEPT_LOG << "loop not in parallelizable form\n";
+    return false;
+  }
+
+  std::set<BasicBlock*> bodyBlocks;
+  for (Loop::block_iterator bi = loop->block_begin();
+       bi != loop->block_end(); ++bi) {
+    if (*bi == header || *bi == latch)
+      continue;
+    if (loop->isLoopExiting(*bi)) {
+      ACCEPT_LOG << "contains loop exit\n";
+      return false;
+    }
+    bodyBlocks.insert(*bi);
+  }
+
+  // The body may only have approximate side effects.
+  std::set<Instruction*> blockers = AI->preciseEscapeCheck(bodyBlocks);
+  if (!blockers.empty()) {
+    for (std::set<Instruction*>::iterator i = blockers.begin();
+         i != blockers.end(); ++i)
+      ACCEPT_LOG << *i;
+    ACCEPT_LOG << "body has precise side effects\n";
+    return false;
+  }
+
+  // Every thread runs the loop's control, so it must be pure too.
+  BasicBlock *control[] = {header, latch};
+  for (unsigned i = 0; i < 2; ++i) {
+    for (BasicBlock::iterator ii = control[i]->begin();
+         ii != control[i]->end(); ++ii) {
+      CallInst *call = dyn_cast<CallInst>(ii);
+      if (!call || isa<DbgInfoIntrinsic>(call))
+        continue;
+      Function *callee = call->getCalledFunction();
+      if (!callee || !AI->isPrecisePure(callee)) {
+        ACCEPT_LOG << call;
+        ACCEPT_LOG << "loop control calls an impure function\n";
+        return false;
+      }
+    }
+  }
+
+  // Precise stores must go to private variables.
+  findPrivates(*header->getParent(), loop, privates);
+  for (Loop::block_iterator bi = loop->block_begin();
+       bi != loop->block_end(); ++bi) {
+    for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end(); ++ii) {
+      StoreInst *store = dyn_cast<StoreInst>(ii);
+      if (!store || isApprox(store))
+        continue;
+      AllocaInst *alloca = dyn_cast<AllocaInst>(
+          GetUnderlyingObject(store->getPointerOperand()));
+      if (!alloca || !privates.count(alloca)) {
+        ACCEPT_LOG << store;
+        ACCEPT_LOG << "precise store to shared memory\n";
+        return false;
+      }
+    }
+  }
+
+  // Values computed in the loop can't be used after it.
+  CodeExtractor extractor(loop->getBlocks(), NULL, true);
+  SetVector<Value*> inputs, outputs;
+  extractor.findInputsOutputs(inputs, outputs);
+  if (!extractor.isEligible() || !outputs.empty()) {
+    ACCEPT_LOG << "loop cannot be outlined\n";
+    return false;
+  }
+
+  return true;
+}
+
+void ACCEPTPass::parallelizeLoop(Loop *loop, BasicBlock *bodyBlock,
+                                 const std::map<AllocaInst*, bool> &privates,
+                                 int param) {
+  LLVMContext &ctx = module->getContext();
+  Type *i64 = Type::getInt64Ty(ctx);
+  Type *i8ptr = Type::getInt8PtrTy(ctx);
+  BasicBlock *header = loop->getHeader();
+  BasicBlock *latch = loop->getLoopLatch();
+  Function *parent = header->getParent();
+
+  // Outline the loop. Its inputs are passed in a structure.
+  CodeExtractor extractor(loop->getBlocks(), NULL, true);
+  Function *body = extractor.extractCodeRegion();
+  body->setName("accept_par_" + parent->getName());
+  CallInst *call = cast<CallInst>(*body->use_begin());
+  Value *structArg = call->getArgOperand(0);
+
+  // Find the input stored in each field of the structure.
+  std::map<uint64_t, Value*> fieldInputs;
+  for (BasicBlock::iterator ii = call->getParent()->begin();
+       ii != call->getParent()->end(); ++ii) {
+    StoreInst *store = dyn_cast<StoreInst>(ii);
+    if (!store)
+      continue;
+    GetElementPtrInst *gep =
+        dyn_cast<GetElementPtrInst>(store->getPointerOperand());
+    if (gep && gep->getPointerOperand() == structArg)
+      fieldInputs[cast<ConstantInt>(gep->getOperand(2))->getZExtValue()] =
+          store->getValueOperand();
+  }
+
+  // Replace the loaded private inputs with thread-local copies.
+  BasicBlock &entry = body->getEntryBlock();
+  Argument *arg = body->arg_begin();
+  std::vector<LoadInst*> fieldLoads;
+  for (BasicBlock::iterator ii = entry.begin(); ii != entry.end(); ++ii) {
+    if (LoadInst *load = dyn_cast<LoadInst>(ii))
+      fieldLoads.push_back(load);
+  }
+  for (std::vector<LoadInst*>::iterator i = fieldLoads.begin();
+       i != fieldLoads.end(); ++i) {
+    GetElementPtrInst *gep =
+        dyn_cast<GetElementPtrInst>((*i)->getPointerOperand());
+    if (!gep || gep->getPointerOperand() != arg)
+      continue;
+    uint64_t field = cast<ConstantInt>(gep->getOperand(2))->getZExtValue();
+    AllocaInst *shared = dyn_cast_or_null<AllocaInst>(fieldInputs[field]);
+    if (!shared || !privates.count(shared))
+      continue;
+
+    AllocaInst *priv = new AllocaInst(shared->getAllocatedType(),
+                                      shared->getArraySize(),
+                                      shared->getAlignment(),
+                                      shared->getName() + ".private",
+                                      entry.begin());
+    (*i)->replaceAllUsesWith(priv);
+    if (privates.find(shared)->second) {
+      IRBuilder<> builder(entry.getTerminator());
+      builder.CreateStore(builder.CreateLoad(*i), priv);
+    }
+  }
+
+  // Count iterations and claim the first chunk on entry.
+  Constant *claimFunc = module->getOrInsertFunction("accept_par_claim",
+      i64, NULL);
+  IRBuilder<> builder(entry.begin());
+  AllocaInst *counter = builder.CreateAlloca(i64, 0, "accept_par_iter");
+  AllocaInst *next = builder.CreateAlloca(i64, 0, "accept_par_next");
+  builder.SetInsertPoint(entry.getTerminator());
+  builder.CreateStore(builder.getInt64(0), counter);
+  builder.CreateStore(builder.CreateCall(claimFunc), next);
+
+  builder.SetInsertPoint(latch->getTerminator());
+  builder.CreateStore(builder.CreateAdd(builder.CreateLoad(counter),
+                                        builder.getInt64(1)), counter);
+
+  // Before the body: once this thread passes the chunk it claimed, it
+  // claims another. It runs the body only in its own chunk.
+  BasicBlock *checkBlock = BasicBlock::Create(ctx, "accept_par_check", body,
+                                              bodyBlock);
+  BasicBlock *claimBlock = BasicBlock::Create(ctx, "accept_par_claim", body,
+                                              bodyBlock);
+  BasicBlock *ownBlock = BasicBlock::Create(ctx, "accept_par_own", body,
+                                            bodyBlock);
+  BranchInst *condBranch = cast<BranchInst>(header->getTerminator());
+  for (unsigned i = 0; i < condBranch->getNumSuccessors(); ++i)
+    if (condBranch->getSuccessor(i) == bodyBlock)
+      condBranch->setSuccessor(i, checkBlock);
+
+  int logChunk = 2 * (std::min(param, PARALLEL_MAX_PARAM) - 1);
+  builder.SetInsertPoint(checkBlock);
+  Value *chunk = builder.CreateLShr(builder.CreateLoad(counter), logChunk,
+                                    "accept_par_chunk");
+  builder.CreateCondBr(builder.CreateICmpSGT(chunk, builder.CreateLoad(next)),
+                       claimBlock, ownBlock);
+  builder.SetInsertPoint(claimBlock);
+  builder.CreateStore(builder.CreateCall(claimFunc), next);
+  builder.CreateBr(ownBlock);
+  builder.SetInsertPoint(ownBlock);
+  builder.CreateCondBr(builder.CreateICmpEQ(chunk, builder.CreateLoad(next)),
+                       bodyBlock, latch);
+
+  // Run the outlined loop on the pool.
+  Type *fnPtrTy = PointerType::getUnqual(FunctionType::get(
+      Type::getVoidTy(ctx), i8ptr, false));
+  Constant *runFunc = module->getOrInsertFunction("accept_par_run",
+      Type::getVoidTy(ctx), fnPtrTy, i8ptr, NULL);
+  builder.SetInsertPoint(call);
+  builder.CreateCall2(runFunc, ConstantExpr::getBitCast(body, fnPtrTy),
+                      builder.CreateBitCast(structArg, i8ptr));
+  call->eraseFromParent();
+}
+
+bool ACCEPTPass::optimizeParallel(Function &F) {
+  // The other optimizations may have changed the CFG, so the loops are
+  // found afresh.
+  DominatorTree DT;
+  DT.runOnFunction(F);
+  LoopInfo LI;
+  LI.getBase().Analyze(DT.getBase());
+
+  // Only outermost loops, so parallel loops don't nest.
+  std::vector<Loop*> loops(LI.begin(), LI.end());
+  bool modified = false;
+  for (std::vector<Loop*>::iterator i = loops.begin(); i != loops.end();
+       ++i) {
+    Loop *loop = *i;
+    Instruction *first = loop->getHeader()->getFirstNonPHI();
+    std::string optName = siteName("parallel", first);
+    LogDescription *desc = AI->logAdd("Loop", first);
+    ACCEPT_LOG << optName << "\n";
+
+    if (AI->instMarker(first) == markerForbid) {
+      ACCEPT_LOG << "optimization forbidden\n";
+      continue;
+    }
+    BasicBlock *bodyBlock;
+    std::map<AllocaInst*, bool> privates;
+    if (!parallelizable(loop, bodyBlock, privates, desc))
+      continue;
+    ACCEPT_LOG << privates.size() << " private variables\n";
+
+    if (relax) {
+      int param = relaxConfig[optName];
+      if (param) {
+        ACCEPT_LOG << "parallelizing with chunk size 4^" << (param - 1)
+                   << "\n";
+        parallelizeLoop(loop, bodyBlock, privates, param);
+        modified = true;
+      }
+    } else {
+      ACCEPT_LOG << "can parallelize\n";
+      relaxConfig[optName] = 0;
+    }
+  }
+  return modified;
+}
@@ -52,8 +52,8 @@ namespace {
       RegisterACCEPT(PassManagerBuilder::EP_EarlyAsPossible,
                      registerACCEPT);
 
-  // Alias analysis.
-  /*
+  // Alias analysis. It is added after the default alias analyses, so it
+  // is queried first and delegates to them.
   static void registerAA(const PassManagerBuilder &, PassManagerBase &PM) {
     PM.add(createAcceptAAPass());
   }
@@ -61,5 +61,4 @@ namespace {
   static RegisterStandardPasses
       RM(PassManagerBuilder::EP_ModuleOptimizerEarly,
          registerAA);
-  */
 }
@@ -14,6 +14,7 @@
 #include "llvm/DataLayout.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 
 #include <set>
 #include <cstdio>
@@ -31,6 +32,8 @@ cl::opt<bool> optRelax ("accept-relax",
 
 ACCEPTPass::ACCEPTPass() : FunctionPass(ID) {
   module = 0;
+  usedQuorumBarriers = false;
+  usedReductions = false;
 
   relax = optRelax;
 
@@ -42,6 +45,7 @@ void ACCEPTPass::getAnalysisUsage(AnalysisUsage &Info) const {
   Info.addRequired<LoopInfo>();
   Info.addRequired<DominatorTree>();
   Info.addRequired<PostDominatorTree>();
+  Info.addRequired<ScalarEvolution>();
   Info.addRequiredTransitive<ApproxInfo>();
   if (acceptUseProfile)
     Info.addRequired<ProfileInfo>();
@@ -83,6 +87,17 @@ bool ACCEPTPass::runOnFunction(Function &F) {
 
   bool modified = false;
   modified = modified || optimizeSync(F);
+  modified = optimizeLUT(F) || modified;
+  modified = optimizeFastMath(F) || modified;
+  modified = optimizeCompression(F) || modified;
+  modified = optimizeDemotion(F) || modified;
+  modified = optimizeFixedPoint(F) || modified;
+  modified = optimizeNarrowing(F) || modified;
+  modified = optimizeArith(F) || modified;
+  modified = optimizeMemo(F) || modified;
+  modified = relaxFPFlags(F) || modified;
+  modified = optimizeAlias(F) || modified;
+  modified = optimizeParallel(F) || modified;
   return modified;
 }
 
@@ -141,7 +156,16 @@ bool ACCEPTPass::doInitialization(Module &M) {
 bool ACCEPTPass::doFinalization(Module &M) {
   if (!relax)
     dumpRelaxConfig();
-  return false;
+  bool changed = false;
+  if (usedQuorumBarriers) {
+    hookBarrierInit();
+    changed = true;
+  }
+  if (usedReductions) {
+    flushReductionsAtBarriers();
+    changed = true;
+  }
+  return changed;
 }
 
 const char *ACCEPTPass::getPassName() const {
@@ -5,6 +5,12 @@
 
 static double time_begin;
 
+// Provided by the synchronization profiler (syncprof.c).
+void accept_syncprof_dump(void);
+
+// Provided by the reduction privatization support (reduce.c).
+void accept_reduce_flush(void);
+
 void accept_roi_begin() {
     struct timeval t;
     gettimeofday(&t,NULL);
@@ -13,6 +19,10 @@ void accept_roi_begin() {
 
 void accept_roi_end() {
     struct timeval t;
+
+    // The output after the ROI must see this thread's reduction partials.
+    accept_reduce_flush();
+
     gettimeofday(&t,NULL);
     double time_end = (double)t.tv_sec+(double)t.tv_usec*1e-6;
     double delta = time_end - time_begin;
@@ -20,4 +30,6 @@ void accept_roi_end() {
     FILE *f = fopen("accept_time.txt", "w");
     fprintf(f, "%f\n", delta);
     fclose(f);
+
+    accept_syncprof_dump();
 }
@@ -0,0 +1,159 @@
+// Relaxed barrier support for the host platform. The ACCEPT pass guards
+// approximable barrier calls with a call to accept_barrier_relax(), and the
+// original barrier only executes when that call returns nonzero. It can also
+// replace barrier waits with quorum barriers, which release once a fraction
+// of the participants has arrived.
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Per-thread counters keyed on a barrier's identity (usually its address),
+// stored in a small open-addressed table.
+#define THREAD_SLOTS 64
+
+typedef struct {
+    const void *key;
+    unsigned long count;
+} thread_slot;
+
+static thread_slot *thread_lookup(thread_slot *table, const void *key) {
+    uintptr_t hash = ((uintptr_t)key >> 4) * 2654435761u;
+    unsigned i;
+    for (i = 0; i < THREAD_SLOTS; ++i) {
+        thread_slot *slot = &table[(hash + i) % THREAD_SLOTS];
+        if (slot->key == key)
+            return slot;
+        if (!slot->key) {
+            slot->key = key;
+            return slot;
+        }
+    }
+    return 0;
+}
+
+
+/**** BOUNDED STALENESS ****/
+
+// Each thread counts its own arrivals at every barrier it reaches. Since all
+// participants reach a barrier the same number of times, they all agree on
+// which arrivals actually synchronize without any communication.
+static __thread thread_slot relax_table[THREAD_SLOTS];
+
+// Decide whether this arrival at the barrier identified by `key` should
+// synchronize. Only every 2^logperiod-th arrival waits, so threads may run
+// up to that many phases apart.
+int accept_barrier_relax(const void *key, int logperiod) {
+    thread_slot *slot = thread_lookup(relax_table, key);
+    if (!slot)
+        return 1;  // Out of slots: conservatively always synchronize.
+    ++slot->count;
+    return (slot->count & ((1UL << logperiod) - 1)) == 0;
+}
+
+
+/**** QUORUM BARRIERS ****/
+
+#if defined(_POSIX_BARRIERS) && _POSIX_BARRIERS > 0
+
+// A quorum barrier shadows an ordinary pthread barrier. The pass redirects
+// pthread_barrier_init to accept_barrier_init so we learn the number of
+// participants, which pthreads does not expose.
+#define QUORUM_BARRIERS 64
+
+typedef struct {
+    const pthread_barrier_t *key;
+    unsigned count;
+    unsigned arrived;
+    unsigned long phase;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+} quorum_barrier;
+
+static quorum_barrier quorum_barriers[QUORUM_BARRIERS];
+static pthread_mutex_t quorum_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The number of phases each thread has completed at each quorum barrier.
+static __thread thread_slot quorum_phases[THREAD_SLOTS];
+
+// The caller must hold quorum_registry_lock.
+static quorum_barrier *quorum_find(const pthread_barrier_t *bar) {
+    unsigned i;
+    for (i = 0; i < QUORUM_BARRIERS; ++i) {
+        if (quorum_barriers[i].key == bar)
+            return &quorum_barriers[i];
+    }
+    return 0;
+}
+
+int accept_barrier_init(pthread_barrier_t *bar,
+                        const pthread_barrierattr_t *attr,
+                        unsigned count) {
+    quorum_barrier *qb;
+    pthread_mutex_lock(&quorum_registry_lock);
+    qb = quorum_find(bar);
+    if (!qb)
+        qb = quorum_find(0);
+    if (qb) {
+        // (Re-)initialize the shadow state.
+        if (!qb->key) {
+            pthread_mutex_init(&qb->lock, 0);
+            pthread_cond_init(&qb->released, 0);
+        }
+        qb->key = bar;
+        qb->count = count;
+        qb->arrived = 0;
+        qb->phase = 0;
+    }
+    pthread_mutex_unlock(&quorum_registry_lock);
+
+    // The real barrier stays usable for precise waits.
+    return pthread_barrier_init(bar, attr, count);
+}
+
+// Wait at a barrier until a quorum of participants has arrived. With
+// parameter p, the quorum is (8 - p) / 8 of the participants. Threads that
+// arrive after their phase has been released do not wait; they join the
+// next phase instead.
+int accept_quorum_barrier_wait(pthread_barrier_t *bar, int param) {
+    quorum_barrier *qb;
+    thread_slot *slot = thread_lookup(quorum_phases, bar);
+    unsigned quorum;
+    int result = 0;
+
+    // Entries are claimed and re-keyed under the registry lock.
+    pthread_mutex_lock(&quorum_registry_lock);
+    qb = quorum_find(bar);
+    pthread_mutex_unlock(&quorum_registry_lock);
+
+    // Barriers we don't know about (or can't track) stay precise.
+    if (!qb || !slot)
+        return pthread_barrier_wait(bar);
+
+    quorum = qb->count - qb->count * param / 8;
+    if (quorum < 1)
+        quorum = 1;
+
+    pthread_mutex_lock(&qb->lock);
+    if (qb->phase > slot->count) {
+        // Straggler: this phase was released without us.
+        ++slot->count;
+    } else if (++qb->arrived >= quorum) {
+        // Last member of the quorum: release everyone waiting.
+        qb->arrived = 0;
+        ++qb->phase;
+        ++slot->count;
+        pthread_cond_broadcast(&qb->released);
+        result = PTHREAD_BARRIER_SERIAL_THREAD;
+    } else {
+        unsigned long phase = qb->phase;
+        while (qb->phase == phase)
+            pthread_cond_wait(&qb->released, &qb->lock);
+        ++slot->count;
+    }
+    pthread_mutex_unlock(&qb->lock);
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,224 @@
+// Fast approximations of libm functions. The ACCEPT pass replaces calls to
+// sin, cos, exp, log, pow, and sqrt (and their float versions) whose results
+// are only used approximately with these. The extra argument is the site's
+// precision level, from 1 (fastest) to 3 (most accurate). It is always a
+// constant, and the functions are always inlined, so each call reduces to
+// the straight-line code for its level.
+//
+// None of these set errno. Special cases (zeros, infinities, NaNs, and
+// negative arguments to log, pow, and sqrt) produce the same values as libm,
+// except that NaNs may lose their sign and payload. Subnormal inputs to sin,
+// exp, and sqrt are handled only roughly. This file must not call
+// libm itself: programs that don't use libm don't link it.
+
+#include <stdint.h>
+#include <string.h>
+
+// Inlined even at -O1, where only the always-inliner runs.
+#define FM_INLINE __attribute__((always_inline))
+
+#define FM_PI 3.14159265358979323846
+#define FM_LN2 0.69314718055994530942
+#define FM_LOG2E 1.44269504088896340736
+#define FM_INF 0x7ff0000000000000ull
+#define FM_ROUND_MAGIC 6755399441055744.0  // 1.5 * 2^52
+
+// 1 / c and log(c) for c = 1 + (j + 1/2) / 16, j = 0 through 15: the centers
+// of the intervals picked by the top four mantissa bits.
+static const double fm_log_inv[] = {
+    0.9696969696969697, 0.9142857142857143, 0.8648648648648649,
+    0.8205128205128205, 0.7804878048780488, 0.7441860465116279,
+    0.7111111111111111, 0.6808510638297872, 0.6530612244897959,
+    0.6274509803921569, 0.6037735849056604, 0.5818181818181818,
+    0.5614035087719298, 0.5423728813559322, 0.5245901639344263,
+    0.5079365079365079,
+};
+static const double fm_log_c[] = {
+    0.030771658666753687, 0.08961215868968714, 0.1451820098444979,
+    0.19782574332991987, 0.24783616390458127, 0.2954642128938359,
+    0.3409265869705932, 0.38441169891033206, 0.4260843953109001,
+    0.46608972992459924, 0.5045560107523953, 0.5415972824327444,
+    0.5773153650348236, 0.6118015411059929, 0.6451379613735847,
+    0.6773988235918061,
+};
+
+static inline uint64_t fm_bits(double x) {
+    uint64_t b;
+    memcpy(&b, &x, sizeof(b));
+    return b;
+}
+
+static inline double fm_double(uint64_t b) {
+    double x;
+    memcpy(&x, &b, sizeof(x));
+    return x;
+}
+
+static inline int fm_level(int level) {
+    return level < 1 ? 1 : (level > 3 ? 3 : level);
+}
+
+// Round to the nearest integer for |x| < 2^51, without a float-to-int
+// conversion (which most SIMD instruction sets lack for 64-bit integers).
+static inline double fm_round(double x) {
+    return (x + FM_ROUND_MAGIC) - FM_ROUND_MAGIC;
+}
+
+// Special cases below are handled with selects rather than early returns so
+// that the functions stay free of branches.
+
+// Taylor series for sin on [-pi/2, pi/2] with 3, 4, or 5 odd terms. The
+// worst-case errors are about 5e-3, 2e-4, and 4e-6.
+FM_INLINE double accept_fast_sin(double x, int level) {
+    double r, r2, p;
+    int terms = fm_level(level) + 2;
+
+    // Reduce to [-pi, pi], then fold onto [-pi/2, pi/2].
+    r = x - fm_round(x * (0.5 / FM_PI)) * (2 * FM_PI);
+    r = r > FM_PI / 2 ? FM_PI - r : r;
+    r = r < -FM_PI / 2 ? -FM_PI - r : r;
+
+    r2 = r * r;
+    p = 0.0;
+    if (terms >= 5)
+        p = 1.0 / 362880;
+    if (terms >= 4)
+        p = p * r2 - 1.0 / 5040;
+    p = p * r2 + 1.0 / 120;
+    p = p * r2 - 1.0 / 6;
+    p = p * r2 + 1.0;
+    return r * p;
+}
+
+FM_INLINE double accept_fast_cos(double x, int level) {
+    return accept_fast_sin(x + FM_PI / 2, level);
+}
+
+// exp(x) = 2^k * exp(r) with |r| <= ln(2)/2. exp(r) is a Taylor polynomial
+// of degree 3, 5, or 7, for relative errors of about 6e-4, 3e-6, and 5e-9.
+FM_INLINE double accept_fast_exp(double x, int level) {
+    double xc, k, r, p, res;
+
+    xc = x > 709.0 ? 709.0 : x;
+    xc = xc < -708.0 ? -708.0 : xc;
+    xc = x == x ? xc : 0.0;
+
+    k = fm_round(xc * FM_LOG2E);
+    r = xc - k * FM_LN2;
+
+    switch (fm_level(level)) {
+    case 1:
+        p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6)));
+        break;
+    case 2:
+        p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 +
+            r * (1.0 / 120)))));
+        break;
+    default:
+        p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 +
+            r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040)))))));
+        break;
+    }
+
+    // The low bits of k + FM_ROUND_MAGIC hold k as an integer.
+    res = p * fm_double((fm_bits(k + FM_ROUND_MAGIC) -
+                         fm_bits(FM_ROUND_MAGIC) + 1023) << 52);
+    res = x > 709.0 ? fm_double(FM_INF) : res;
+    res = x < -708.0 ? 0.0 : res;
+    return x == x ? res : x;
+}
+
+// log(x) = e * ln(2) + log(c) + log(1 + r) with 1 <= m < 2, where c is the
+// center of m's sixteenth of [1, 2) and r = m / c - 1, so |r| < 1/32. The
+// Taylor series for log(1 + r) is truncated to 2, 3, or 5 terms for absolute
+// errors of about 1e-5, 2e-7, and 2e-10.
+FM_INLINE double accept_fast_log(double x, int level) {
+    uint64_t b;
+    int subnormal, j;
+    double e, m, r, p, res;
+
+    // Scale subnormals into the normal range.
+    subnormal = x < 2.2250738585072014e-308;  // DBL_MIN
+    b = fm_bits(subnormal ? x * 18014398509481984.0 : x);  // 2^54
+    // The exponent field, converted to double without an int conversion.
+    e = fm_double(0x4330000000000000ull | ((b >> 52) & 0x7ff)) -
+        (4503599627370496.0 + 1023.0);  // 2^52
+    e = subnormal ? e - 54.0 : e;
+    m = fm_double((b & 0x000fffffffffffffull) | 0x3ff0000000000000ull);
+    j = (b >> 48) & 0xf;
+    r = m * fm_log_inv[j] - 1.0;
+
+    switch (fm_level(level)) {
+    case 1:
+        p = r * (1.0 - r * (1.0 / 2));
+        break;
+    case 2:
+        p = r * (1.0 - r * (1.0 / 2 - r * (1.0 / 3)));
+        break;
+    default:
+        p = r * (1.0 - r * (1.0 / 2 - r * (1.0 / 3 - r * (1.0 / 4 -
+            r * (1.0 / 5)))));
+        break;
+    }
+    res = e * FM_LN2 + fm_log_c[j] + p;
+
+    res = x == fm_double(FM_INF) ? x : res;
+    res = x == 0.0 ? -fm_double(FM_INF) : res;
+    return x < 0.0 || x != x ? fm_double(FM_INF) - fm_double(FM_INF) : res;
+}
+
+// pow(x, y) = exp(y * log(|x|)), with libm's rules for special cases.
+FM_INLINE double accept_fast_pow(double x, double y, int level) {
+    double ax = x < 0.0 ? -x : x;
+    double res = accept_fast_exp(y * accept_fast_log(ax, level), level);
+    double ay = y < 0.0 ? -y : y;
+    double yhalf = fm_round(ay * 0.5);
+    int integral = fm_round(ay) == ay || ay >= 4503599627370496.0;  // 2^52
+    int odd = integral && yhalf * 2.0 != ay && ay < 9007199254740992.0;
+
+    // A negative base needs an integral exponent; odd ones flip the sign.
+    res = x < 0.0 && odd ? -res : res;
+    res = x < 0.0 && !integral ? fm_double(FM_INF) - fm_double(FM_INF) : res;
+    res = x == 0.0 ? (y < 0.0 ? fm_double(FM_INF) : 0.0) : res;
+    return y == 0.0 || x == 1.0 ? 1.0 : res;
+}
+
+// sqrt(x) = x * (1 / sqrt(x)), using the bit-level reciprocal square root
+// estimate and 1, 2, or 3 Newton steps, for relative errors of about 2e-3,
+// 5e-6, and 4e-11.
+FM_INLINE double accept_fast_sqrt(double x, int level) {
+    double y, res;
+    int i;
+
+    y = fm_double(0x5fe6eb50c7b537a9ull - (fm_bits(x) >> 1));
+    for (i = 0; i < fm_level(level); ++i)
+        y = y * (1.5 - 0.5 * x * y * y);
+    res = x * y;
+
+    res = x == 0.0 || x == fm_double(FM_INF) ? x : res;
+    return x < 0.0 || x != x ? fm_double(FM_INF) - fm_double(FM_INF) : res;
+}
+
+FM_INLINE float accept_fast_sinf(float x, int level) {
+    return (float)accept_fast_sin(x, level);
+}
+
+FM_INLINE float accept_fast_cosf(float x, int level) {
+    return (float)accept_fast_cos(x, level);
+}
+
+FM_INLINE float accept_fast_expf(float x, int level) {
+    return (float)accept_fast_exp(x, level);
+}
+
+FM_INLINE float accept_fast_logf(float x, int level) {
+    return (float)accept_fast_log(x, level);
+}
+
+FM_INLINE float accept_fast_powf(float x, float y, int level) {
+    return (float)accept_fast_pow(x, y, level);
+}
+
+FM_INLINE float accept_fast_sqrtf(float x, int level) {
+    return (float)accept_fast_sqrt(x, level);
+}
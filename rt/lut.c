@@ -0,0 +1,111 @@
+// Lookup-table substitution for unary math functions. The ACCEPT pass
+// replaces a call f(x) with accept_lut_f(&state, f, x, logsize) (or the
+// double version). Each site has its own state pointer, which starts out
+// null.
+//
+// The first LUT_PROFILE_CALLS calls at a site run f precisely and record the
+// range of x. The runtime then tabulates f at 2^logsize + 1 evenly spaced
+// points over that range. Later calls interpolate linearly between the two
+// nearest points. Inputs outside the profiled range (and NaNs) still call f.
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#define LUT_PROFILE_CALLS 256
+#define LUT_MAX_LOGSIZE 20
+
+typedef double (*lut_eval_fn)(void *fn, double x);
+
+typedef struct {
+    int ready;  // Set once the table is built; read without the lock.
+    long seen;
+    double lo, hi;
+    double scale;  // Intervals per unit of input.
+    int n;
+    double *table;  // n + 1 entries.
+} lut_state;
+
+static pthread_mutex_t lut_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double lut_eval_f(void *fn, double x) {
+    return ((float (*)(float))fn)((float)x);
+}
+
+static double lut_eval_d(void *fn, double x) {
+    return ((double (*)(double))fn)(x);
+}
+
+// Record an input during profiling. When the profile is complete, build the
+// table. Must be called with lut_lock held.
+static void lut_profile(void **statep, void *fn, lut_eval_fn eval, double x,
+                        int logsize) {
+    lut_state *st = *statep;
+    double *table;
+    int n, i;
+
+    if (!st) {
+        st = calloc(1, sizeof(lut_state));
+        if (!st)
+            return;
+        st->lo = 1.0;  // An empty range.
+        __atomic_store_n(statep, st, __ATOMIC_RELEASE);
+    }
+    if (x == x) {  // Ignore NaNs.
+        if (st->lo > st->hi)
+            st->lo = st->hi = x;
+        else if (x < st->lo)
+            st->lo = x;
+        else if (x > st->hi)
+            st->hi = x;
+    }
+    if (++st->seen < LUT_PROFILE_CALLS || st->lo > st->hi)
+        return;
+
+    if (logsize > LUT_MAX_LOGSIZE)
+        logsize = LUT_MAX_LOGSIZE;
+    n = 1 << logsize;
+    table = malloc((n + 1) * sizeof(double));
+    if (!table)
+        return;  // Keep profiling.
+    for (i = 0; i <= n; ++i)
+        table[i] = eval(fn, st->lo + (st->hi - st->lo) * i / n);
+    st->n = n;
+    st->table = table;
+    st->scale = (st->hi > st->lo) ? n / (st->hi - st->lo) : 0.0;
+    __atomic_store_n(&st->ready, 1, __ATOMIC_RELEASE);
+}
+
+static double lut_lookup(void **statep, void *fn, lut_eval_fn eval,
+                         double x, int logsize) {
+    lut_state *st = __atomic_load_n(statep, __ATOMIC_ACQUIRE);
+    double t, frac;
+    int i;
+
+    if (!st || !__atomic_load_n(&st->ready, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&lut_lock);
+        st = *statep;
+        if (!st || !st->ready)
+            lut_profile(statep, fn, eval, x, logsize);
+        pthread_mutex_unlock(&lut_lock);
+        return eval(fn, x);
+    }
+
+    if (!(x >= st->lo && x <= st->hi))
+        return eval(fn, x);
+
+    t = (x - st->lo) * st->scale;
+    i = (int)t;
+    if (i >= st->n)
+        return st->table[st->n];
+    frac = t - i;
+    return st->table[i] + frac * (st->table[i + 1] - st->table[i]);
+}
+
+float accept_lut_f(void **state, float (*fn)(float), float x, int logsize) {
+    return (float)lut_lookup(state, (void *)fn, lut_eval_f, x, logsize);
+}
+
+double accept_lut_d(void **state, double (*fn)(double), double x,
+                    int logsize) {
+    return lut_lookup(state, (void *)fn, lut_eval_d, x, logsize);
+}
@@ -0,0 +1,70 @@
+// Approximate memoization for the host platform. The ACCEPT pass wraps calls
+// to precise-pure functions in a lookup keyed on the call site and the
+// call's quantized arguments, each widened to 64 bits. Each thread has its
+// own direct-mapped table, so lookups and updates need no synchronization. A
+// colliding update simply evicts the previous entry.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MEMO_SLOTS 4096  // Per thread; a power of two.
+#define MEMO_MAX_ARGS 6
+
+typedef struct {
+    const char *site;
+    int nkey;
+    uint64_t key[MEMO_MAX_ARGS];
+    uint64_t result;
+} memo_entry;
+
+static __thread memo_entry *memo_table;
+static pthread_key_t memo_exit_key;
+static pthread_once_t memo_key_once = PTHREAD_ONCE_INIT;
+
+static void memo_make_key(void) {
+    pthread_key_create(&memo_exit_key, free);
+}
+
+static memo_entry *memo_slot(const char *site, const uint64_t *key,
+                             int nkey) {
+    uint64_t h = (uintptr_t)site * 0x9E3779B97F4A7C15ull;
+    int i;
+
+    if (!memo_table) {
+        pthread_once(&memo_key_once, memo_make_key);
+        memo_table = calloc(MEMO_SLOTS, sizeof(memo_entry));
+        if (!memo_table)
+            return 0;
+        pthread_setspecific(memo_exit_key, memo_table);
+    }
+
+    for (i = 0; i < nkey; ++i)
+        h = (h ^ key[i]) * 0x100000001B3ull;
+    h ^= h >> 29;
+    return &memo_table[h & (MEMO_SLOTS - 1)];
+}
+
+// Look up a call. On a hit, store the cached result and return nonzero.
+int accept_memo_lookup(const char *site, const uint64_t *key, int nkey,
+                       uint64_t *result) {
+    memo_entry *e = memo_slot(site, key, nkey);
+    if (!e || e->site != site || e->nkey != nkey ||
+        memcmp(e->key, key, nkey * sizeof(uint64_t)))
+        return 0;
+    *result = e->result;
+    return 1;
+}
+
+// Record the result of a call that missed.
+void accept_memo_update(const char *site, const uint64_t *key, int nkey,
+                        uint64_t result) {
+    memo_entry *e = memo_slot(site, key, nkey);
+    if (!e || nkey > MEMO_MAX_ARGS)
+        return;
+    e->site = site;
+    e->nkey = nkey;
+    memcpy(e->key, key, nkey * sizeof(uint64_t));
+    e->result = result;
+}
@@ -0,0 +1,514 @@
+// Software NPU for the host platform. With -accept-npu-backend=soft, the
+// ACCEPT pass buffers the inputs of an NPU region's calls into a buffer from
+// accept_npu_ibuff(). When that buffer is full, it calls accept_npu_invoke().
+// Then it reads the results back from accept_npu_obuff(). Instead of talking
+// to hardware, this module evaluates a multilayer perceptron for the region
+// on the CPU, using AVX2 or NEON when the runtime is compiled for them. A
+// buffer of invocations is evaluated as a batch: each layer is a
+// matrix-matrix product over a block of invocations, so every weight row
+// that is loaded is reused across several inputs.
+//
+// With -accept-npu-async, the buffer holds two batches. The pass hands each
+// full batch to accept_npu_submit(), which evaluates it on a worker thread,
+// and keeps marshalling the next batch into the other half. It calls
+// accept_npu_wait() before reading a batch's results, when the next batch is
+// full or when the loop exits.
+//
+// Networks are read from the file named by $ACCEPT_NPU_NETWORKS (default
+// accept_npu.nn), which may describe several regions:
+//
+//     network npu_region at file.c:12
+//     layers 2 8 1
+//     activations sigmoid linear
+//     <weights>
+//     end
+//
+// `layers` gives the neuron counts from the input layer to the output layer.
+// There is one activation per non-input layer: linear, sigmoid, tanh, or relu.
+// Then, for each non-input layer, come its weights as an outputs-by-inputs
+// row-major matrix, followed by one bias per output.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define NPU_MAX_LAYERS 8
+#define NPU_MAX_NAME 256
+#define NPU_DEFAULT_FILE "accept_npu.nn"
+
+// Invocations evaluated together through all layers, sized so that a block's
+// intermediate activations stay in cache.
+#define NPU_BLOCK 64
+
+typedef enum {
+    NPU_LINEAR,
+    NPU_SIGMOID,
+    NPU_TANH,
+    NPU_RELU
+} npu_activation;
+
+typedef struct {
+    int nlayers;  // Including the input layer.
+    int sizes[NPU_MAX_LAYERS];
+    npu_activation activations[NPU_MAX_LAYERS];
+    float *weights[NPU_MAX_LAYERS];
+    float *biases[NPU_MAX_LAYERS];
+    int widest;
+} npu_network;
+
+// Per-call-site state. Sites are keyed on the address of their name string.
+typedef struct npu_region {
+    const char *key;
+    npu_network *net;
+    float *ibuff;
+    long icapacity;
+    float *obuff;
+    long ocapacity;
+    float *scratch;  // Two NPU_BLOCK-by-widest activation matrices.
+
+    // Asynchronous evaluation of buffered invocations
+    // [sub_start, sub_start + submitted).
+    int has_worker;
+    int busy;
+    long sub_start;
+    long submitted;
+    long nin;
+    long nout;
+    float *worker_scratch;
+    pthread_mutex_t wlock;
+    pthread_cond_t wcond;
+
+    struct npu_region *next;
+} npu_region;
+
+static npu_region *npu_regions;
+static pthread_mutex_t npu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void npu_fail(const char *region, const char *msg) {
+    fprintf(stderr, "ACCEPT NPU: %s: %s\n", region, msg);
+    exit(1);
+}
+
+
+/**** KERNELS ****/
+
+// Dot product of a weight row with a layer's input vector.
+static float npu_dot(const float *w, const float *x, int n) {
+    float sum = 0.0f;
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+    float lanes[8];
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(w + i),
+                                               _mm256_loadu_ps(x + i)));
+    _mm256_storeu_ps(lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+          lanes[4] + lanes[5] + lanes[6] + lanes[7];
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    float lanes[4];
+    for (; i + 4 <= n; i += 4)
+        acc = vmlaq_f32(acc, vld1q_f32(w + i), vld1q_f32(x + i));
+    vst1q_f32(lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; ++i)
+        sum += w[i] * x[i];
+    return sum;
+}
+
+static float npu_activate(npu_activation act, float x) {
+    switch (act) {
+    case NPU_SIGMOID:
+        return 1.0f / (1.0f + expf(-x));
+    case NPU_TANH:
+        return tanhf(x);
+    case NPU_RELU:
+        return x > 0.0f ? x : 0.0f;
+    default:
+        return x;
+    }
+}
+
+// Four dot products of one weight row with four input vectors, loading each
+// weight once.
+static void npu_dot4(const float *w, const float *x0, const float *x1,
+                     const float *x2, const float *x3, int n, float *sums) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    float lanes[4][8];
+    int l;
+    for (; i + 8 <= n; i += 8) {
+        __m256 wv = _mm256_loadu_ps(w + i);
+        a0 = _mm256_add_ps(a0, _mm256_mul_ps(wv, _mm256_loadu_ps(x0 + i)));
+        a1 = _mm256_add_ps(a1, _mm256_mul_ps(wv, _mm256_loadu_ps(x1 + i)));
+        a2 = _mm256_add_ps(a2, _mm256_mul_ps(wv, _mm256_loadu_ps(x2 + i)));
+        a3 = _mm256_add_ps(a3, _mm256_mul_ps(wv, _mm256_loadu_ps(x3 + i)));
+    }
+    _mm256_storeu_ps(lanes[0], a0);
+    _mm256_storeu_ps(lanes[1], a1);
+    _mm256_storeu_ps(lanes[2], a2);
+    _mm256_storeu_ps(lanes[3], a3);
+    for (l = 0; l < 8; ++l) {
+        s0 += lanes[0][l];
+        s1 += lanes[1][l];
+        s2 += lanes[2][l];
+        s3 += lanes[3][l];
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f);
+    float32x4_t a2 = vdupq_n_f32(0.0f), a3 = vdupq_n_f32(0.0f);
+    float lanes[4][4];
+    int l;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t wv = vld1q_f32(w + i);
+        a0 = vmlaq_f32(a0, wv, vld1q_f32(x0 + i));
+        a1 = vmlaq_f32(a1, wv, vld1q_f32(x1 + i));
+        a2 = vmlaq_f32(a2, wv, vld1q_f32(x2 + i));
+        a3 = vmlaq_f32(a3, wv, vld1q_f32(x3 + i));
+    }
+    vst1q_f32(lanes[0], a0);
+    vst1q_f32(lanes[1], a1);
+    vst1q_f32(lanes[2], a2);
+    vst1q_f32(lanes[3], a3);
+    for (l = 0; l < 4; ++l) {
+        s0 += lanes[0][l];
+        s1 += lanes[1][l];
+        s2 += lanes[2][l];
+        s3 += lanes[3][l];
+    }
+#endif
+    for (; i < n; ++i) {
+        s0 += w[i] * x0[i];
+        s1 += w[i] * x1[i];
+        s2 += w[i] * x2[i];
+        s3 += w[i] * x3[i];
+    }
+    sums[0] = s0;
+    sums[1] = s1;
+    sums[2] = s2;
+    sums[3] = s3;
+}
+
+// Evaluate layer l for `count` input vectors, `xstride` floats apart in x.
+// Results go to y, `ystride` floats apart.
+static void npu_layer(const npu_network *net, int l, const float *x,
+                      long xstride, float *y, long ystride, long count) {
+    int nin = net->sizes[l - 1];
+    int nout = net->sizes[l];
+    const float *w = net->weights[l];
+    const float *b = net->biases[l];
+    npu_activation act = net->activations[l];
+    long k = 0;
+    int j;
+
+    for (; k + 4 <= count; k += 4) {
+        const float *xk = x + k * xstride;
+        float *yk = y + k * ystride;
+        for (j = 0; j < nout; ++j) {
+            float sums[4];
+            npu_dot4(w + (long)j * nin, xk, xk + xstride, xk + 2 * xstride,
+                     xk + 3 * xstride, nin, sums);
+            yk[j] = npu_activate(act, sums[0] + b[j]);
+            yk[ystride + j] = npu_activate(act, sums[1] + b[j]);
+            yk[2 * ystride + j] = npu_activate(act, sums[2] + b[j]);
+            yk[3 * ystride + j] = npu_activate(act, sums[3] + b[j]);
+        }
+    }
+    for (; k < count; ++k) {
+        for (j = 0; j < nout; ++j) {
+            float v = npu_dot(w + (long)j * nin, x + k * xstride, nin) + b[j];
+            y[k * ystride + j] = npu_activate(act, v);
+        }
+    }
+}
+
+// Evaluate the network on `count` (at most NPU_BLOCK) input vectors. Hidden
+// layers' activations alternate between the two halves of `scratch`.
+static void npu_eval_block(const npu_network *net, const float *in,
+                           float *out, long count, float *scratch) {
+    const float *x = in;
+    long xstride = net->sizes[0];
+    float *y = scratch;
+    int l;
+    for (l = 1; l < net->nlayers; ++l) {
+        int last = (l == net->nlayers - 1);
+        float *dest = last ? out : y;
+        long ystride = last ? net->sizes[l] : net->widest;
+        npu_layer(net, l, x, xstride, dest, ystride, count);
+        x = dest;
+        xstride = ystride;
+        y = (y == scratch) ? scratch + (long)NPU_BLOCK * net->widest : scratch;
+    }
+}
+
+
+/**** NETWORK LOADING ****/
+
+static int npu_parse_activation(const char *name, npu_activation *act) {
+    if (!strcmp(name, "linear"))
+        *act = NPU_LINEAR;
+    else if (!strcmp(name, "sigmoid"))
+        *act = NPU_SIGMOID;
+    else if (!strcmp(name, "tanh"))
+        *act = NPU_TANH;
+    else if (!strcmp(name, "relu"))
+        *act = NPU_RELU;
+    else
+        return 0;
+    return 1;
+}
+
+static int npu_read_floats(FILE *f, float *dest, long n) {
+    long i;
+    for (i = 0; i < n; ++i) {
+        if (fscanf(f, "%f", &dest[i]) != 1)
+            return 0;
+    }
+    return 1;
+}
+
+// Parse the body of a network (everything after its name line).
+static npu_network *npu_read_network(FILE *f, const char *region) {
+    npu_network *net = calloc(1, sizeof(npu_network));
+    char word[64];
+    char line[1024];
+    char *tok;
+    int l;
+
+    // Layer sizes.
+    if (fscanf(f, "%63s", word) != 1 || strcmp(word, "layers"))
+        npu_fail(region, "expected layer sizes");
+    if (!fgets(line, sizeof(line), f))
+        npu_fail(region, "expected layer sizes");
+    for (tok = strtok(line, " \t\n"); tok; tok = strtok(0, " \t\n")) {
+        if (net->nlayers == NPU_MAX_LAYERS)
+            npu_fail(region, "too many layers");
+        net->sizes[net->nlayers] = atoi(tok);
+        if (net->sizes[net->nlayers] <= 0)
+            npu_fail(region, "bad layer size");
+        if (net->sizes[net->nlayers] > net->widest)
+            net->widest = net->sizes[net->nlayers];
+        ++net->nlayers;
+    }
+    if (net->nlayers < 2)
+        npu_fail(region, "need at least an input and an output layer");
+
+    // Activations.
+    if (fscanf(f, "%63s", word) != 1 || strcmp(word, "activations"))
+        npu_fail(region, "expected activations");
+    for (l = 1; l < net->nlayers; ++l) {
+        if (fscanf(f, "%63s", word) != 1 ||
+            !npu_parse_activation(word, &net->activations[l]))
+            npu_fail(region, "bad activation");
+    }
+
+    // Weights and biases.
+    for (l = 1; l < net->nlayers; ++l) {
+        long nw = (long)net->sizes[l] * net->sizes[l - 1];
+        net->weights[l] = malloc(nw * sizeof(float));
+        net->biases[l] = malloc(net->sizes[l] * sizeof(float));
+        if (!npu_read_floats(f, net->weights[l], nw) ||
+            !npu_read_floats(f, net->biases[l], net->sizes[l]))
+            npu_fail(region, "too few weights");
+    }
+    if (fscanf(f, "%63s", word) != 1 || strcmp(word, "end"))
+        npu_fail(region, "expected end of network");
+
+    return net;
+}
+
+// Find the network for a region in the network file.
+static npu_network *npu_load(const char *region) {
+    const char *fn = getenv("ACCEPT_NPU_NETWORKS");
+    char word[64];
+    char name[NPU_MAX_NAME];
+    FILE *f;
+
+    if (!fn)
+        fn = NPU_DEFAULT_FILE;
+    f = fopen(fn, "r");
+    if (!f)
+        npu_fail(region, "could not open network file");
+
+    while (fscanf(f, "%63s", word) == 1) {
+        size_t len;
+        if (strcmp(word, "network"))
+            continue;
+        if (!fgets(name, sizeof(name), f))
+            break;
+        len = strlen(name);
+        while (len && (name[len - 1] == '\n' || name[len - 1] == ' '))
+            name[--len] = '\0';
+        if (!strcmp(name + strspn(name, " \t"), region)) {
+            npu_network *net = npu_read_network(f, region);
+            fclose(f);
+            return net;
+        }
+    }
+
+    fclose(f);
+    npu_fail(region, "no network for this region");
+    return 0;
+}
+
+static npu_region *npu_find(const char *key) {
+    npu_region *r;
+    pthread_mutex_lock(&npu_lock);
+    for (r = npu_regions; r; r = r->next) {
+        if (r->key == key)
+            break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(npu_region));
+        r->key = key;
+        pthread_mutex_init(&r->wlock, 0);
+        pthread_cond_init(&r->wcond, 0);
+        r->net = npu_load(key);
+        r->next = npu_regions;
+        npu_regions = r;
+    }
+    pthread_mutex_unlock(&npu_lock);
+    return r;
+}
+
+
+// Evaluate buffered invocations [start, end) in blocks.
+static void npu_eval_range(npu_region *r, long start, long end, long nin,
+                           long nout, float *scratch) {
+    long i;
+    for (i = start; i < end; i += NPU_BLOCK) {
+        long count = end - i < NPU_BLOCK ? end - i : NPU_BLOCK;
+        npu_eval_block(r->net, r->ibuff + i * nin, r->obuff + i * nout, count,
+                       scratch);
+    }
+}
+
+static float *npu_alloc_scratch(const npu_network *net) {
+    return malloc(2 * (long)NPU_BLOCK * net->widest * sizeof(float));
+}
+
+static void npu_check_shape(npu_region *r, long nin, long nout) {
+    npu_network *net = r->net;
+    if (net->sizes[0] != nin || net->sizes[net->nlayers - 1] != nout)
+        npu_fail(r->key, "network shape does not match the region");
+}
+
+static void npu_reserve_obuff(npu_region *r, long n) {
+    if (r->ocapacity < n) {
+        free(r->obuff);
+        r->obuff = malloc(n * sizeof(float));
+        r->ocapacity = n;
+    }
+}
+
+static void *npu_worker(void *arg) {
+    npu_region *r = arg;
+    pthread_mutex_lock(&r->wlock);
+    for (;;) {
+        while (!r->busy)
+            pthread_cond_wait(&r->wcond, &r->wlock);
+        pthread_mutex_unlock(&r->wlock);
+
+        npu_eval_range(r, r->sub_start, r->sub_start + r->submitted, r->nin,
+                       r->nout, r->worker_scratch);
+
+        pthread_mutex_lock(&r->wlock);
+        r->busy = 0;
+        pthread_cond_broadcast(&r->wcond);
+    }
+    return 0;
+}
+
+
+/**** INTERFACE ****/
+
+static void npu_wait(npu_region *r) {
+    pthread_mutex_lock(&r->wlock);
+    while (r->busy)
+        pthread_cond_wait(&r->wcond, &r->wlock);
+    pthread_mutex_unlock(&r->wlock);
+}
+
+// Get the input buffer for a region, which holds `capacity` floats.
+float *accept_npu_ibuff(const char *region, long capacity) {
+    npu_region *r = npu_find(region);
+    if (r->icapacity < capacity) {
+        npu_wait(r);
+        free(r->ibuff);
+        r->ibuff = malloc(capacity * sizeof(float));
+        r->icapacity = capacity;
+    }
+    return r->ibuff;
+}
+
+// Start evaluating buffered invocations [start, start + ncalls) in the
+// background. An earlier submission must have been waited for.
+void accept_npu_submit(const char *region, long start, long ncalls, long nin,
+                       long nout) {
+    npu_region *r = npu_find(region);
+    if (!ncalls)
+        return;
+    npu_check_shape(r, nin, nout);
+
+    // The worker writes into the output buffer, so it must already be large
+    // enough for the whole input buffer.
+    npu_reserve_obuff(r, r->icapacity / nin * nout);
+    if (!r->worker_scratch)
+        r->worker_scratch = npu_alloc_scratch(r->net);
+    if (!r->has_worker) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, npu_worker, r)) {
+            // No thread: just evaluate these invocations now.
+            npu_eval_range(r, start, start + ncalls, nin, nout,
+                           r->worker_scratch);
+            return;
+        }
+        pthread_detach(thread);
+        r->has_worker = 1;
+    }
+
+    pthread_mutex_lock(&r->wlock);
+    r->sub_start = start;
+    r->submitted = ncalls;
+    r->nin = nin;
+    r->nout = nout;
+    r->busy = 1;
+    pthread_cond_signal(&r->wcond);
+    pthread_mutex_unlock(&r->wlock);
+}
+
+// Wait for the region's submitted invocations to finish.
+void accept_npu_wait(const char *region) {
+    npu_wait(npu_find(region));
+}
+
+// Run the region's network on `ncalls` buffered invocations, each with `nin`
+// inputs and `nout` outputs.
+void accept_npu_invoke(const char *region, long ncalls, long nin, long nout) {
+    npu_region *r = npu_find(region);
+    npu_check_shape(r, nin, nout);
+
+    npu_wait(r);
+    npu_reserve_obuff(r, ncalls * nout);
+    if (!r->scratch)
+        r->scratch = npu_alloc_scratch(r->net);
+    npu_eval_range(r, 0, ncalls, nin, nout, r->scratch);
+}
+
+// Get the output buffer, valid after accept_npu_invoke.
+float *accept_npu_obuff(const char *region) {
+    return npu_find(region)->obuff;
+}
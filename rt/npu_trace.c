@@ -0,0 +1,157 @@
+// Input/output tracing for NPU candidate calls. With -accept-npu-trace, the
+// ACCEPT pass leaves NPU-able calls in place but records each call's
+// marshalled inputs and its outputs. These come as float vectors, laid out
+// exactly as the NPU sees them. The traces are used to train the networks
+// that replace the calls.
+//
+// Each thread collects samples in its own buffer and appends whole buffers
+// to the trace file (accept_npu_trace.bin, or $ACCEPT_NPU_TRACE). The file is
+// a sequence of little-endian records:
+//
+//     'R' u32 id, u32 nin, u32 nout, u32 namelen, name   -- region definition
+//     'S' u32 id, float in[nin], float out[nout]          -- one sample
+//
+// A region's definition always precedes its samples.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define TRACE_DEFAULT_FILE "accept_npu_trace.bin"
+#define TRACE_BUFFER_SIZE (256 * 1024)
+#define TRACE_CACHE_SLOTS 16
+
+typedef struct trace_region {
+    const char *key;
+    uint32_t id;
+    struct trace_region *next;
+} trace_region;
+
+typedef struct {
+    char data[TRACE_BUFFER_SIZE];
+    size_t used;
+    const char *cache_keys[TRACE_CACHE_SLOTS];
+    uint32_t cache_ids[TRACE_CACHE_SLOTS];
+} trace_buffer;
+
+static FILE *trace_file;
+static trace_region *trace_regions;
+static uint32_t trace_next_id;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_exit_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_buffer *trace_mine;
+
+// Must be called with trace_lock held.
+static FILE *trace_open(void) {
+    if (!trace_file) {
+        const char *fn = getenv("ACCEPT_NPU_TRACE");
+        trace_file = fopen(fn ? fn : TRACE_DEFAULT_FILE, "wb");
+        if (!trace_file) {
+            perror("ACCEPT NPU trace");
+            exit(1);
+        }
+    }
+    return trace_file;
+}
+
+static void trace_flush(trace_buffer *buf) {
+    if (!buf->used)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    fwrite(buf->data, 1, buf->used, trace_open());
+    pthread_mutex_unlock(&trace_lock);
+    buf->used = 0;
+}
+
+static void trace_thread_exit(void *buf) {
+    trace_flush(buf);
+    free(buf);
+}
+
+// The main thread doesn't run key destructors when the process exits.
+static void trace_process_exit(void) {
+    if (trace_mine)
+        trace_flush(trace_mine);
+    // Other threads may still be tracing, so leave the file open.
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file)
+        fflush(trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_make_key(void) {
+    pthread_key_create(&trace_exit_key, trace_thread_exit);
+    atexit(trace_process_exit);
+}
+
+static void trace_put(trace_buffer *buf, const void *data, size_t size) {
+    memcpy(buf->data + buf->used, data, size);
+    buf->used += size;
+}
+
+// Get the id for a region, writing its definition the first time.
+static uint32_t trace_region_id(trace_buffer *buf, const char *key,
+                                uint32_t nin, uint32_t nout) {
+    unsigned slot = ((uintptr_t)key >> 3) % TRACE_CACHE_SLOTS;
+    trace_region *r;
+
+    if (buf->cache_keys[slot] == key)
+        return buf->cache_ids[slot];
+
+    pthread_mutex_lock(&trace_lock);
+    for (r = trace_regions; r; r = r->next) {
+        if (r->key == key)
+            break;
+    }
+    if (!r) {
+        uint32_t header[4];
+        char tag = 'R';
+        FILE *f = trace_open();
+        r = malloc(sizeof(trace_region));
+        r->key = key;
+        r->id = trace_next_id++;
+        r->next = trace_regions;
+        trace_regions = r;
+
+        header[0] = r->id;
+        header[1] = nin;
+        header[2] = nout;
+        header[3] = strlen(key);
+        fwrite(&tag, 1, 1, f);
+        fwrite(header, sizeof(uint32_t), 4, f);
+        fwrite(key, 1, header[3], f);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    buf->cache_keys[slot] = key;
+    buf->cache_ids[slot] = r->id;
+    return r->id;
+}
+
+void accept_npu_trace(const char *region, const float *in, long nin,
+                      const float *out, long nout) {
+    trace_buffer *buf = trace_mine;
+    size_t size = 1 + sizeof(uint32_t) + (nin + nout) * sizeof(float);
+    uint32_t id;
+    char tag = 'S';
+
+    if (!buf) {
+        pthread_once(&trace_key_once, trace_make_key);
+        buf = trace_mine = calloc(1, sizeof(trace_buffer));
+        pthread_setspecific(trace_exit_key, buf);
+    }
+    if (size > TRACE_BUFFER_SIZE)
+        return;  // Absurdly large sample; drop it.
+
+    id = trace_region_id(buf, region, nin, nout);
+    if (buf->used + size > TRACE_BUFFER_SIZE)
+        trace_flush(buf);
+
+    trace_put(buf, &tag, 1);
+    trace_put(buf, &id, sizeof(uint32_t));
+    trace_put(buf, in, nin * sizeof(float));
+    trace_put(buf, out, nout * sizeof(float));
+}
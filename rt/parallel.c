@@ -0,0 +1,127 @@
+// Approximate parallelization for the host platform. The ACCEPT pass outlines
+// a parallelizable loop and replaces it with a call to accept_par_run(),
+// which runs the outlined loop on every thread of a pool. Each thread runs
+// the loop's control in full and calls accept_par_claim() to claim chunks of
+// the body's iterations from a counter shared by the run.
+//
+// The pool size comes from $ACCEPT_THREADS (default: the number of online
+// processors). The calling thread participates in each run. A run started
+// while another is in progress (including a nested one) executes on the
+// calling thread alone.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PAR_MAX_THREADS 64
+
+typedef struct {
+    void (*fn)(void *);
+    void *env;
+    int64_t next_chunk;
+} par_job;
+
+static pthread_once_t par_once = PTHREAD_ONCE_INIT;
+static int par_nthreads = 1;  // Including the caller.
+
+// The pool's current job. Workers wait for the generation to change, run the
+// job, and count themselves out.
+static pthread_mutex_t par_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t par_done = PTHREAD_COND_INITIALIZER;
+static par_job par_pool_job;
+static unsigned long par_generation;
+static int par_running;
+
+static __thread par_job *par_current;
+
+static void par_execute(par_job *job) {
+    par_job *outer = par_current;
+    par_current = job;
+    job->fn(job->env);
+    par_current = outer;
+}
+
+static void *par_worker(void *arg) {
+    unsigned long seen = 0;
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&par_lock);
+        while (par_generation == seen)
+            pthread_cond_wait(&par_start, &par_lock);
+        seen = par_generation;
+        pthread_mutex_unlock(&par_lock);
+
+        par_execute(&par_pool_job);
+
+        pthread_mutex_lock(&par_lock);
+        if (--par_running == 0)
+            pthread_cond_signal(&par_done);
+        pthread_mutex_unlock(&par_lock);
+    }
+    return 0;
+}
+
+static void par_init(void) {
+    const char *env = getenv("ACCEPT_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_t attr;
+    int i;
+
+    if (n < 1)
+        n = 1;
+    if (n > PAR_MAX_THREADS)
+        n = PAR_MAX_THREADS;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 1; i < n; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, par_worker, 0))
+            break;
+    }
+    pthread_attr_destroy(&attr);
+    par_nthreads = i;
+}
+
+// Run an outlined loop on the pool and wait for every thread to finish it.
+void accept_par_run(void (*fn)(void *), void *env) {
+    pthread_once(&par_once, par_init);
+
+    if (par_current || par_nthreads == 1 ||
+        pthread_mutex_trylock(&par_run_lock)) {
+        par_job job;
+        job.fn = fn;
+        job.env = env;
+        job.next_chunk = 0;
+        par_execute(&job);
+        return;
+    }
+
+    pthread_mutex_lock(&par_lock);
+    par_pool_job.fn = fn;
+    par_pool_job.env = env;
+    par_pool_job.next_chunk = 0;
+    par_running = par_nthreads - 1;
+    ++par_generation;
+    pthread_cond_broadcast(&par_start);
+    pthread_mutex_unlock(&par_lock);
+
+    par_execute(&par_pool_job);
+
+    pthread_mutex_lock(&par_lock);
+    while (par_running)
+        pthread_cond_wait(&par_done, &par_lock);
+    pthread_mutex_unlock(&par_lock);
+    pthread_mutex_unlock(&par_run_lock);
+}
+
+// Claim the next chunk of the current run's iterations.
+int64_t accept_par_claim(void) {
+    static __thread int64_t serial_chunk;
+    if (!par_current)
+        return serial_chunk++;
+    return __atomic_fetch_add(&par_current->next_chunk, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,187 @@
+// Privatized approximate reductions for the host platform. The ACCEPT pass
+// replaces a mutex-protected `shared += x` with a call that accumulates into a
+// per-thread partial sum instead. Partials are merged into the shared
+// variable (under the original mutex) every 2^logperiod updates, whenever the
+// thread reaches a barrier, and when the thread exits. Key destructors don't
+// run for the main thread, so its partials are merged at the end of the ROI
+// and at process exit.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define REDUCE_SLOTS 64
+#define REDUCE_CACHE_LINE 64
+
+// Logarithmic periods at or above this value only merge at barriers and at
+// thread exit.
+#define REDUCE_MERGE_NEVER 8
+
+enum reduce_type {
+    REDUCE_I32,
+    REDUCE_I64,
+    REDUCE_F32,
+    REDUCE_F64
+};
+
+// One per-thread partial, padded to a cache line so partials never share
+// lines with each other.
+typedef struct {
+    void *shared;
+    pthread_mutex_t *lock;
+    enum reduce_type type;
+    unsigned long count;
+    union {
+        int64_t i;
+        double f;
+    } partial;
+} reduce_state;
+
+typedef union {
+    reduce_state state;
+    char pad[REDUCE_CACHE_LINE];
+} reduce_slot;
+
+static __thread reduce_slot reduce_partials[REDUCE_SLOTS]
+    __attribute__((aligned(REDUCE_CACHE_LINE)));
+static __thread int reduce_registered;
+
+static pthread_key_t reduce_exit_key;
+static pthread_once_t reduce_key_once = PTHREAD_ONCE_INIT;
+
+// Fold one partial into its shared variable.
+static void reduce_merge(reduce_state *st) {
+    if (!st->count)
+        return;
+    pthread_mutex_lock(st->lock);
+    switch (st->type) {
+    case REDUCE_I32:
+        *(int32_t *)st->shared += (int32_t)st->partial.i;
+        break;
+    case REDUCE_I64:
+        *(int64_t *)st->shared += st->partial.i;
+        break;
+    case REDUCE_F32:
+        *(float *)st->shared += (float)st->partial.f;
+        break;
+    case REDUCE_F64:
+        *(double *)st->shared += st->partial.f;
+        break;
+    }
+    pthread_mutex_unlock(st->lock);
+    st->partial.i = 0;
+    st->partial.f = 0.0;
+    st->count = 0;
+}
+
+// Merge all of the calling thread's partials.
+void accept_reduce_flush(void) {
+    unsigned i;
+    for (i = 0; i < REDUCE_SLOTS; ++i) {
+        if (reduce_partials[i].state.shared)
+            reduce_merge(&reduce_partials[i].state);
+    }
+}
+
+static void reduce_thread_exit(void *unused) {
+    (void)unused;
+    accept_reduce_flush();
+}
+
+static void reduce_make_key(void) {
+    pthread_key_create(&reduce_exit_key, reduce_thread_exit);
+    atexit(accept_reduce_flush);
+}
+
+// Find (or claim) the calling thread's partial for a shared variable. Returns
+// null when the table is full.
+static reduce_state *reduce_lookup(void *shared, pthread_mutex_t *lock,
+                                   enum reduce_type type) {
+    uintptr_t hash = ((uintptr_t)shared >> 2) * 2654435761u;
+    unsigned i;
+
+    // Arrange for the partials to be merged when this thread exits. The key
+    // value only needs to be non-null for the destructor to run.
+    if (!reduce_registered) {
+        pthread_once(&reduce_key_once, reduce_make_key);
+        pthread_setspecific(reduce_exit_key, reduce_partials);
+        reduce_registered = 1;
+    }
+
+    for (i = 0; i < REDUCE_SLOTS; ++i) {
+        reduce_state *st = &reduce_partials[(hash + i) % REDUCE_SLOTS].state;
+        if (st->shared == shared)
+            return st;
+        if (!st->shared) {
+            st->shared = shared;
+            st->lock = lock;
+            st->type = type;
+            return st;
+        }
+    }
+    return 0;
+}
+
+static int reduce_should_merge(reduce_state *st, int logperiod) {
+    ++st->count;
+    if (logperiod >= REDUCE_MERGE_NEVER)
+        return 0;
+    return (st->count & ((1UL << logperiod) - 1)) == 0;
+}
+
+void accept_reduce_add_i32(void *shared, int32_t x, void *lock,
+                           int logperiod) {
+    reduce_state *st = reduce_lookup(shared, lock, REDUCE_I32);
+    if (!st) {
+        // Out of slots: fall back to the precise update.
+        pthread_mutex_lock(lock);
+        *(int32_t *)shared += x;
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    st->partial.i += x;
+    if (reduce_should_merge(st, logperiod))
+        reduce_merge(st);
+}
+
+void accept_reduce_add_i64(void *shared, int64_t x, void *lock,
+                           int logperiod) {
+    reduce_state *st = reduce_lookup(shared, lock, REDUCE_I64);
+    if (!st) {
+        pthread_mutex_lock(lock);
+        *(int64_t *)shared += x;
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    st->partial.i += x;
+    if (reduce_should_merge(st, logperiod))
+        reduce_merge(st);
+}
+
+void accept_reduce_add_f32(void *shared, float x, void *lock,
+                           int logperiod) {
+    reduce_state *st = reduce_lookup(shared, lock, REDUCE_F32);
+    if (!st) {
+        pthread_mutex_lock(lock);
+        *(float *)shared += x;
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    st->partial.f += x;
+    if (reduce_should_merge(st, logperiod))
+        reduce_merge(st);
+}
+
+void accept_reduce_add_f64(void *shared, double x, void *lock,
+                           int logperiod) {
+    reduce_state *st = reduce_lookup(shared, lock, REDUCE_F64);
+    if (!st) {
+        pthread_mutex_lock(lock);
+        *(double *)shared += x;
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    st->partial.f += x;
+    if (reduce_should_merge(st, logperiod))
+        reduce_merge(st);
+}
@@ -0,0 +1,181 @@
+// Synchronization contention profiling for the host platform. When built with
+// -accept-syncprof, the ACCEPT pass brackets each relaxable lock and barrier
+// site with calls into this module, identifying sites by their configuration
+// names. Each thread records acquisition counts, wait and hold times, and
+// log2-scaled histograms of both. accept_roi_end() writes the totals to
+// accept_syncprof.txt.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SYNCPROF_SLOTS 64
+#define SYNCPROF_BUCKETS 32
+
+typedef struct {
+    const char *site;
+    unsigned long count;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t wait_start;
+    uint64_t hold_start;
+    unsigned long wait_hist[SYNCPROF_BUCKETS];
+    unsigned long hold_hist[SYNCPROF_BUCKETS];
+} syncprof_site;
+
+// Threads' tables are heap-allocated and never freed so they can be
+// collected after the threads exit.
+typedef struct syncprof_thread {
+    syncprof_site sites[SYNCPROF_SLOTS];
+    struct syncprof_thread *next;
+} syncprof_thread;
+
+static syncprof_thread *syncprof_threads;
+static pthread_mutex_t syncprof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread syncprof_thread *syncprof_mine;
+
+static uint64_t syncprof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned syncprof_bucket(uint64_t ns) {
+    unsigned b = 0;
+    while (ns > 1 && b < SYNCPROF_BUCKETS - 1) {
+        ns >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+static syncprof_site *syncprof_lookup(const char *site) {
+    uintptr_t hash = ((uintptr_t)site >> 3) * 2654435761u;
+    unsigned i;
+
+    if (!syncprof_mine) {
+        syncprof_mine = calloc(1, sizeof(syncprof_thread));
+        if (!syncprof_mine)
+            return 0;
+        pthread_mutex_lock(&syncprof_lock);
+        syncprof_mine->next = syncprof_threads;
+        syncprof_threads = syncprof_mine;
+        pthread_mutex_unlock(&syncprof_lock);
+    }
+
+    for (i = 0; i < SYNCPROF_SLOTS; ++i) {
+        syncprof_site *s = &syncprof_mine->sites[(hash + i) % SYNCPROF_SLOTS];
+        if (s->site == site)
+            return s;
+        if (!s->site) {
+            s->site = site;
+            return s;
+        }
+    }
+    return 0;
+}
+
+// Called just before a thread tries to acquire a lock or enter a barrier.
+void accept_syncprof_wait(const char *site) {
+    syncprof_site *s = syncprof_lookup(site);
+    if (s)
+        s->wait_start = syncprof_now();
+}
+
+// Called once the lock is held or the barrier has released the thread.
+void accept_syncprof_acquired(const char *site) {
+    syncprof_site *s = syncprof_lookup(site);
+    uint64_t now, wait;
+    if (!s)
+        return;
+    now = syncprof_now();
+    wait = now - s->wait_start;
+    ++s->count;
+    s->wait_ns += wait;
+    ++s->wait_hist[syncprof_bucket(wait)];
+    s->hold_start = now;
+}
+
+// Called after the matching lock release.
+void accept_syncprof_released(const char *site) {
+    syncprof_site *s = syncprof_lookup(site);
+    uint64_t hold;
+    if (!s)
+        return;
+    hold = syncprof_now() - s->hold_start;
+    s->hold_ns += hold;
+    ++s->hold_hist[syncprof_bucket(hold)];
+}
+
+static void syncprof_write_hist(FILE *f, const unsigned long *hist) {
+    unsigned i;
+    for (i = 0; i < SYNCPROF_BUCKETS; ++i)
+        fprintf(f, i ? ",%lu" : "%lu", hist[i]);
+}
+
+// Sum the per-thread tables and write one line per site:
+//   site <tab> count <tab> wait (s) <tab> hold (s) <tab> wait hist <tab> hold
+// hist. Histogram bucket b counts durations of about 2^b nanoseconds. Threads
+// still running may be mid-update; this is a profile, so that's tolerated.
+void accept_syncprof_dump(void) {
+    syncprof_site total;
+    syncprof_thread *t, *u;
+    unsigned i, j, b;
+    FILE *f;
+
+    if (!syncprof_threads)
+        return;
+    f = fopen("accept_syncprof.txt", "w");
+    if (!f)
+        return;
+
+    pthread_mutex_lock(&syncprof_lock);
+    for (t = syncprof_threads; t; t = t->next) {
+        for (i = 0; i < SYNCPROF_SLOTS; ++i) {
+            const char *site = t->sites[i].site;
+            int seen = 0;
+            if (!site)
+                continue;
+
+            // Only the first thread with a site reports it.
+            for (u = syncprof_threads; u != t && !seen; u = u->next) {
+                for (j = 0; j < SYNCPROF_SLOTS; ++j) {
+                    if (u->sites[j].site == site) {
+                        seen = 1;
+                        break;
+                    }
+                }
+            }
+            if (seen)
+                continue;
+
+            total = t->sites[i];
+            for (u = t->next; u; u = u->next) {
+                for (j = 0; j < SYNCPROF_SLOTS; ++j) {
+                    syncprof_site *s = &u->sites[j];
+                    if (s->site != site)
+                        continue;
+                    total.count += s->count;
+                    total.wait_ns += s->wait_ns;
+                    total.hold_ns += s->hold_ns;
+                    for (b = 0; b < SYNCPROF_BUCKETS; ++b) {
+                        total.wait_hist[b] += s->wait_hist[b];
+                        total.hold_hist[b] += s->hold_hist[b];
+                    }
+                }
+            }
+
+            fprintf(f, "%s\t%lu\t%f\t%f\t", site, total.count,
+                    total.wait_ns * 1e-9, total.hold_ns * 1e-9);
+            syncprof_write_hist(f, total.wait_hist);
+            fprintf(f, "\t");
+            syncprof_write_hist(f, total.hold_hist);
+            fprintf(f, "\n");
+        }
+    }
+    pthread_mutex_unlock(&syncprof_lock);
+
+    fclose(f);
+}
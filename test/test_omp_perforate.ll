@@ -0,0 +1,77 @@
+; RUN: rm -rf %t && mkdir -p %t && cd %t && opt -O1 %s -o /dev/null && FileCheck --check-prefix=LOG %s < accept_log.txt
+; RUN: cd %t && sed -i.bak 's/^0 loop/1 loop/' accept_config.txt && opt -O1 -accept-relax -print-before=simplifycfg %s -o /dev/null 2>&1 | FileCheck %s
+
+; The body of "#pragma omp parallel for" as clang outlines it: the thread's
+; range of normalized iterations comes from __kmpc_for_static_init_4 in
+; .omp.lb and .omp.ub, and .omp.iv counts from .omp.lb. Perforation must
+; test .omp.iv, the global iteration number, instead of a new counter that
+; starts at zero in every thread.
+
+; LOG: OpenMP worksharing loop
+; LOG: can perforate loop
+
+; CHECK: define void @.omp_outlined.
+; CHECK-NOT: accept_counter
+; CHECK: accept_cond:
+; CHECK-NEXT: %accept_tmp = load i32* %.omp.iv
+; CHECK-NEXT: %accept_trunc = trunc i32 %accept_tmp to i1
+
+%ident_t = type { i32, i32, i32, i32, i8* }
+
+define void @.omp_outlined.(i32* noalias %.global_tid., i32* noalias %.bound_tid., i32 %n, float* %a) nounwind {
+entry:
+  %.omp.iv = alloca i32, align 4
+  %.omp.lb = alloca i32, align 4
+  %.omp.ub = alloca i32, align 4
+  %.omp.stride = alloca i32, align 4
+  %.omp.is_last = alloca i32, align 4
+  %i = alloca i32, align 4
+  %last = sub nsw i32 %n, 1
+  store i32 0, i32* %.omp.lb, align 4
+  store i32 %last, i32* %.omp.ub, align 4
+  store i32 1, i32* %.omp.stride, align 4
+  store i32 0, i32* %.omp.is_last, align 4
+  %tid = load i32* %.global_tid., align 4
+  call void @__kmpc_for_static_init_4(%ident_t* null, i32 %tid, i32 34, i32* %.omp.is_last, i32* %.omp.lb, i32* %.omp.ub, i32* %.omp.stride, i32 1, i32 1)
+  %ub = load i32* %.omp.ub, align 4
+  %ub.big = icmp sgt i32 %ub, %last
+  %ub.clamped = select i1 %ub.big, i32 %last, i32 %ub
+  store i32 %ub.clamped, i32* %.omp.ub, align 4
+  %lb = load i32* %.omp.lb, align 4
+  store i32 %lb, i32* %.omp.iv, align 4
+  br label %omp.inner.for.cond
+
+omp.inner.for.cond:
+  %iv = load i32* %.omp.iv, align 4
+  %ub.cur = load i32* %.omp.ub, align 4
+  %more = icmp sle i32 %iv, %ub.cur
+  br i1 %more, label %omp.inner.for.body, label %omp.inner.for.end
+
+omp.inner.for.body:
+  %iv.body = load i32* %.omp.iv, align 4
+  %mul = mul nsw i32 %iv.body, 1
+  %add = add nsw i32 0, %mul
+  store i32 %add, i32* %i, align 4, !quals !1
+  %i.val = load i32* %i, align 4, !quals !1
+  %idx = sext i32 %i.val to i64
+  %arrayidx = getelementptr inbounds float* %a, i64 %idx
+  store float 1.000000e+00, float* %arrayidx, align 4, !quals !0
+  br label %omp.inner.for.inc
+
+omp.inner.for.inc:
+  %iv.inc = load i32* %.omp.iv, align 4
+  %next = add nsw i32 %iv.inc, 1
+  store i32 %next, i32* %.omp.iv, align 4
+  br label %omp.inner.for.cond
+
+omp.inner.for.end:
+  call void @__kmpc_for_static_fini(%ident_t* null, i32 %tid)
+  ret void
+}
+
+declare void @__kmpc_for_static_init_4(%ident_t*, i32, i32, i32*, i32*, i32*, i32*, i32, i32)
+
+declare void @__kmpc_for_static_fini(%ident_t*, i32)
+
+!0 = metadata !{i32 1}
+!1 = metadata !{i32 0}
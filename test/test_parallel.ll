@@ -0,0 +1,59 @@
+; RUN: rm -rf %t && mkdir -p %t && cd %t && opt -O1 %s -o /dev/null && FileCheck --check-prefix=LOG %s < accept_log.txt
+; RUN: cd %t && sed -i.bak 's/^0 parallel/2 parallel/' accept_config.txt && opt -O1 -accept-relax -print-before=simplifycfg %s -o /dev/null 2>&1 | FileCheck %s
+
+; A loop that fills an approximate array. The induction variable is written
+; by the loop and initialized before it, so each thread gets a private copy
+; that starts with its value. At parameter 2, threads claim chunks of four
+; iterations.
+
+; LOG: parallel at
+; LOG: 1 private variables
+; LOG: can parallelize
+
+; CHECK: define void @fill(float* %a)
+; CHECK-NOT: for.body:
+; CHECK: call void @accept_par_run({{.*}}@accept_par_fill
+
+; CHECK: define internal void @accept_par_fill(
+; CHECK: %i.private = alloca i32
+; CHECK: store i32 {{%[^,]+}}, i32* %i.private
+; CHECK: call i64 @accept_par_claim()
+; CHECK: accept_par_check:
+; CHECK: %accept_par_chunk = lshr i64 {{%[^,]+}}, 2
+; CHECK: br i1 {{%[^,]+}}, label %accept_par_claim, label %accept_par_own
+; CHECK: accept_par_claim:
+; CHECK-NEXT: {{%[^ ]+}} = call i64 @accept_par_claim()
+; CHECK: accept_par_own:
+; CHECK: br i1 {{%[^,]+}}, label %for.body, label %for.inc
+; CHECK: for.body:
+; CHECK: store float 1.000000e+00
+
+define void @fill(float* %a) nounwind {
+entry:
+  %i = alloca i32, align 4
+  store i32 0, i32* %i, align 4
+  br label %for.cond
+
+for.cond:
+  %iv = load i32* %i, align 4
+  %cmp = icmp slt i32 %iv, 100
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %iv.body = load i32* %i, align 4
+  %idx = sext i32 %iv.body to i64
+  %arrayidx = getelementptr inbounds float* %a, i64 %idx
+  store float 1.000000e+00, float* %arrayidx, align 4, !quals !0
+  br label %for.inc
+
+for.inc:
+  %iv.inc = load i32* %i, align 4
+  %next = add nsw i32 %iv.inc, 1
+  store i32 %next, i32* %i, align 4
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+!0 = metadata !{i32 1}